@@ -0,0 +1,388 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "src/neuralnetwork.hpp"
+
+// benchmarks of every layer and of the example networks on generated data
+//   ./benchmark                           all of them, one line per benchmark as TSV
+//   ./benchmark -q                        fewer iterations
+//   ./benchmark -f conv                   only the benchmarks whose name contains conv
+//   ./benchmark -o baseline.tsv           writes the results to a file as well
+//   ./benchmark -c baseline.tsv -t 0.1    compares the p50 latencies with a saved run,
+//                                         the exit status is 1 when one is more than 10% slower
+// every line is name, phase, batch size, samples/s and GFLOP/s at the median
+// latency, and the median and 99th percentile latencies in microseconds
+
+struct Result {
+  std::string name;
+  std::string phase;
+  int batch;
+  double p50, p99; // seconds
+  double flops;
+};
+
+double min_time = 0.3;   // per benchmark, in seconds
+int min_iterations = 10;
+std::string filter;
+std::vector<Result> results;
+std::mt19937 engine( 1 );
+
+vec random_vec( size_t n ){
+  std::uniform_real_distribution<F> dist( -1.0, 1.0 );
+  vec v( n );
+  for(size_t i = 0; i < n; i++){
+    v[i] = dist( engine );
+  }
+  return v;
+}
+// n 28 x 28 images of a few thick strokes in the central 20 x 20 pixels, about as
+// sparse as MNIST digits ( a fifth of the pixels set )
+vec random_images( int n ){
+  std::uniform_int_distribution<int> end( 4, 21 );
+  vec v( (size_t)n * 28 * 28, 0 );
+  for(int k = 0; k < n; k++){
+    for(int s = 0; s < 4; s++){
+      int y0 = end( engine ), x0 = end( engine ), y1 = end( engine ), x1 = end( engine );
+      for(int t = 0; t <= 16; t++){
+        int y = y0 + ( y1 - y0 ) * t / 16, x = x0 + ( x1 - x0 ) * t / 16;
+        for(int p = 0; p < 9; p++){
+          v[ (size_t)k * 28 * 28 + ( y + p / 3 ) * 28 + x + p % 3 ] = 1;
+        }
+      }
+    }
+  }
+  return v;
+}
+vec random_targets( int n, int classes ){
+  vec t( n * classes, 0 );
+  for(int k = 0; k < n; k++){
+    t[ k * classes + engine() % classes ] = 1;
+  }
+  return t;
+}
+
+void print_header( std::ostream & out ){
+  out << "name\tphase\tbatch\tsamples_per_s\tgflops\tp50_us\tp99_us" << std::endl;
+}
+void print_result( std::ostream & out, const Result & r ){
+  out << r.name << '\t' << r.phase << '\t' << r.batch << '\t'
+      << r.batch / r.p50 << '\t' << r.flops / r.p50 * 1e-9 << '\t'
+      << r.p50 * 1e6 << '\t' << r.p99 * 1e6 << std::endl;
+}
+
+// times run() until min_time has passed and at least min_iterations ran
+template <class Run>
+void measure( std::string name, std::string phase, int batch, double flops, Run run ){
+  for(int i = 0; i < 3; i++){
+    run();
+  }
+  std::vector<double> t;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now(), now = begin;
+  while( t.size() < min_iterations || ( std::chrono::duration<double>( now - begin ).count() < min_time && t.size() < 100000 ) ){
+    std::chrono::steady_clock::time_point s = std::chrono::steady_clock::now();
+    run();
+    now = std::chrono::steady_clock::now();
+    t.push_back( std::chrono::duration<double>( now - s ).count() );
+  }
+  std::sort( t.begin(), t.end() );
+  Result r = { name, phase, batch, t[ t.size() / 2 ], t[ std::min( t.size() - 1, t.size() * 99 / 100 ) ], flops };
+  results.push_back( r );
+  print_result( std::cout, r );
+}
+
+bool selected( const std::string & name ){
+  return name.find( filter ) != std::string::npos;
+}
+
+// forward, backward, gradient and update of layer on its own, after input given data,
+// random by default
+void bench_layer( Layer & input, Layer & layer, std::string name, int n, vec data = vec() ){
+  if( !selected( name ) ) return;
+  ExecutionContext ctx( &input );
+  if( data.empty() ){
+    data = random_vec( (size_t)n * input.units );
+  }
+  input.set_input( ctx, data.data(), n );
+  input.forward( ctx );
+  layer.forward( ctx );
+  vec target = random_targets( n, layer.units );
+  layer.set_target( ctx, target.data(), n );
+  vec d = random_vec( (size_t)n * layer.units );
+  std::copy( d.begin(), d.end(), layer.delta( ctx ).begin() );
+  measure( name, "forward", n, layer.cost( FORWARD_PHASE, n ).flops, [&]{ layer.forward( ctx ); } );
+  measure( name, "backward", n, layer.cost( BACKWARD_PHASE, n ).flops, [&]{ layer.backward( ctx ); } );
+  const std::vector<Layer::Parameter> & ps = layer.cached_parameters();
+  if( ps.empty() ) return;
+  size_t size = 0;
+  for(int i = 0; i < ps.size(); i++){
+    size += ps[i].value->size();
+  }
+  measure( name, "gradient", n, layer.cost( GRADIENT_PHASE, n ).flops, [&]{ layer.compute_gradient( ctx ); } );
+  measure( name, "update", n, update_cost( ADAGRAD_UPDATE, size ).flops, [&]{ layer.apply_gradient( ctx, 1e-6, 0.5, (F)1.0 / n ); } );
+}
+
+std::string shape( int c, int h, int w ){
+  return std::to_string( c ) + "x" + std::to_string( h ) + "x" + std::to_string( w );
+}
+const char * engine_name( ConvolutionEngine e ){
+  const char * names[] = { "direct", "im2col", "winograd2x2", "winograd4x4", "blocked" };
+  return names[e];
+}
+
+void bench_fully_connected(){
+  int shapes[][2] = { { 784, 100 }, { 100, 50 }, { 784, 1000 }, { 1000, 1000 } };
+  for(int s = 0; s < 4; s++){
+    for(int n : { 10, 64 }){
+      InputLayer input( shapes[s][0] );
+      FullyConnectedLayer full( shapes[s][1], &input, &relu, "" );
+      bench_layer( input, full, "fully_connected_" + std::to_string( shapes[s][0] ) + "x" + std::to_string( shapes[s][1] ), n );
+    }
+  }
+}
+
+// the pruned layers of mnist_full and mnist_cnn, dense and at 90% sparsity in each block shape
+void bench_sparse_fully_connected(){
+  int shapes[][2] = { { 784, 100 }, { 980, 500 } };
+  for(int s = 0; s < 2; s++){
+    for(int n : { 1, 10 }){
+      for(int block : { 0, 1, 4, 8 }){
+        InputLayer input( shapes[s][0] );
+        FullyConnectedLayer full( shapes[s][1], &input, &relu, "" );
+        if( block > 0 ){
+          full.prune( 0.9, block );
+        }
+        bench_layer( input, full, "fully_connected_" + std::to_string( shapes[s][0] ) + "x" + std::to_string( shapes[s][1] )
+                     + ( block > 0 ? "_sparse90_b" + std::to_string( block ) : "_dense" ), n );
+      }
+    }
+  }
+}
+
+// the first layer of mnist_full on images, most of whose pixels are zero
+void bench_image_inputs(){
+  for(int units : { 100, 1000 }){
+    for(int n : { 1, 10, 64 }){
+      InputLayer input( 28 * 28 );
+      FullyConnectedLayer full( units, &input, &relu, "" );
+      bench_layer( input, full, "fully_connected_784x" + std::to_string( units ) + "_images", n, random_images( n ) );
+    }
+  }
+}
+
+void bench_softmax(){
+  int shapes[][2] = { { 30, 10 }, { 500, 10 }, { 1000, 1000 } };
+  for(int s = 0; s < 3; s++){
+    InputLayer input( shapes[s][0] );
+    SoftmaxLayer softmax( shapes[s][1], &input );
+    bench_layer( input, softmax, "softmax_" + std::to_string( shapes[s][0] ) + "x" + std::to_string( shapes[s][1] ), 10 );
+  }
+}
+
+// input channels, height, width, output channels, filter size
+const int CONVOLUTION_SHAPES[][5] = {
+  { 1, 28, 28, 20, 5 }, { 20, 14, 14, 20, 3 }, { 16, 32, 32, 32, 3 }, { 64, 16, 16, 64, 3 } };
+
+template <class Convolution>
+void bench_convolution( std::string kind ){
+  for(int s = 0; s < 4; s++){
+    const int * c = CONVOLUTION_SHAPES[s];
+    std::vector<ConvolutionEngine> engines;
+    engines.push_back( IM2COL_CONVOLUTION );
+    if( c[4] == 3 ){
+      engines.push_back( WINOGRAD_2X2_CONVOLUTION );
+      engines.push_back( WINOGRAD_4X4_CONVOLUTION );
+    }
+    engines.push_back( BLOCKED_CONVOLUTION );
+    for(int e = 0; e < engines.size(); e++){
+      InputLayer2D input( c[0], c[1], c[2] );
+      Convolution conv( c[3], c[4], &input, &relu, "" );
+      if( engines[e] == BLOCKED_CONVOLUTION ){
+        input.set_channel_block( simd.channel_block );
+      }else{
+        conv.set_engine( engines[e] );
+      }
+      std::string name = kind + "_" + shape( c[0], c[1], c[2] ) + "_k" + std::to_string( c[3] )
+                         + "_f" + std::to_string( c[4] ) + "_" + engine_name( conv.engine );
+      bench_layer( input, conv, name, 10 );
+    }
+  }
+}
+
+void bench_max_pooling(){
+  // channels, height, width, pooling size, stride
+  int shapes[][5] = { { 20, 28, 28, 3, 2 }, { 20, 14, 14, 3, 2 }, { 64, 32, 32, 2, 2 } };
+  for(int s = 0; s < 3; s++){
+    for(int b : { 1, simd.channel_block }){
+      InputLayer2D input( shapes[s][0], shapes[s][1], shapes[s][2] );
+      MaxPoolingLayer pool( shapes[s][3], shapes[s][4], &input, &relu, "" );
+      input.set_channel_block( b );
+      std::string name = "max_pooling_" + shape( shapes[s][0], shapes[s][1], shapes[s][2] ) + "_p"
+                         + std::to_string( shapes[s][3] ) + "_s" + std::to_string( shapes[s][4] )
+                         + ( b > 1 ? "_blocked" : "_planar" );
+      bench_layer( input, pool, name, 10 );
+    }
+  }
+}
+
+// the work of a training step: every forward, the backward of all the layers
+// after the input, the gradients and the AdaGrad update
+double step_flops( Network & net, int n, bool training ){
+  double flops = 0;
+  for(int i = 0; i < net.layers.size(); i++){
+    Layer * l = net.layers[i];
+    flops += l->cost( FORWARD_PHASE, n ).flops;
+    if( !training ) continue;
+    if( i > 0 ){
+      flops += l->cost( BACKWARD_PHASE, n ).flops;
+    }
+    const std::vector<Layer::Parameter> & ps = l->cached_parameters();
+    for(int p = 0; p < ps.size(); p++){
+      flops += update_cost( ADAGRAD_UPDATE, ps[p].value->size() ).flops;
+    }
+    if( !ps.empty() ){
+      flops += l->cost( GRADIENT_PHASE, n ).flops;
+    }
+  }
+  return flops;
+}
+
+// a training step and an inference of n samples of net, compiled, and a single sample
+// autoencoder: the target is the input
+void bench_network( Network & net, std::string name, bool autoencoder ){
+  if( !selected( name ) ) return;
+  net.compile();
+  for(int n : { 10, 64 }){
+    vec data = random_vec( (size_t)n * net.input().units );
+    vec target = autoencoder ? data : random_targets( n, net.output().units );
+    ExecutionContext * train = net.create_context( TRAINING );
+    ExecutionContext * infer = net.create_context( INFERENCE );
+    measure( name, "train_step", n, step_flops( net, n, true ), [&]{
+        net.train_step( *train, data.data(), target.data(), n, 1e-6, 0.5 );
+      } );
+    measure( name, "inference", n, step_flops( net, n, false ), [&]{
+        net.forward( *infer, data.data(), n );
+      } );
+    delete train;
+    delete infer;
+  }
+  // the latency of a single sample through Network::infer
+  vec x = random_vec( net.input().units ), y( net.output().units );
+  ExecutionContext * single = net.create_context( INFERENCE );
+  measure( name, "infer", 1, step_flops( net, 1, false ), [&]{
+      net.infer( *single, x.data(), y.data() );
+    } );
+  delete single;
+}
+
+void bench_networks(){
+  {
+    Network net;
+    InputLayer & input = net.add( new InputLayer( 28 * 28 ) );
+    FullyConnectedLayer & full1 = net.add( new FullyConnectedLayer( 100, &input, &relu, "1" ) );
+    FullyConnectedLayer & full2 = net.add( new FullyConnectedLayer( 50, &full1, &relu, "2" ) );
+    FullyConnectedLayer & full3 = net.add( new FullyConnectedLayer( 30, &full2, &relu, "3" ) );
+    net.add( new SoftmaxLayer( 10, &full3 ) );
+    bench_network( net, "mnist_full", false );
+  }
+  {
+    Network net;
+    InputLayer2D & input = net.add( new InputLayer2D( 1, 28, 28 ) );
+    ConvolutionZeroPaddingLayer & conv1 = net.add( new ConvolutionZeroPaddingLayer( 20, 5, &input, &relu, "conv1" ) );
+    MaxPoolingLayer & maxpool1 = net.add( new MaxPoolingLayer( 3, 2, &conv1, &relu, "maxpool1" ) );
+    ConvolutionZeroPaddingLayer & conv2 = net.add( new ConvolutionZeroPaddingLayer( 20, 3, &maxpool1, &relu, "conv2" ) );
+    MaxPoolingLayer & maxpool2 = net.add( new MaxPoolingLayer( 3, 2, &conv2, &relu, "maxpool2" ) );
+    FullyConnectedLayer & full1 = net.add( new FullyConnectedLayer( 500, &maxpool2, &relu, "full1" ) );
+    net.add( new SoftmaxLayer( 10, &full1 ) );
+    bench_network( net, "mnist_cnn", false );
+  }
+  {
+    Network net;
+    InputLayer2D & input = net.add( new InputLayer2D( 1, 28, 28 ) );
+    FullyConnectedLayer & med = net.add( new FullyConnectedLayer( 50, &input, &relu, "med" ) );
+    net.add( new FullyConnectedLayer( 28 * 28, &med, &sigmoid, "output" ) );
+    bench_network( net, "autoencoder", true );
+  }
+}
+
+// the p50 of every benchmark of baseline also run now; slower by more than
+// threshold is a regression
+bool compare( std::string baseline, double threshold ){
+  std::ifstream in( baseline );
+  if( !in ){
+    throw "cannot read " + baseline;
+  }
+  std::map<std::string, double> base;
+  std::string line;
+  while( std::getline( in, line ) ){
+    std::istringstream ls( line );
+    std::string name, phase, batch;
+    double samples, gflops, p50;
+    if( std::getline( ls, name, '\t' ) && std::getline( ls, phase, '\t' ) && std::getline( ls, batch, '\t' )
+        && ls >> samples >> gflops >> p50 ){
+      base[ name + '\t' + phase + '\t' + batch ] = p50;
+    }
+  }
+  bool regression = false;
+  std::cerr << "status\tname\tphase\tbatch\tbaseline_p50_us\tp50_us\tratio" << std::endl;
+  for(int i = 0; i < results.size(); i++){
+    const Result & r = results[i];
+    std::map<std::string, double>::iterator b = base.find( r.name + '\t' + r.phase + '\t' + std::to_string( r.batch ) );
+    if( b == base.end() ) continue;
+    double ratio = r.p50 * 1e6 / b->second;
+    const char * status = ratio > 1 + threshold ? "REGRESSION" : ratio < 1 - threshold ? "faster" : "ok";
+    regression = regression || ratio > 1 + threshold;
+    std::cerr << status << '\t' << r.name << '\t' << r.phase << '\t' << r.batch << '\t'
+              << b->second << '\t' << r.p50 * 1e6 << '\t' << ratio << std::endl;
+  }
+  return regression;
+}
+
+int main( int argc, char ** argv ){
+  std::string output, baseline;
+  double threshold = 0.1;
+  for(int i = 1; i < argc; i++){
+    std::string a = argv[i];
+    if( a == "-q" ){
+      min_time = 0.05;
+      min_iterations = 3;
+    }else if( a == "-f" && i + 1 < argc ){
+      filter = argv[ ++i ];
+    }else if( a == "-o" && i + 1 < argc ){
+      output = argv[ ++i ];
+    }else if( a == "-c" && i + 1 < argc ){
+      baseline = argv[ ++i ];
+    }else if( a == "-t" && i + 1 < argc ){
+      threshold = std::stod( argv[ ++i ] );
+    }else{
+      std::cerr << "usage: benchmark [-q] [-f filter] [-o results.tsv] [-c baseline.tsv] [-t threshold]" << std::endl;
+      return 2;
+    }
+  }
+  std::cout << "# simd = " << simd.name << std::endl;
+  print_header( std::cout );
+  bench_fully_connected();
+  bench_sparse_fully_connected();
+  bench_image_inputs();
+  bench_softmax();
+  bench_convolution<ConvolutionLayer>( "convolution" );
+  bench_convolution<ConvolutionZeroPaddingLayer>( "convolution_zero_padding" );
+  bench_max_pooling();
+  bench_networks();
+  if( output != "" ){
+    std::ofstream out( output );
+    out << "# simd = " << simd.name << std::endl;
+    print_header( out );
+    for(int i = 0; i < results.size(); i++){
+      print_result( out, results[i] );
+    }
+  }
+  if( baseline != "" && compare( baseline, threshold ) ){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <string>
+#include "src/neuralnetwork.hpp"
+
+// packs a PNG dataset directory ( 0/, ..., 9/ ) into one memory mappable file
+// usage: convert_dataset <dataset dir> <output file> [uint8|float]
+int main( int argc, char ** argv ){
+  if( argc < 3 ){
+    std::cout << "usage: " << argv[0] << " <dataset dir> <output file> [uint8|float]" << std::endl;
+    return 1;
+  }
+  TensorType t = UINT8_TENSOR;
+  if( argc >= 4 && std::string( argv[3] ) == "float" ){
+    t = FLOAT32_TENSOR;
+  }
+  convert_dataset( argv[1], argv[2], t );
+  TensorDataset d( argv[2] );
+  std::cout << argv[2] << " : " << d.size() << " samples of "
+            << d.channel << " x " << d.height << " x " << d.width << std::endl;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include "src/neuralnetwork.hpp"
+
+// serves the network of mnist_cnn or mnist_full to local clients ( see src/inference_server.hpp )
+//   inference_server -m cnn -k mnist_cnn.ckpt -u /tmp/nn.sock -b 64 -l 1000
+// and prints the requests per second and the batch sizes every few seconds
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void on_signal( int ){
+  interrupted = 1;
+}
+
+void build( Network & net, std::string model ){
+  if( model == "full" ){
+    InputLayer & input = net.add( new InputLayer( 28 * 28 ) );
+    FullyConnectedLayer & full1 = net.add( new FullyConnectedLayer( 100, &input, &relu, "1" ) );
+    FullyConnectedLayer & full2 = net.add( new FullyConnectedLayer( 50, &full1, &relu, "2" ) );
+    FullyConnectedLayer & full3 = net.add( new FullyConnectedLayer( 30, &full2, &relu, "3" ) );
+    net.add( new SoftmaxLayer( 10, &full3 ) );
+  }else if( model == "cnn" ){
+    InputLayer2D & input = net.add( new InputLayer2D( 1, 28, 28 ) );
+    ConvolutionZeroPaddingLayer & conv1 = net.add( new ConvolutionZeroPaddingLayer( 20, 5, &input, &relu, "conv1" ) );
+    MaxPoolingLayer & maxpool1 = net.add( new MaxPoolingLayer( 3, 2, &conv1, &relu, "maxpool1" ) );
+    ConvolutionZeroPaddingLayer & conv2 = net.add( new ConvolutionZeroPaddingLayer( 20, 3, &maxpool1, &relu, "conv2" ) );
+    MaxPoolingLayer & maxpool2 = net.add( new MaxPoolingLayer( 3, 2, &conv2, &relu, "maxpool2" ) );
+    FullyConnectedLayer & full1 = net.add( new FullyConnectedLayer( 500, &maxpool2, &relu, "full1" ) );
+    net.add( new SoftmaxLayer( 10, &full1 ) );
+  }else{
+    throw "unknown model " + model;
+  }
+  net.compile();
+}
+
+int main( int argc, char ** argv ){
+  std::string model = "cnn", checkpoint, path;
+  int port = 0, max_batch = 64, max_latency_us = 1000, workers = 1, interval = 5;
+  for(int i = 1; i < argc; i++){
+    std::string a = argv[i];
+    if( a == "-m" && i + 1 < argc ){
+      model = argv[ ++i ];
+    }else if( a == "-k" && i + 1 < argc ){
+      checkpoint = argv[ ++i ];
+    }else if( a == "-u" && i + 1 < argc ){
+      path = argv[ ++i ];
+    }else if( a == "-p" && i + 1 < argc ){
+      port = std::stoi( argv[ ++i ] );
+    }else if( a == "-b" && i + 1 < argc ){
+      max_batch = std::stoi( argv[ ++i ] );
+    }else if( a == "-l" && i + 1 < argc ){
+      max_latency_us = std::stoi( argv[ ++i ] );
+    }else if( a == "-w" && i + 1 < argc ){
+      workers = std::stoi( argv[ ++i ] );
+    }else if( a == "-s" && i + 1 < argc ){
+      interval = std::stoi( argv[ ++i ] );
+    }else{
+      std::cerr << "usage: inference_server [-m cnn|full] [-k checkpoint] [-u socket_path | -p port] "
+                << "[-b max_batch] [-l max_latency_us] [-w workers] [-s stats_interval_s]" << std::endl;
+      return 2;
+    }
+  }
+  if( path == "" && port == 0 ){
+    path = "/tmp/neural_network.sock";
+  }
+
+  Network net;
+  build( net, model );
+  if( checkpoint != "" ){
+    load_checkpoint( net.input(), checkpoint );
+    std::cout << "[[[ loaded " << checkpoint << " ]]]" << std::endl;
+  }else{
+    std::cout << "[[[ no checkpoint, random weights ]]]" << std::endl;
+  }
+
+  InferenceServer server( net, max_batch, max_latency_us, workers );
+  server.start( path != "" ? listen_unix( path ) : listen_tcp( port ) );
+  std::cout << "[[[ serving " << model << " on " << ( path != "" ? path : "127.0.0.1:" + std::to_string( port ) )
+            << ", batches of up to " << max_batch << " within " << max_latency_us << " us ]]]" << std::endl;
+
+  std::signal( SIGINT, on_signal );
+  std::signal( SIGTERM, on_signal );
+  long requests = 0, batches = 0;
+  auto last = std::chrono::steady_clock::now();
+  while( !interrupted ){
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>( now - last ).count();
+    if( seconds < interval ) continue;
+    long r = server.requests(), b = server.batches();
+    if( r > requests ){
+      std::cout << ( r - requests ) / seconds << " requests/s, " << (double)( r - requests ) / ( b - batches )
+                << " per batch" << std::endl;
+      server.print_batch_sizes();
+    }
+    requests = r;
+    batches = b;
+    last = now;
+  }
+  server.stop();
+  if( path != "" ){
+    ::unlink( path.c_str() );
+  }
+  std::cout << "[[[ served " << server.requests() << " requests in " << server.batches() << " batches ]]]" << std::endl;
+}
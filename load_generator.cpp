@@ -0,0 +1,158 @@
+#include <iostream>
+#include <string>
+#include <random>
+#include "src/neuralnetwork.hpp"
+
+// requests random images from an inference_server and prints the latencies
+//   load_generator -u /tmp/nn.sock -c 8 -w 1 -d 10     closed loop: each of 8 connections
+//                                                       keeps 1 request in flight
+//   load_generator -u /tmp/nn.sock -c 8 -r 5000 -d 10   open loop: 5000 requests/s in all,
+//                                                       sent on schedule whatever the answers
+// in the open loop a latency runs from the time the request was due, not sent, so a
+// server falling behind shows in the latencies instead of slowing the load down
+
+struct Options {
+  std::string path;
+  int port;
+  int connections;
+  int window;
+  double rate;
+  double duration;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double since( Clock::time_point t ){
+  return std::chrono::duration<double>( Clock::now() - t ).count();
+}
+
+int open_connection( const Options & o ){
+  return o.path != "" ? connect_unix( o.path ) : connect_tcp( o.port );
+}
+
+// the inputs, a few random images repeated
+std::vector<vec> random_inputs( int inputs, int seed ){
+  std::mt19937 mt( seed );
+  std::uniform_real_distribution<F> u( 0, 1 );
+  std::vector<vec> x( 16, vec( inputs ) );
+  for(int k = 0; k < x.size(); k++){
+    for(int i = 0; i < inputs; i++){
+      x[k][i] = u( mt );
+    }
+  }
+  return x;
+}
+
+// window requests in flight, a new one sent on each answer
+void closed_loop( const Options & o, int seed, LatencyHistogram & h ){
+  InferenceClient client( open_connection( o ) );
+  std::vector<vec> x = random_inputs( client.inputs, seed );
+  std::vector<Clock::time_point> sent;
+  Clock::time_point start = Clock::now();
+  for(int k = 0; k < o.window; k++){
+    sent.push_back( Clock::now() );
+    client.send( k, x[ k % x.size() ].data() );
+  }
+  for(long received = 0; received < sent.size(); received++){
+    uint32_t id;
+    int cls;
+    if( !client.receive( id, cls, nullptr ) ){
+      throw "inference server closed the connection";
+    }
+    h.record( since( sent[ id ] ) );
+    if( since( start ) < o.duration ){
+      uint32_t next = sent.size();
+      sent.push_back( Clock::now() );
+      client.send( next, x[ next % x.size() ].data() );
+    }
+  }
+}
+
+// rate requests per second, request k due at k / rate
+void open_loop( const Options & o, double rate, int seed, LatencyHistogram & h ){
+  InferenceClient client( open_connection( o ) );
+  std::vector<vec> x = random_inputs( client.inputs, seed );
+  long total = (long)( rate * o.duration );
+  Clock::time_point start = Clock::now();
+  auto due = [&]( long k ){
+    return start + std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>( k / rate ) );
+  };
+  std::thread sender( [&]{
+    for(long k = 0; k < total; k++){
+      std::this_thread::sleep_until( due( k ) );
+      if( !client.send( k, x[ k % x.size() ].data() ) ){
+        return;
+      }
+    }
+  } );
+  for(long received = 0; received < total; received++){
+    uint32_t id;
+    int cls;
+    if( !client.receive( id, cls, nullptr ) ){
+      break;
+    }
+    h.record( std::chrono::duration<double>( Clock::now() - due( id ) ).count() );
+  }
+  client.shutdown();
+  sender.join();
+}
+
+int main( int argc, char ** argv ){
+  Options o = { "", 0, 4, 1, 0, 5 };
+  for(int i = 1; i < argc; i++){
+    std::string a = argv[i];
+    if( a == "-u" && i + 1 < argc ){
+      o.path = argv[ ++i ];
+    }else if( a == "-p" && i + 1 < argc ){
+      o.port = std::stoi( argv[ ++i ] );
+    }else if( a == "-c" && i + 1 < argc ){
+      o.connections = std::stoi( argv[ ++i ] );
+    }else if( a == "-w" && i + 1 < argc ){
+      o.window = std::stoi( argv[ ++i ] );
+    }else if( a == "-r" && i + 1 < argc ){
+      o.rate = std::stod( argv[ ++i ] );
+    }else if( a == "-d" && i + 1 < argc ){
+      o.duration = std::stod( argv[ ++i ] );
+    }else{
+      std::cerr << "usage: load_generator [-u socket_path | -p port] [-c connections] "
+                << "[-w window | -r requests_per_s] [-d seconds]" << std::endl;
+      return 2;
+    }
+  }
+  if( o.path == "" && o.port == 0 ){
+    o.path = "/tmp/neural_network.sock";
+  }
+
+  std::vector<LatencyHistogram> histograms( o.connections );
+  std::vector<std::thread> threads;
+  Clock::time_point start = Clock::now();
+  for(int c = 0; c < o.connections; c++){
+    threads.push_back( std::thread( [&, c]{
+      try{
+        if( o.rate > 0 ){
+          open_loop( o, o.rate / o.connections, c, histograms[c] );
+        }else{
+          closed_loop( o, c, histograms[c] );
+        }
+      }catch( const char * e ){
+        std::cerr << e << std::endl;
+      }catch( std::string e ){
+        std::cerr << e << std::endl;
+      }
+    } ) );
+  }
+  for(int c = 0; c < threads.size(); c++){
+    threads[c].join();
+  }
+  double seconds = since( start );
+
+  LatencyHistogram all;
+  for(int c = 0; c < histograms.size(); c++){
+    all.merge( histograms[c] );
+  }
+  std::cout << o.connections << " connections, "
+            << ( o.rate > 0 ? "open loop at " + std::to_string( (long)o.rate ) + " requests/s"
+                            : "closed loop, window " + std::to_string( o.window ) ) << std::endl;
+  std::cout << all.size() << " requests in " << seconds << " s, " << all.size() / seconds << " requests/s" << std::endl;
+  all.print();
+}
@@ -11,13 +11,11 @@ const int IMAGE_W = 28;
 std::vector<std::vector<vec> > mnist_training;
 std::vector<std::vector<vec> > mnist_testing;
 
-void one_step( InputLayer2D & input, Layer & output, vec data, vec target );
-void test( InputLayer2D & input, SoftmaxLayer & output );
+const int TEST_BATCH_SIZE = 100;
 
-int main(){
-  std::random_device rnd;
-  std::mt19937 mt(rnd());
+void test( DataParallelTrainer<InputLayer2D> & trainer, InputLayer2D & input, SoftmaxLayer & output );
 
+int main( int argc, char ** argv ){
   load_dataset(TRAINING_DATASET_DIR, mnist_training);
   load_dataset(TESTING_DATASET_DIR, mnist_testing);
   std::cout << "[[[ loaded ]]]" << std::endl;
@@ -31,57 +29,99 @@ int main(){
   MaxPoolingLayer maxpool2( 3, 2, &conv2, &relu, "maxpool2" );
   FullyConnectedLayer full1( 500, &maxpool2, &relu, "full1" );
   SoftmaxLayer softmax( 10, &full1 );
+  // channel blocked images, each convolution fused with its max pooling
+  Network network( input );
+  network.compile();
 
   input.print_network_info();
+  network.print_schedule();
+
+  // resume from a checkpoint: mnist_cnn <checkpoint>
+  if( argc > 1 ){
+    load_checkpoint( input, argv[1] );
+    std::cout << "[[[ resumed from " << argv[1] << " ]]]" << std::endl;
+  }
+
+  // every mini-batch is split over all cores
+  DataParallelTrainer<InputLayer2D> trainer( input, std::max( 1u, std::thread::hardware_concurrency() ) );
+  std::cout << "[[[ " << trainer.threads() << " threads ]]]" << std::endl;
 
   std::cout << "[[[ constructed ]]]" << std::endl;
   std::cout << std::endl;
 
-  vec image;
-  vec target(10,0);
+  // a mini-batch holds one image of each digit, prepared in the background
+  BatchPipeline pipeline( mnist_training, 1 );
+  // AdaGrad with momentum, the update of all the layers split over the same threads
+  Optimizer optimizer( ADAGRAD_UPDATE, 0.01, 0.5 );
 
   // learning
   for(int i = 0; i < 50000; i++){
-    for(int j = 0; j < 10; j++){
-      std::uniform_int_distribution<> rand(0, mnist_training[j].size()-1 );
-      image = mnist_training[j][ rand(mt) ];
-      target[j] = 1.0;
-      one_step( input, softmax, image, target );
-      target[j] = 0;
-    }
+    trainer.one_step( pipeline.next(), optimizer );
     if( i % 1000 == 0 ){
       std::cout << "i=" << i << std::endl;
-      test( input, softmax );
+      test( trainer, input, softmax );
     }
   }
   std::cout << "[[[[ learned ]]]]" << std::endl;
+  save_checkpoint( input, "mnist_cnn.ckpt" );
   std::cout << std::endl;
 
   // testing
-  test( input, softmax );
-}
+  test( trainer, input, softmax );
+
+  // int8 inference, calibrated on 10 training images of each digit
+  std::vector<vec> calibration;
+  for(int i = 0; i < 10; i++){
+    calibration.insert( calibration.end(), mnist_training[i].begin(), mnist_training[i].begin() + 10 );
+  }
+  QuantizedNetwork quantized( input, calibration );
+  compare_quantized( input, quantized, mnist_testing );
+
+  // the fully connected layers with bf16 weights
+  full1.set_precision( BF16 );
+  softmax.set_precision( BF16 );
+  std::cout << "[[[ bf16 weights ( " << half_kernels.name << " ) ]]]" << std::endl;
+  test( trainer, input, softmax );
+  full1.set_precision( FP32 );
+  softmax.set_precision( FP32 );
 
-void one_step( InputLayer2D & input, Layer & output, vec data, vec target ){
-  input.propagate( data );
-  output.set_target( target );
-  output.back_propagate( );
-  input.gradient_descent( 0.01, 0.5 );
+  // full1 holds most of the parameters: 90% of its weights pruned in blocks of 8 x 1,
+  // then fine-tuned with the pruned ones kept zero
+  full1.prune( 0.9, 8 );
+  for(int i = 0; i < 5000; i++){
+    trainer.one_step( pipeline.next(), optimizer );
+  }
+  std::cout << "[[[ full1 pruned to " << 100 * full1.sparsity() << "% ]]]" << std::endl;
+  test( trainer, input, softmax );
+  save_checkpoint( input, "mnist_cnn_pruned.ckpt", false, FP32, true );
 }
 
-void test( InputLayer2D & input, SoftmaxLayer & output ){
+void test( DataParallelTrainer<InputLayer2D> & trainer, InputLayer2D & input, SoftmaxLayer & output ){
+  // every test batch is one task; the workers share the network, each with its own context
+  std::vector< std::pair<int,int> > batches; // ( digit, first image )
+  for(int i = 0; i < 10; i++){
+    for(int j = 0; j < mnist_testing[i].size(); j += TEST_BATCH_SIZE){
+      batches.push_back( std::make_pair( i, j ) );
+    }
+  }
+  std::vector<int> corrects( batches.size(), 0 );
+  trainer.run( batches.size(), [&]( ExecutionContext & ctx, int b ){
+      int i = batches[b].first, j = batches[b].second;
+      int end = std::min( j + TEST_BATCH_SIZE, (int)mnist_testing[i].size() );
+      input.propagate( ctx, &mnist_testing[i][j], end - j );
+      for(int k = 0; k < end - j; k++){
+        if( i == output.get_class( ctx, k ) ){
+          corrects[b]++;
+        }
+      }
+    } );
   int n = 0;
   int correct = 0;
-  vec image;
-
   for(int i = 0; i < 10; i++){
-    for(int j = 0; j < mnist_testing[i].size(); j++){
-      image = mnist_testing[i][j];
-      input.propagate( image );
-      if( i == output.get_class() ){
-	correct++;
-      }
-      n++;
-    }
+    n += mnist_testing[i].size();
+  }
+  for(int b = 0; b < batches.size(); b++){
+    correct += corrects[b];
   }
   std::cout << "total test data size = " << n << std::endl;
   std::cout << "correct answer = " << correct << std::endl;
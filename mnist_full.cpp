@@ -11,67 +11,70 @@ const int IMAGE_W = 28;
 std::vector<std::vector<vec> > mnist_training;
 std::vector<std::vector<vec> > mnist_testing;
 
-void one_step( InputLayer & input, Layer & output, vec data, vec target );
-void test( InputLayer & input, SoftmaxLayer & output );
+const int TEST_BATCH_SIZE = 100;
 
-int main(){
-  std::random_device rnd;
-  std::mt19937 mt(rnd());
+void test( Network & network, SoftmaxLayer & output );
 
+int main(){
   load_dataset(TRAINING_DATASET_DIR, mnist_training);
   load_dataset(TESTING_DATASET_DIR, mnist_testing);
   std::cout << "loaded" << std::endl;
 
   // construct neural network
-  InputLayer input( IMAGE_H * IMAGE_W );
-  FullyConnectedLayer full1( 100, &input, &relu, "1" );
-  FullyConnectedLayer full2( 50, &full1, &relu, "2" );
-  FullyConnectedLayer full3( 30, &full2, &relu, "3" );
-  SoftmaxLayer softmax( 10, &full3 );
+  Network network;
+  InputLayer & input = network.add( new InputLayer( IMAGE_H * IMAGE_W ) );
+  FullyConnectedLayer & full1 = network.add( new FullyConnectedLayer( 100, &input, &relu, "1" ) );
+  FullyConnectedLayer & full2 = network.add( new FullyConnectedLayer( 50, &full1, &relu, "2" ) );
+  FullyConnectedLayer & full3 = network.add( new FullyConnectedLayer( 30, &full2, &relu, "3" ) );
+  SoftmaxLayer & softmax = network.add( new SoftmaxLayer( 10, &full3 ) );
+  network.compile();
+
+  // a mini-batch holds one image of each digit, prepared in the background
+  BatchPipeline pipeline( mnist_training, 1 );
 
-  vec image;
-  vec target(10,0);
+  // time of every layer and of the data loading, printed at the end
+  Profiler profiler( network.layers.size() );
+  network.set_profiler( &profiler );
+  pipeline.set_profiler( &profiler );
 
   // learning
   for(int i = 0; i < 50000; i++){
-    for(int j = 0; j < 10; j++){
-      std::uniform_int_distribution<> rand(0, mnist_training[j].size()-1 );
-      image = mnist_training[j][ rand(mt) ];
-      target[j] = 1.0;
-      one_step( input, softmax, image, target );
-      target[j] = 0;
+    // the 784 -> 100 layer pruned gradually while training, to 90% of its weights
+    if( i == 20000 || i == 30000 || i == 40000 ){
+      full1.prune( i == 20000 ? 0.5 : i == 30000 ? 0.8 : 0.9, 8 );
+      std::cout << "[[[ layer 1 pruned to " << 100 * full1.sparsity() << "% ]]]" << std::endl;
     }
+    network.train_step( pipeline.next(), 0.01, 0.5 );
     if( i % 1000 == 0 ){
       std::cout << "i=" << i << std::endl;
-      test( input, softmax );
+      test( network, softmax );
     }
   }
   std::cout << "[[[[ learned ]]]]" << std::endl;
 
   // testing
-  test( input, softmax );
-}
-
-void one_step( InputLayer & input, Layer & output, vec data, vec target ){
-  input.propagate( data );
-  output.set_target( target );
-  output.back_propagate();
-  input.gradient_descent( 0.01, 0.5 );
+  test( network, softmax );
+  network.print_memory( network.context() );
+  profiler.print();
+  profiler.write_chrome_trace( "mnist_full_trace.json" );
 }
 
-void test( InputLayer & input, SoftmaxLayer & output ){
+void test( Network & network, SoftmaxLayer & output ){
   int n = 0;
   int correct = 0;
-  vec image;
+  std::vector<vec> images;
 
   for(int i = 0; i < 10; i++){
-    for(int j = 0; j < mnist_testing[i].size(); j++){
-      image = mnist_testing[i][j];
-      input.propagate( image );
-      if( i == output.get_class() ){
-	correct++;
+    for(int j = 0; j < mnist_testing[i].size(); j += TEST_BATCH_SIZE){
+      int end = std::min( j + TEST_BATCH_SIZE, (int)mnist_testing[i].size() );
+      images.assign( mnist_testing[i].begin() + j, mnist_testing[i].begin() + end );
+      network.forward( images );
+      for(int k = 0; k < images.size(); k++){
+        if( i == output.get_class( network.context(), k ) ){
+          correct++;
+        }
+        n++;
       }
-      n++;
     }
   }
   std::cout << "total test data size = " << n << std::endl;
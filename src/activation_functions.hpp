@@ -2,10 +2,25 @@
 #define ACTIVATIONFUNCTION
 #include <iostream>
 #include "common.hpp"
+#include "simd.hpp"
+
+// the activation functions below are selectors: layers pass them to the span
+// kernels at the bottom of this file, which pick a loop specialized for the
+// function once per span instead of calling f / df once per unit; a subclass of
+// its own is CUSTOM_ACTIVATION and still computed through f / df
+enum ActivationKind {
+  ID_ACTIVATION = 0,
+  RELU_ACTIVATION = 1,
+  SIGMOID_ACTIVATION = 2,
+  SOFTMAX_ACTIVATION = 3,
+  CUSTOM_ACTIVATION = 4
+};
 
 class ActivationFunction{
 public:
   std::string func_name;
+  ActivationKind kind;
+  ActivationFunction() : kind( CUSTOM_ACTIVATION ) { }
   virtual F f(F u) = 0;
   virtual F df(F u) = 0;
 };
@@ -14,6 +29,7 @@ class Id : public ActivationFunction {
 public:
   Id(){
     func_name = "Id";
+    kind = ID_ACTIVATION;
   }
   F f(F u){
     return u;
@@ -28,6 +44,7 @@ class ReLU : public ActivationFunction {
 public:
   ReLU(){
     func_name = "ReLU";
+    kind = RELU_ACTIVATION;
   }
   F f(F u){
     return std::max(F(0), u);
@@ -41,20 +58,24 @@ class Sigmoid : public ActivationFunction {
 public:
   Sigmoid(){
     func_name = "sigmoid";
+    kind = SIGMOID_ACTIVATION;
   }
   F f(F u){
     return 1.0 / (1.0 + std::exp(-u));
   }
   F df(F u){
-    return f(u) * (1 - f(u));
+    F s = f(u);
+    return s * (1 - s);
   }
 } sigmoid;
 
 class Softmax : public ActivationFunction {
   // this is a damy class
+  // SoftmaxLayer normalizes its outputs itself
 public:
   Softmax(){
     func_name = "softmax";
+    kind = SOFTMAX_ACTIVATION;
   }
   F f(F u){
     return 0;
@@ -63,4 +84,48 @@ public:
     return 0;
   }
 } softmax;
+
+// the index of the span kernels of af in simd
+inline int activation_kernel( ActivationFunction * af ){
+  if( af->kind == SOFTMAX_ACTIVATION ){
+    throw "softmax has no span kernel, SoftmaxLayer normalizes its outputs itself";
+  }
+  return af->kind;
+}
+
+// a = f( y )
+void activate( ActivationFunction * af, int n, const F * y, F * a ){
+  if( af->kind == CUSTOM_ACTIVATION ){
+    for(int i = 0; i < n; i++) a[i] = af->f( y[i] );
+    return;
+  }
+  simd.activate[ activation_kernel( af ) ]( n, y, a );
+}
+
+// y += b, a = f( y )
+void bias_activate( ActivationFunction * af, int n, const F * b, F * y, F * a ){
+  if( af->kind == CUSTOM_ACTIVATION ){
+    for(int i = 0; i < n; i++) a[i] = af->f( y[i] += b[i] );
+    return;
+  }
+  simd.bias_activate[ activation_kernel( af ) ]( n, b, y, a );
+}
+
+// y = x + b, a = f( y ) with the same bias b for every unit
+void bias_activate( ActivationFunction * af, int n, F b, const F * x, F * y, F * a ){
+  if( af->kind == CUSTOM_ACTIVATION ){
+    for(int i = 0; i < n; i++) a[i] = af->f( y[i] = x[i] + b );
+    return;
+  }
+  simd.bias_scalar_activate[ activation_kernel( af ) ]( n, b, x, y, a );
+}
+
+// d *= f'( u ), where a = f( u ) is the activated output of the same units
+void mul_activation_derivative( ActivationFunction * af, int n, const F * u, const F * a, F * d ){
+  if( af->kind == CUSTOM_ACTIVATION ){
+    for(int i = 0; i < n; i++) d[i] *= af->df( u[i] );
+    return;
+  }
+  simd.mul_activation_derivative[ activation_kernel( af ) ]( n, u, a, d );
+}
 #endif
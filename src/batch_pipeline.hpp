@@ -0,0 +1,175 @@
+#ifndef BATCHPIPELINE
+#define BATCHPIPELINE
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <random>
+#include <algorithm>
+#include "common.hpp"
+#include "dataset.hpp"
+#include "profiler.hpp"
+
+// a mini-batch, samples and one-hot targets stored sample by sample
+struct Batch {
+  int size;
+  vec data;    // [ size x sample_size ]
+  vec target;  // [ size x classes ]
+  std::vector<int> labels;
+};
+
+// builds class-balanced mini-batches on a background thread
+// every batch holds per_class samples of each class; the samples of a class
+// are drawn without replacement from a permutation shuffled every epoch
+// batches are written into a ring of preallocated slots, so the next batch is
+// prepared while the current one is being trained on
+class BatchPipeline {
+public:
+  // dataset[c] = samples of class c, as load_dataset makes
+  BatchPipeline( const std::vector<std::vector<vec> > & dataset, int per_class, int slots = 2, unsigned seed = std::random_device()() ){
+    std::vector<int> sizes;
+    for(int c = 0; c < dataset.size(); c++){
+      sizes.push_back( dataset[c].size() );
+    }
+    const std::vector<std::vector<vec> > * d = &dataset;
+    fetch = [d]( int c, int i, F * out ){
+      std::copy( (*d)[c][i].begin(), (*d)[c][i].end(), out );
+    };
+    start( sizes, dataset[0][0].size(), per_class, slots, seed );
+  }
+  // samples of a labelled dataset file, read straight from the mapping
+  BatchPipeline( const TensorDataset & dataset, int classes, int per_class, int slots = 2, unsigned seed = std::random_device()() ){
+    std::vector<int> sizes( classes, 0 );
+    by_class.resize( classes );
+    for(int i = 0; i < dataset.size(); i++){
+      by_class[ dataset.label( i ) ].push_back( i );
+    }
+    for(int c = 0; c < classes; c++){
+      sizes[c] = by_class[c].size();
+    }
+    const TensorDataset * d = &dataset;
+    fetch = [this, d]( int c, int i, F * out ){
+      d->read( by_class[c][i], 1, out );
+    };
+    start( sizes, dataset.sample_size(), per_class, slots, seed );
+  }
+  ~BatchPipeline(){
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      stopping = true;
+    }
+    changed.notify_all();
+    producer.join();
+  }
+  // records the filling of every batch and the waits of next() on profiler's
+  // pipeline row, nullptr stops
+  void set_profiler( Profiler * p ){
+    std::lock_guard<std::mutex> lock( mutex );
+    profiler = p;
+  }
+  // waits for the next batch; it stays valid until the following call
+  const Batch & next(){
+    std::unique_lock<std::mutex> lock( mutex );
+    Profiler * p = profiler;
+    long long start = p != nullptr ? p->now() : 0;
+    if( released < consumed ){
+      // the previous batch goes back to the producer
+      released = consumed;
+      changed.notify_all();
+    }
+    changed.wait( lock, [this]{ return produced > consumed; } );
+    if( p != nullptr ){
+      LayerCost none = { 0, 0 };
+      p->record( p->load_row(), "batch pipeline", WAIT_PHASE, start, p->now(), none );
+    }
+    return ring[ consumed++ % ring.size() ];
+  }
+  int batch_size(){
+    return per_class * order.size();
+  }
+private:
+  std::function<void( int, int, F * )> fetch;
+  std::vector<std::vector<int> > by_class;
+  std::vector<std::vector<int> > order; // permutation of each class
+  std::vector<int> position;
+  int per_class;
+  int sample_size;
+  std::mt19937 engine;
+  std::vector<Batch> ring;
+  long produced, consumed, released;
+  bool stopping;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread producer;
+  Profiler * profiler;
+
+  void start( const std::vector<int> & sizes, int ss, int pc, int slots, unsigned seed ){
+    int classes = sizes.size();
+    per_class = pc;
+    sample_size = ss;
+    engine.seed( seed );
+    order.resize( classes );
+    position.resize( classes, 0 );
+    for(int c = 0; c < classes; c++){
+      if( sizes[c] == 0 ){
+        throw "no sample of class " + std::to_string( c );
+      }
+      for(int i = 0; i < sizes[c]; i++){
+        order[c].push_back( i );
+      }
+      std::shuffle( order[c].begin(), order[c].end(), engine );
+    }
+    ring.resize( std::max( slots, 2 ) );
+    for(int s = 0; s < ring.size(); s++){
+      ring[s].size = classes * per_class;
+      ring[s].data.resize( ring[s].size * sample_size );
+      ring[s].target.resize( ring[s].size * classes, 0 );
+      ring[s].labels.resize( ring[s].size );
+    }
+    produced = consumed = released = 0;
+    stopping = false;
+    profiler = nullptr;
+    producer = std::thread( &BatchPipeline::produce, this );
+  }
+  void produce(){
+    while( true ){
+      Profiler * p;
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        changed.wait( lock, [this]{ return stopping || produced < released + (long)ring.size(); } );
+        if( stopping ) return;
+        p = profiler;
+      }
+      // slot produced % ring.size() is owned by this thread until produced is incremented
+      Batch & b = ring[ produced % ring.size() ];
+      long long start = p != nullptr ? p->now() : 0;
+      fill( b );
+      if( p != nullptr ){
+        LayerCost c = { 0, sizeof( F ) * ( 2.0 * b.data.size() + b.target.size() ) };
+        p->record( p->load_row(), "batch pipeline", LOAD_PHASE, start, p->now(), c );
+      }
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        produced++;
+      }
+      changed.notify_all();
+    }
+  }
+  void fill( Batch & b ){
+    int classes = order.size();
+    std::fill( b.target.begin(), b.target.end(), 0 );
+    for(int k = 0; k < b.size; k++){
+      int c = k % classes;
+      if( position[c] == order[c].size() ){
+        // next epoch of this class
+        std::shuffle( order[c].begin(), order[c].end(), engine );
+        position[c] = 0;
+      }
+      fetch( c, order[c][ position[c]++ ], &b.data[ k * sample_size ] );
+      b.target[ k * classes + c ] = 1.0;
+      b.labels[k] = c;
+    }
+  }
+};
+
+#endif
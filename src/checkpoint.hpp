@@ -0,0 +1,265 @@
+#ifndef CHECKPOINT
+#define CHECKPOINT
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "common.hpp"
+#include "dataset.hpp"
+#include "layer/layer.hpp"
+
+// binary checkpoint of a network, all integers little endian
+//   header        "NNCK", version, number of layers, flags                    ( 16 bytes )
+//   layers        name ( 48 bytes, truncated ), units, inputs, parameters, pruning  ( 64 bytes each )
+//   parameters    size, offsets of value, d and sum_square_grad                ( 4 x 8 bytes each )
+//   data          arrays, each starting at a multiple of 64 bytes
+// d and sum_square_grad are only stored with CHECKPOINT_OPTIMIZER_STATE, their offsets are 0 otherwise
+// values are float, or the Precision in bits 1-2 of flags; d and sum_square_grad are always float
+// with CHECKPOINT_SPARSE values are a bitmap of the nonzero ones ( size / 64 words of
+// 64 bits, bit k of word i for value 64 i + k ) followed by those values only
+// pruning is the block of a pruned FullyConnectedLayer, 0 for the others ( version 1 )
+const char CHECKPOINT_MAGIC[4] = { 'N', 'N', 'C', 'K' };
+const uint32_t CHECKPOINT_VERSION = 2;
+const uint32_t CHECKPOINT_OPTIMIZER_STATE = 1;
+const int CHECKPOINT_PRECISION_SHIFT = 1;
+const uint32_t CHECKPOINT_PRECISION_MASK = 3 << CHECKPOINT_PRECISION_SHIFT;
+const uint32_t CHECKPOINT_SPARSE = 1 << 3;
+
+struct CheckpointLayer {
+  char name[48];
+  uint32_t units;
+  uint32_t inputs;
+  uint32_t parameters;
+  uint32_t pruning;
+};
+
+struct CheckpointParameter {
+  uint64_t size;
+  uint64_t value;
+  uint64_t d;
+  uint64_t sum_square_grad;
+};
+
+// whether the bytes [ offset, offset + bytes ) lie in a file of size bytes, without
+// overflowing on a corrupt offset
+inline bool in_file( size_t size, uint64_t offset, uint64_t bytes ){
+  return offset <= size && bytes <= size - offset;
+}
+
+inline size_t bitmap_words( size_t n ){
+  return ( n + 63 ) / 64;
+}
+
+inline size_t nonzeros( const vec & v ){
+  return v.size() - std::count( v.begin(), v.end(), (F)0 );
+}
+
+std::vector<Layer *> network_layers( Layer & input ){
+  std::vector<Layer *> layers;
+  for(Layer * l = &input; l != nullptr; l = l->next_layer){
+    layers.push_back( l );
+  }
+  return layers;
+}
+
+// writes the topology and parameters of the network starting at input;
+// with optimizer_state the AdaGrad/momentum state is kept as well, so that
+// training can be resumed
+// values = BF16 or FP16 stores the parameters in 16 bits, half the size
+// sparse stores only the nonzero parameters and a bitmap of them, for pruned networks
+// ( at 90% sparsity a float parameter takes 0.525 bytes on average instead of 4 )
+void save_checkpoint( Layer & input, std::string filename, bool optimizer_state = true, Precision values = FP32,
+                      bool sparse = false ){
+  std::vector<Layer *> layers = network_layers( input );
+  std::vector<CheckpointLayer> ls( layers.size() );
+  std::vector<CheckpointParameter> ps;
+  std::vector<const vec *> blocks;
+  for(int i = 0; i < layers.size(); i++){
+    std::vector<Layer::Parameter> params = layers[i]->parameters();
+    std::memset( &ls[i], 0, sizeof( CheckpointLayer ) );
+    std::strncpy( ls[i].name, layers[i]->layer_name.c_str(), sizeof( ls[i].name ) - 1 );
+    ls[i].units = layers[i]->units;
+    ls[i].inputs = layers[i]->inputs;
+    ls[i].parameters = params.size();
+    FullyConnectedLayer * fc = dynamic_cast<FullyConnectedLayer *>( layers[i] );
+    ls[i].pruning = fc != nullptr ? fc->pruning_block() : 0;
+    for(int p = 0; p < params.size(); p++){
+      CheckpointParameter cp = { params[p].value->size(), 0, 0, 0 };
+      ps.push_back( cp );
+      blocks.push_back( params[p].value );
+      if( optimizer_state ){
+        blocks.push_back( params[p].d );
+        blocks.push_back( params[p].sum_square_grad );
+      }
+    }
+  }
+  // offsets of the data blocks, value first for every parameter
+  int per_parameter = optimizer_state ? 3 : 1;
+  size_t offset = 16 + ls.size() * sizeof( CheckpointLayer ) + ps.size() * sizeof( CheckpointParameter );
+  std::vector<size_t> offsets;
+  for(int b = 0; b < blocks.size(); b++){
+    offset = ( offset + 63 ) / 64 * 64;
+    offsets.push_back( offset );
+    bool value = b % per_parameter == 0;
+    size_t n = blocks[b]->size(), size = value && values != FP32 ? sizeof( uint16_t ) : sizeof( F );
+    if( value && sparse ){
+      offset += bitmap_words( n ) * sizeof( uint64_t ) + nonzeros( *blocks[b] ) * size;
+    }else{
+      offset += n * size;
+    }
+  }
+  for(int p = 0; p < ps.size(); p++){
+    ps[p].value = offsets[ p * per_parameter ];
+    if( optimizer_state ){
+      ps[p].d = offsets[ p * per_parameter + 1 ];
+      ps[p].sum_square_grad = offsets[ p * per_parameter + 2 ];
+    }
+  }
+  // the whole file is assembled in memory and written at once
+  std::vector<char> buf( offset, 0 );
+  uint32_t flags = ( optimizer_state ? CHECKPOINT_OPTIMIZER_STATE : 0 ) | ( (uint32_t)values << CHECKPOINT_PRECISION_SHIFT )
+                   | ( sparse ? CHECKPOINT_SPARSE : 0 );
+  uint32_t header[3] = { CHECKPOINT_VERSION, (uint32_t)ls.size(), flags };
+  std::memcpy( &buf[0], CHECKPOINT_MAGIC, 4 );
+  std::memcpy( &buf[4], header, sizeof( header ) );
+  std::memcpy( &buf[16], ls.data(), ls.size() * sizeof( CheckpointLayer ) );
+  std::memcpy( &buf[ 16 + ls.size() * sizeof( CheckpointLayer ) ], ps.data(), ps.size() * sizeof( CheckpointParameter ) );
+  vec packed;
+  for(int b = 0; b < blocks.size(); b++){
+    const vec * data = blocks[b];
+    char * out = &buf[ offsets[b] ];
+    if( sparse && b % per_parameter == 0 ){
+      // the bitmap, then the nonzero values as dense ones
+      size_t words = bitmap_words( data->size() );
+      std::vector<uint64_t> bitmap( words, 0 );
+      packed.clear();
+      for(size_t k = 0; k < data->size(); k++){
+        if( (*data)[k] != 0 ){
+          bitmap[ k / 64 ] |= (uint64_t)1 << ( k % 64 );
+          packed.push_back( (*data)[k] );
+        }
+      }
+      std::memcpy( out, bitmap.data(), words * sizeof( uint64_t ) );
+      out += words * sizeof( uint64_t );
+      data = &packed;
+    }
+    if( values != FP32 && b % per_parameter == 0 ){
+      pack_half( values, data->size(), data->data(), (uint16_t *)out );
+    }else if( data != blocks[b] ){
+      std::memcpy( out, data->data(), data->size() * sizeof( F ) );
+    }else{
+      std::memcpy( &buf[ offsets[b] ], blocks[b]->data(), blocks[b]->size() * sizeof( F ) );
+    }
+  }
+  FILE * fp = fopen( filename.c_str(), "wb" );
+  if( fp == nullptr ){
+    throw "cannot write " + filename;
+  }
+  size_t written = fwrite( buf.data(), 1, buf.size(), fp );
+  fclose( fp );
+  if( written != buf.size() ){
+    throw "cannot write " + filename;
+  }
+}
+
+// reads the parameters of a checkpoint into the network starting at input,
+// which must have been constructed with the same topology
+// the file is mapped, so loading is one copy per parameter without any parsing
+// returns true when the optimizer state was restored too
+bool load_checkpoint( Layer & input, std::string filename ){
+  MappedFile file( filename );
+  const char * p = (const char *)file.data();
+  uint32_t header[3];
+  if( file.size() < 16 || std::memcmp( p, CHECKPOINT_MAGIC, 4 ) != 0 ){
+    throw "not a checkpoint " + filename;
+  }
+  std::memcpy( header, p + 4, sizeof( header ) );
+  if( header[0] != 1 && header[0] != CHECKPOINT_VERSION ){
+    throw "unsupported checkpoint version " + std::to_string( header[0] );
+  }
+  std::vector<Layer *> layers = network_layers( input );
+  if( header[1] != layers.size() ){
+    throw "checkpoint has " + std::to_string( header[1] ) + " layers, the network has " + std::to_string( layers.size() );
+  }
+  bool optimizer_state = header[2] & CHECKPOINT_OPTIMIZER_STATE;
+  bool sparse = header[2] & CHECKPOINT_SPARSE;
+  Precision values = (Precision)( ( header[2] & CHECKPOINT_PRECISION_MASK ) >> CHECKPOINT_PRECISION_SHIFT );
+  if( values > FP16 ){
+    throw "unknown precision in checkpoint " + filename;
+  }
+  size_t value_size = values == FP32 ? sizeof( F ) : sizeof( uint16_t );
+  // the tables are checked against the file before anything is read from them
+  size_t layer_table = layers.size() * sizeof( CheckpointLayer );
+  if( !in_file( file.size(), 16, layer_table ) ){
+    throw "not compatible parameter table in " + filename;
+  }
+  const CheckpointLayer * ls = (const CheckpointLayer *)( p + 16 );
+  uint64_t stored_params = 0;
+  for(int i = 0; i < layers.size(); i++){
+    stored_params += ls[i].parameters;
+  }
+  if( !in_file( file.size(), 16 + layer_table, stored_params * sizeof( CheckpointParameter ) ) ){
+    throw "not compatible parameter table in " + filename;
+  }
+  const CheckpointParameter * ps = (const CheckpointParameter *)( ls + layers.size() );
+  for(int i = 0; i < layers.size(); i++){
+    std::vector<Layer::Parameter> params = layers[i]->parameters();
+    if( ls[i].units != layers[i]->units || ls[i].inputs != layers[i]->inputs || ls[i].parameters != params.size() ){
+      throw "not compatible layer " + layers[i]->layer_name + " ( checkpoint has " + std::string( ls[i].name ) + " )";
+    }
+    for(int k = 0; k < params.size(); k++, ps++){
+      if( ps->size != params[k].value->size() || !in_file( file.size(), ps->value, 0 ) ){
+        throw "not compatible parameter of " + layers[i]->layer_name;
+      }
+      size_t stored = ps->size;
+      const char * data = p + ps->value;
+      const uint64_t * bitmap = nullptr;
+      if( sparse ){
+        size_t words = bitmap_words( ps->size );
+        if( !in_file( file.size(), ps->value, words * sizeof( uint64_t ) ) ){
+          throw "not compatible parameter of " + layers[i]->layer_name;
+        }
+        bitmap = (const uint64_t *)data;
+        // no bits past the parameter, so the nonzero values fit in it
+        if( ps->size % 64 != 0 && bitmap[ words - 1 ] >> ( ps->size % 64 ) != 0 ){
+          throw "not compatible parameter of " + layers[i]->layer_name;
+        }
+        stored = 0;
+        for(size_t w = 0; w < words; w++){
+          stored += __builtin_popcountll( bitmap[w] );
+        }
+        data += words * sizeof( uint64_t );
+      }
+      if( !in_file( file.size(), data - p, stored * value_size ) ){
+        throw "not compatible parameter of " + layers[i]->layer_name;
+      }
+      if( optimizer_state && ( !in_file( file.size(), ps->d, ps->size * sizeof( F ) ) ||
+                               !in_file( file.size(), ps->sum_square_grad, ps->size * sizeof( F ) ) ) ){
+        throw "not compatible parameter of " + layers[i]->layer_name;
+      }
+      vec & value = *params[k].value;
+      if( values == FP32 ){
+        std::memcpy( value.data(), data, stored * sizeof( F ) );
+      }else{
+        unpack_half( values, stored, (const uint16_t *)data, value.data() );
+      }
+      if( sparse ){
+        // the nonzero values, unpacked at the front, moved to their places from the back
+        for(size_t n = ps->size; n-- > 0; ){
+          value[n] = bitmap[ n / 64 ] >> ( n % 64 ) & 1 ? value[ --stored ] : 0;
+        }
+      }
+      if( optimizer_state ){
+        std::memcpy( params[k].d->data(), p + ps->d, ps->size * sizeof( F ) );
+        std::memcpy( params[k].sum_square_grad->data(), p + ps->sum_square_grad, ps->size * sizeof( F ) );
+      }
+    }
+    FullyConnectedLayer * fc = dynamic_cast<FullyConnectedLayer *>( layers[i] );
+    if( fc != nullptr ){
+      fc->prune_zeros( header[0] == 1 ? 0 : ls[i].pruning );
+    }
+    layers[i]->parameters_updated();
+  }
+  return optimizer_state;
+}
+
+#endif
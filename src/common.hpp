@@ -4,9 +4,46 @@
 #include <string>
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <new>
 
 typedef float F;
-typedef std::vector<F> vec;
+
+#ifdef NN_COUNT_ALLOCATIONS
+#include <atomic>
+// heap allocations of the program so far ( see heap_allocations in memory_plan.hpp )
+std::atomic<long> heap_allocation_count( 0 );
+#endif
+
+// allocator handing out cache line (64 byte) aligned storage
+template <class T, int ALIGN = 64>
+class AlignedAllocator {
+public:
+  typedef T value_type;
+  template <class U> struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+  AlignedAllocator(){ }
+  template <class U> AlignedAllocator( const AlignedAllocator<U, ALIGN> & ){ }
+  T * allocate( std::size_t n ){
+    void * p = nullptr;
+    if( n == 0 ) n = 1;
+#ifdef NN_COUNT_ALLOCATIONS
+    heap_allocation_count++;
+#endif
+    if( posix_memalign( &p, ALIGN, n * sizeof(T) ) != 0 ){
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>( p );
+  }
+  void deallocate( T * p, std::size_t ){
+    free( p );
+  }
+};
+template <class T, class U, int ALIGN>
+bool operator==( const AlignedAllocator<T, ALIGN> &, const AlignedAllocator<U, ALIGN> & ){ return true; }
+template <class T, class U, int ALIGN>
+bool operator!=( const AlignedAllocator<T, ALIGN> &, const AlignedAllocator<U, ALIGN> & ){ return false; }
+
+typedef std::vector<F, AlignedAllocator<F> > vec;
 typedef std::vector<vec> mat;
 
 #endif
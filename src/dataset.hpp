@@ -0,0 +1,190 @@
+#ifndef DATASET
+#define DATASET
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.hpp"
+
+// a read-only memory mapping of a whole file
+class MappedFile {
+public:
+  MappedFile( std::string filename ){
+    fd = open( filename.c_str(), O_RDONLY );
+    if( fd < 0 ){
+      throw "cannot open " + filename;
+    }
+    struct stat st;
+    fstat( fd, &st );
+    length = st.st_size;
+    ptr = nullptr;
+    if( length > 0 ){
+      ptr = (const unsigned char *)mmap( nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if( ptr == MAP_FAILED ){
+        close( fd );
+        throw "cannot map " + filename;
+      }
+    }
+  }
+  ~MappedFile(){
+    if( ptr != nullptr ) munmap( (void *)ptr, length );
+    close( fd );
+  }
+  const unsigned char * data() const { return ptr; }
+  size_t size() const { return length; }
+private:
+  int fd;
+  size_t length;
+  const unsigned char * ptr;
+  MappedFile( const MappedFile & );
+  MappedFile & operator=( const MappedFile & );
+};
+
+enum TensorType {
+  UINT8_TENSOR = 0,   // pixels 0-255, normalized to [0, 1] when read
+  FLOAT32_TENSOR = 1  // already normalized
+};
+
+// packed tensor file, all integers little endian
+//   "NNTS", type, count, channel, h, w, data offset   ( 7 x 4 bytes )
+//   labels                                            ( count bytes )
+//   samples from data offset, a multiple of 64        ( count x channel x h x w elements )
+const char PACKED_MAGIC[4] = { 'N', 'N', 'T', 'S' };
+const int PACKED_HEADER_SIZE = 28;
+
+// samples of a dataset file, read straight from the mapping without copying
+// the file is either a packed tensor file or a pair of MNIST IDX files
+// ( images with magic 0x803 and labels with magic 0x801 )
+class TensorDataset {
+public:
+  TensorDataset( std::string filename ) : file( filename ), label_file( nullptr ){
+    const unsigned char * p = file.data();
+    if( file.size() >= PACKED_HEADER_SIZE && std::memcmp( p, PACKED_MAGIC, 4 ) == 0 ){
+      uint32_t h[6];
+      std::memcpy( h, p + 4, sizeof( h ) );
+      type = (TensorType)h[0];
+      count = h[1];
+      channel = h[2];
+      height = h[3];
+      width = h[4];
+      labels = p + PACKED_HEADER_SIZE;
+      samples = p + h[5];
+      if( h[5] + (size_t)count * sample_size() * element_size() > file.size() ){
+        throw "truncated dataset " + filename;
+      }
+    }else{
+      read_idx_images( filename );
+      labels = nullptr;
+    }
+  }
+  TensorDataset( std::string images_filename, std::string labels_filename ) : file( images_filename ){
+    read_idx_images( images_filename );
+    label_file = new MappedFile( labels_filename );
+    const unsigned char * p = label_file->data();
+    if( label_file->size() < 8 || idx_int( p ) != 0x801 || idx_int( p + 4 ) != count ){
+      delete label_file;
+      throw "not compatible label file " + labels_filename;
+    }
+    labels = p + 8;
+  }
+  ~TensorDataset(){
+    delete label_file;
+  }
+  int size() const { return count; }
+  int sample_size() const { return channel * height * width; }
+  int element_size() const { return type == FLOAT32_TENSOR ? 4 : 1; }
+  bool has_labels() const { return labels != nullptr; }
+  int label( int i ) const { return labels[i]; }
+
+  // zero-copy views; samples i, i+1, ... are contiguous
+  const F * float_sample( int i ) const {
+    return (const F *)samples + (size_t)i * sample_size();
+  }
+  const unsigned char * uint8_sample( int i ) const {
+    return samples + (size_t)i * sample_size();
+  }
+  // n samples from i normalized into out = [ n x sample_size ]
+  void read( int i, int n, F * out ) const {
+    size_t len = (size_t)n * sample_size();
+    if( type == FLOAT32_TENSOR ){
+      std::memcpy( out, float_sample( i ), len * sizeof( F ) );
+    }else{
+      const unsigned char * s = uint8_sample( i );
+      for(size_t k = 0; k < len; k++){
+        out[k] = s[k] * ( (F)1.0 / 255 );
+      }
+    }
+  }
+  vec sample( int i ) const {
+    vec v( sample_size() );
+    read( i, 1, v.data() );
+    return v;
+  }
+
+  TensorType type;
+  int count;
+  int channel;
+  int height;
+  int width;
+private:
+  MappedFile file;
+  MappedFile * label_file;
+  const unsigned char * labels;
+  const unsigned char * samples;
+
+  static uint32_t idx_int( const unsigned char * p ){
+    // IDX integers are big endian
+    return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) | ( (uint32_t)p[2] << 8 ) | p[3];
+  }
+  void read_idx_images( std::string filename ){
+    const unsigned char * p = file.data();
+    if( file.size() < 16 || idx_int( p ) != 0x803 ){
+      throw "unknown dataset format " + filename;
+    }
+    type = UINT8_TENSOR;
+    count = idx_int( p + 4 );
+    channel = 1;
+    height = idx_int( p + 8 );
+    width = idx_int( p + 12 );
+    samples = p + 16;
+    if( 16 + (size_t)count * sample_size() > file.size() ){
+      throw "truncated dataset " + filename;
+    }
+  }
+};
+
+// writes a packed tensor file; data holds count samples of type t
+void save_packed_dataset( std::string filename, TensorType t, int count, int ch, int h, int w,
+                          const unsigned char * labels, const void * data ){
+  FILE * fp = fopen( filename.c_str(), "wb" );
+  if( fp == nullptr ){
+    throw "cannot write " + filename;
+  }
+  size_t offset = ( PACKED_HEADER_SIZE + count + 63 ) / 64 * 64;
+  uint32_t h6[6] = { (uint32_t)t, (uint32_t)count, (uint32_t)ch, (uint32_t)h, (uint32_t)w, (uint32_t)offset };
+  fwrite( PACKED_MAGIC, 1, 4, fp );
+  fwrite( h6, 4, 6, fp );
+  fwrite( labels, 1, count, fp );
+  std::vector<char> pad( offset - PACKED_HEADER_SIZE - count, 0 );
+  fwrite( pad.data(), 1, pad.size(), fp );
+  fwrite( data, t == FLOAT32_TENSOR ? 4 : 1, (size_t)count * ch * h * w, fp );
+  fclose( fp );
+}
+
+// samples sorted by label, as load_dataset does for the PNG directories
+void load_dataset( const TensorDataset & d, std::vector<std::vector<vec> > & dataset, int size ){
+  if( !d.has_labels() ){
+    throw std::string( "dataset has no labels" );
+  }
+  dataset.resize(10);
+  for(int i = 0; i < d.size(); i++){
+    int l = d.label( i );
+    if( size != -1 && dataset[l].size() >= size ) continue;
+    dataset[l].push_back( d.sample( i ) );
+  }
+}
+
+#endif
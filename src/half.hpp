@@ -0,0 +1,291 @@
+#ifndef HALFPRECISION
+#define HALFPRECISION
+#include <cstdint>
+#include <cstring>
+#include "common.hpp"
+#include "simd.hpp"
+#include "matrix.hpp"
+
+// storage formats of parameters; arithmetic is always done in fp32
+//   BF16  the upper 16 bits of a float, 8 bit exponent and 7 bit mantissa
+//   FP16  IEEE half, 5 bit exponent and 10 bit mantissa, |x| <= 65504
+enum Precision {
+  FP32 = 0,
+  BF16 = 1,
+  FP16 = 2
+};
+
+typedef std::vector<uint16_t, AlignedAllocator<uint16_t> > hvec;
+
+std::string precision_name( Precision p ){
+  return p == BF16 ? "bf16" : p == FP16 ? "fp16" : "fp32";
+}
+
+inline uint32_t float_bits( F x ){
+  uint32_t u;
+  std::memcpy( &u, &x, 4 );
+  return u;
+}
+
+inline F bits_float( uint32_t u ){
+  F x;
+  std::memcpy( &x, &u, 4 );
+  return x;
+}
+
+// conversions round to nearest even, as the vector instructions do
+inline uint16_t float_to_bf16( F x ){
+  uint32_t u = float_bits( x );
+  if( ( u & 0x7fffffff ) > 0x7f800000 ){
+    return ( u >> 16 ) | 0x40; // quiet NaN
+  }
+  return ( u + 0x7fff + ( ( u >> 16 ) & 1 ) ) >> 16;
+}
+
+inline F bf16_to_float( uint16_t h ){
+  return bits_float( (uint32_t)h << 16 );
+}
+
+inline uint16_t float_to_fp16( F x ){
+  uint32_t u = float_bits( x );
+  uint16_t sign = ( u >> 16 ) & 0x8000;
+  uint32_t a = u & 0x7fffffff;
+  if( a > 0x7f800000 ){
+    return sign | 0x7e00 | ( ( a >> 13 ) & 0x3ff ); // quiet NaN
+  }
+  if( a >= 0x477ff000 ){
+    return sign | 0x7c00; // 65520 and above round to infinity
+  }
+  if( a < 0x38800000 ){
+    // below 2^-14, a subnormal in steps of 2^-24
+    return sign | (uint16_t)std::nearbyint( bits_float( a ) * 16777216.0f );
+  }
+  // rebias the exponent from 127 to 15 and drop 13 mantissa bits
+  return sign | (uint16_t)( ( a - 0x38000000 + 0xfff + ( ( a >> 13 ) & 1 ) ) >> 13 );
+}
+
+inline F fp16_to_float( uint16_t h ){
+  uint32_t sign = (uint32_t)( h & 0x8000 ) << 16;
+  uint32_t e = ( h >> 10 ) & 0x1f;
+  uint32_t m = h & 0x3ff;
+  if( e == 0 ){
+    F x = m * ( 1.0f / 16777216.0f );
+    return sign ? -x : x;
+  }
+  if( e == 31 ){
+    return bits_float( sign | 0x7f800000 | ( m << 13 ) );
+  }
+  return bits_float( sign | ( ( e + 112 ) << 23 ) | ( m << 13 ) );
+}
+
+// kernels between fp32 and 16 bit storage, indexed by Precision - 1 ( BF16, FP16 )
+struct HalfKernels {
+  std::string name;
+  void (*pack[2])( int n, const F * x, uint16_t * h );   // h = round( x )
+  void (*unpack[2])( int n, const uint16_t * h, F * x ); // x = h
+  F (*dot[2])( int n, const uint16_t * h, const F * x ); // sum h[i] x[i] in fp32
+};
+
+// the kernels of one instruction set over
+//   V, W, zero, fmadd, hsum   a float vector as in simd.hpp
+//   load_bf16, store_bf16,
+//   load_fp16, store_fp16     W 16 bit values to and from a float vector
+#define HALF_KERNELS                                                     \
+  struct BF16Format {                                                    \
+    static V load( const uint16_t * h ){ return load_bf16( h ); }        \
+    static void store( uint16_t * h, V v ){ store_bf16( h, v ); }        \
+    static F to_float( uint16_t h ){ return bf16_to_float( h ); }        \
+    static uint16_t from_float( F x ){ return float_to_bf16( x ); }      \
+  };                                                                     \
+  struct FP16Format {                                                    \
+    static V load( const uint16_t * h ){ return load_fp16( h ); }        \
+    static void store( uint16_t * h, V v ){ store_fp16( h, v ); }        \
+    static F to_float( uint16_t h ){ return fp16_to_float( h ); }        \
+    static uint16_t from_float( F x ){ return float_to_fp16( x ); }      \
+  };                                                                     \
+  template <class Format>                                                \
+  void pack( int n, const F * x, uint16_t * h ){                         \
+    int i = 0;                                                           \
+    for(; i + W <= n; i += W){                                           \
+      Format::store( h + i, loadu( x + i ) );                            \
+    }                                                                    \
+    for(; i < n; i++){                                                   \
+      h[i] = Format::from_float( x[i] );                                 \
+    }                                                                    \
+  }                                                                      \
+  template <class Format>                                                \
+  void unpack( int n, const uint16_t * h, F * x ){                       \
+    int i = 0;                                                           \
+    for(; i + W <= n; i += W){                                           \
+      storeu( x + i, Format::load( h + i ) );                            \
+    }                                                                    \
+    for(; i < n; i++){                                                   \
+      x[i] = Format::to_float( h[i] );                                   \
+    }                                                                    \
+  }                                                                      \
+  template <class Format>                                                \
+  F dot( int n, const uint16_t * h, const F * x ){                       \
+    V s0 = zero(), s1 = zero();                                          \
+    int i = 0;                                                           \
+    for(; i + 2 * W <= n; i += 2 * W){                                   \
+      s0 = fmadd( Format::load( h + i ), loadu( x + i ), s0 );           \
+      s1 = fmadd( Format::load( h + i + W ), loadu( x + i + W ), s1 );   \
+    }                                                                    \
+    for(; i + W <= n; i += W){                                           \
+      s0 = fmadd( Format::load( h + i ), loadu( x + i ), s0 );           \
+    }                                                                    \
+    F r = hsum( add( s0, s1 ) );                                         \
+    for(; i < n; i++){                                                   \
+      r += Format::to_float( h[i] ) * x[i];                              \
+    }                                                                    \
+    return r;                                                            \
+  }
+
+namespace half_scalar {
+  using namespace simd_scalar;
+  inline V load_bf16( const uint16_t * h ){ return bf16_to_float( *h ); }
+  inline void store_bf16( uint16_t * h, V v ){ *h = float_to_bf16( v ); }
+  inline V load_fp16( const uint16_t * h ){ return fp16_to_float( *h ); }
+  inline void store_fp16( uint16_t * h, V v ){ *h = float_to_fp16( v ); }
+  HALF_KERNELS
+}
+
+#ifdef SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+namespace half_avx2 {
+  using namespace simd_avx2;
+  inline V load_bf16( const uint16_t * h ){
+    __m256i u = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *)h ) );
+    return _mm256_castsi256_ps( _mm256_slli_epi32( u, 16 ) );
+  }
+  inline void store_bf16( uint16_t * h, V v ){
+    __m256i u = _mm256_castps_si256( v );
+    __m256i odd = _mm256_and_si256( _mm256_srli_epi32( u, 16 ), _mm256_set1_epi32( 1 ) );
+    __m256i r = _mm256_srli_epi32( _mm256_add_epi32( u, _mm256_add_epi32( odd, _mm256_set1_epi32( 0x7fff ) ) ), 16 );
+    __m256i nan = _mm256_or_si256( _mm256_srli_epi32( u, 16 ), _mm256_set1_epi32( 0x40 ) );
+    r = _mm256_blendv_epi8( r, nan, _mm256_castps_si256( _mm256_cmp_ps( v, v, _CMP_UNORD_Q ) ) );
+    r = _mm256_and_si256( r, _mm256_set1_epi32( 0xffff ) );
+    _mm_storeu_si128( (__m128i *)h, _mm_packus_epi32( _mm256_castsi256_si128( r ), _mm256_extracti128_si256( r, 1 ) ) );
+  }
+  inline V load_fp16( const uint16_t * h ){
+    return _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)h ) );
+  }
+  inline void store_fp16( uint16_t * h, V v ){
+    _mm_storeu_si128( (__m128i *)h, _mm256_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT ) );
+  }
+  HALF_KERNELS
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace half_avx512 {
+  using namespace simd_avx512;
+  inline V load_bf16( const uint16_t * h ){
+    __m512i u = _mm512_cvtepu16_epi32( _mm256_loadu_si256( (const __m256i *)h ) );
+    return _mm512_castsi512_ps( _mm512_slli_epi32( u, 16 ) );
+  }
+  inline void store_bf16( uint16_t * h, V v ){
+    __m512i u = _mm512_castps_si512( v );
+    __m512i odd = _mm512_and_si512( _mm512_srli_epi32( u, 16 ), _mm512_set1_epi32( 1 ) );
+    __m512i r = _mm512_srli_epi32( _mm512_add_epi32( u, _mm512_add_epi32( odd, _mm512_set1_epi32( 0x7fff ) ) ), 16 );
+    __m512i nan = _mm512_or_si512( _mm512_srli_epi32( u, 16 ), _mm512_set1_epi32( 0x40 ) );
+    r = _mm512_mask_blend_epi32( _mm512_cmp_ps_mask( v, v, _CMP_UNORD_Q ), r, nan );
+    _mm256_storeu_si256( (__m256i *)h, _mm512_cvtepi32_epi16( r ) );
+  }
+  inline V load_fp16( const uint16_t * h ){
+    return _mm512_cvtph_ps( _mm256_loadu_si256( (const __m256i *)h ) );
+  }
+  inline void store_fp16( uint16_t * h, V v ){
+    _mm256_storeu_si256( (__m256i *)h, _mm512_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) );
+  }
+  HALF_KERNELS
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bf16")
+namespace half_avx512bf16 {
+  using namespace simd_avx512;
+  using half_avx512::load_bf16;
+  using half_avx512::load_fp16;
+  using half_avx512::store_fp16;
+  inline void store_bf16( uint16_t * h, V v ){
+    // vcvtneps2bf16 rounds to nearest even and quiets NaN in one instruction
+    _mm256_storeu_si256( (__m256i *)h, (__m256i)_mm512_cvtneps_pbh( v ) );
+  }
+  HALF_KERNELS
+}
+#pragma GCC pop_options
+#endif
+
+#define HALF_KERNEL_TABLE(ns, isa_name) {                                             \
+    isa_name,                                                                          \
+    { ns::pack<ns::BF16Format>, ns::pack<ns::FP16Format> },                            \
+    { ns::unpack<ns::BF16Format>, ns::unpack<ns::FP16Format> },                        \
+    { ns::dot<ns::BF16Format>, ns::dot<ns::FP16Format> } }
+
+HalfKernels select_half_kernels(){
+  // NN_SIMD overrides the automatic choice as in simd.hpp
+  const char * env = std::getenv( "NN_SIMD" );
+  std::string isa = env == nullptr ? "" : env;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if( ( isa == "" || isa == "avx512" ) && __builtin_cpu_supports( "avx512f" ) ){
+    if( __builtin_cpu_supports( "avx512bf16" ) ){
+      HalfKernels k = HALF_KERNEL_TABLE( half_avx512bf16, "avx512bf16" );
+      return k;
+    }
+    HalfKernels k = HALF_KERNEL_TABLE( half_avx512, "avx512" );
+    return k;
+  }
+  if( isa != "scalar" && isa != "sse4" && __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ){
+    // every CPU with AVX2 has F16C
+    HalfKernels k = HALF_KERNEL_TABLE( half_avx2, "avx2" );
+    return k;
+  }
+#endif
+  HalfKernels k = HALF_KERNEL_TABLE( half_scalar, "scalar" );
+  return k;
+}
+
+HalfKernels half_kernels = select_half_kernels();
+
+// h = x rounded to p, which is BF16 or FP16
+void pack_half( Precision p, int n, const F * x, uint16_t * h ){
+  half_kernels.pack[ p - 1 ]( n, x, h );
+}
+
+void unpack_half( Precision p, int n, const uint16_t * h, F * x ){
+  half_kernels.unpack[ p - 1 ]( n, h, x );
+}
+
+// C += A B^T ( A = [m x k] in fp32, B = [n x k] stored in p, C = [m x n] )
+// every element of B is converted once per row of A, which is the cheapest
+// for the few rows of inference; larger batches convert a block of B to fp32
+// once and hand it to gemm_nt
+void gemm_nt_half( Precision p, int m, int n, int k, const F * A, int lda, const uint16_t * B, int ldb, F * C, int ldc ){
+  if( m <= 2 ){
+    F (*dot)( int, const uint16_t *, const F * ) = half_kernels.dot[ p - 1 ];
+    for(int i = 0; i < m; i++){
+      const F * a = A + (long)i * lda;
+      F * c = C + (long)i * ldc;
+      for(int j = 0; j < n; j++){
+        c[j] += dot( k, B + (long)j * ldb, a );
+      }
+    }
+    return;
+  }
+  static thread_local vec block;
+  block.resize( (size_t)GEMM_BLOCK_M * k );
+  for(int j0 = 0; j0 < n; j0 += GEMM_BLOCK_M){
+    int j1 = std::min( n, j0 + GEMM_BLOCK_M );
+    for(int j = j0; j < j1; j++){
+      unpack_half( p, k, B + (long)j * ldb, &block[ (size_t)( j - j0 ) * k ] );
+    }
+    gemm_nt( m, j1 - j0, k, A, lda, block.data(), k, C + j0, ldc );
+  }
+}
+
+#endif
@@ -0,0 +1,479 @@
+#ifndef INFERENCESERVER
+#define INFERENCESERVER
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "common.hpp"
+#include "network.hpp"
+
+// a local inference service for a network, over a Unix socket or loopback TCP
+// every message is in the byte order of the machine ( both ends are on it )
+//   server, on connecting   "NNIS", version, inputs, classes      ( 4 x 4 bytes )
+//   request                 id, inputs floats                     ( 4 + 4 inputs bytes )
+//   response                id, class, classes floats              ( 8 + 4 classes bytes )
+// the floats of a response are the outputs of the network, the probabilities of a
+// softmax; requests can be pipelined on a connection, and the responses come back
+// with the id of their request, not necessarily in order
+const char INFERENCE_MAGIC[4] = { 'N', 'N', 'I', 'S' };
+const uint32_t INFERENCE_PROTOCOL_VERSION = 1;
+
+bool read_full( int fd, void * p, size_t n ){
+  char * c = (char *)p;
+  while( n > 0 ){
+    ssize_t r = ::read( fd, c, n );
+    if( r <= 0 ){
+      return false;
+    }
+    c += r;
+    n -= r;
+  }
+  return true;
+}
+bool write_full( int fd, const void * p, size_t n ){
+  const char * c = (const char *)p;
+  while( n > 0 ){
+    ssize_t r = ::send( fd, c, n, MSG_NOSIGNAL );
+    if( r <= 0 ){
+      return false;
+    }
+    c += r;
+    n -= r;
+  }
+  return true;
+}
+
+// listening sockets; a Unix socket replaces a file left at path
+int listen_unix( std::string path ){
+  sockaddr_un a;
+  std::memset( &a, 0, sizeof( a ) );
+  if( path.size() >= sizeof( a.sun_path ) ){
+    throw "socket path too long " + path;
+  }
+  a.sun_family = AF_UNIX;
+  std::strcpy( a.sun_path, path.c_str() );
+  int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+  ::unlink( path.c_str() );
+  if( fd < 0 || ::bind( fd, (sockaddr *)&a, sizeof( a ) ) != 0 || ::listen( fd, 128 ) != 0 ){
+    if( fd >= 0 ) ::close( fd );
+    throw "cannot listen on " + path;
+  }
+  return fd;
+}
+// only on 127.0.0.1
+int listen_tcp( int port ){
+  sockaddr_in a;
+  std::memset( &a, 0, sizeof( a ) );
+  a.sin_family = AF_INET;
+  a.sin_port = htons( port );
+  a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  int fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+  int one = 1;
+  if( fd >= 0 ){
+    ::setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+  }
+  if( fd < 0 || ::bind( fd, (sockaddr *)&a, sizeof( a ) ) != 0 || ::listen( fd, 128 ) != 0 ){
+    if( fd >= 0 ) ::close( fd );
+    throw "cannot listen on port " + std::to_string( port );
+  }
+  return fd;
+}
+int connect_unix( std::string path ){
+  sockaddr_un a;
+  std::memset( &a, 0, sizeof( a ) );
+  a.sun_family = AF_UNIX;
+  std::strncpy( a.sun_path, path.c_str(), sizeof( a.sun_path ) - 1 );
+  int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( fd < 0 || ::connect( fd, (sockaddr *)&a, sizeof( a ) ) != 0 ){
+    if( fd >= 0 ) ::close( fd );
+    throw "cannot connect to " + path;
+  }
+  return fd;
+}
+int connect_tcp( int port ){
+  sockaddr_in a;
+  std::memset( &a, 0, sizeof( a ) );
+  a.sin_family = AF_INET;
+  a.sin_port = htons( port );
+  a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  int fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+  int one = 1;
+  if( fd < 0 || ::connect( fd, (sockaddr *)&a, sizeof( a ) ) != 0 ){
+    if( fd >= 0 ) ::close( fd );
+    throw "cannot connect to port " + std::to_string( port );
+  }
+  ::setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+  return fd;
+}
+
+// serves the network net to any number of connections
+// requests of all the connections are queued and run together: a batch starts when
+// max_batch requests are waiting, or when the oldest of them has waited max_latency_us,
+// so under load the batches grow and the cost per sample falls, and when idle a request
+// waits at most max_latency_us
+// each of the workers runs its batches on its own inference context
+//   InferenceServer server( net, 64, 1000 );
+//   server.start( listen_unix( "/tmp/nn.sock" ) );
+class InferenceServer {
+public:
+  InferenceServer( Network & n, int max_batch = 64, int max_latency_us = 1000, int workers = 1 )
+    : net( n ), max_batch( max_batch ), max_latency( max_latency_us ), worker_count( std::max( 1, workers ) ),
+      listen_fd( -1 ), stopping( false ), served( 0 ), batch_count( 0 ), batch_sizes( max_batch + 1 ) {
+    inputs = net.input().units;
+    classes = net.output().units;
+  }
+  ~InferenceServer(){
+    stop();
+  }
+  // accepts connections on the listening socket fd, which the server then owns
+  void start( int fd ){
+    listen_fd = fd;
+    for(int w = 0; w < worker_count; w++){
+      workers.push_back( std::thread( &InferenceServer::work, this ) );
+    }
+    acceptor = std::thread( &InferenceServer::accept_loop, this );
+  }
+  void stop(){
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      if( stopping ) return;
+      stopping = true;
+      for(int i = 0; i < connections.size(); i++){
+        ::shutdown( connections[i]->fd, SHUT_RDWR );
+      }
+    }
+    ready.notify_all();
+    if( listen_fd >= 0 ){
+      ::shutdown( listen_fd, SHUT_RDWR );
+    }
+    if( acceptor.joinable() ) acceptor.join();
+    for(int w = 0; w < workers.size(); w++){
+      workers[w].join();
+    }
+    for(int r = 0; r < readers.size(); r++){
+      readers[r].join();
+    }
+    if( listen_fd >= 0 ){
+      ::close( listen_fd );
+    }
+  }
+  long requests(){
+    return served;
+  }
+  long batches(){
+    return batch_count;
+  }
+  // batches of each size since the last call, printed as a histogram
+  void print_batch_sizes(){
+    long total = 0, most = 0;
+    std::vector<long> count( batch_sizes.size() );
+    for(int s = 0; s < batch_sizes.size(); s++){
+      count[s] = batch_sizes[s].exchange( 0 );
+      total += count[s];
+      most = std::max( most, count[s] );
+    }
+    for(int s = 1; s < count.size(); s++){
+      if( count[s] == 0 ) continue;
+      std::printf( "  batch %4d %10ld %s\n", s, count[s], std::string( 40 * count[s] / most, '#' ).c_str() );
+    }
+  }
+private:
+  struct Connection {
+    int fd;
+    std::mutex write_mutex;
+    Connection( int f ) : fd( f ) { }
+    ~Connection(){
+      ::close( fd );
+    }
+  };
+  struct Request {
+    std::shared_ptr<Connection> connection;
+    uint32_t id;
+    vec input;
+    std::chrono::steady_clock::time_point arrival;
+  };
+  Network & net;
+  int max_batch;
+  std::chrono::microseconds max_latency;
+  int worker_count;
+  int inputs, classes;
+  int listen_fd;
+  bool stopping;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Request> queue;
+  std::vector<std::shared_ptr<Connection> > connections;
+  std::thread acceptor;
+  std::vector<std::thread> workers, readers;
+  // readers whose connection closed, joined on the next accept
+  std::vector<std::thread::id> finished;
+  std::atomic<long> served, batch_count;
+  std::vector<std::atomic<long> > batch_sizes;
+
+  void accept_loop(){
+    while( true ){
+      int fd = ::accept( listen_fd, nullptr, nullptr );
+      if( fd < 0 ){
+        return;
+      }
+      int one = 1;
+      ::setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+      std::shared_ptr<Connection> c( new Connection( fd ) );
+      uint32_t hello[4];
+      std::memcpy( &hello[0], INFERENCE_MAGIC, 4 );
+      hello[1] = INFERENCE_PROTOCOL_VERSION;
+      hello[2] = inputs;
+      hello[3] = classes;
+      if( !write_full( fd, hello, sizeof( hello ) ) ){
+        continue;
+      }
+      std::lock_guard<std::mutex> lock( mutex );
+      if( stopping ){
+        return;
+      }
+      join_finished();
+      connections.push_back( c );
+      readers.push_back( std::thread( &InferenceServer::read_loop, this, c ) );
+    }
+  }
+  void read_loop( std::shared_ptr<Connection> c ){
+    while( true ){
+      Request r;
+      r.connection = c;
+      r.input.resize( inputs );
+      if( !read_full( c->fd, &r.id, sizeof( r.id ) ) || !read_full( c->fd, r.input.data(), inputs * sizeof( F ) ) ){
+        break;
+      }
+      r.arrival = std::chrono::steady_clock::now();
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        queue.push_back( std::move( r ) );
+      }
+      ready.notify_one();
+    }
+    std::lock_guard<std::mutex> lock( mutex );
+    for(int i = 0; i < connections.size(); i++){
+      if( connections[i] == c ){
+        connections.erase( connections.begin() + i );
+        break;
+      }
+    }
+    finished.push_back( std::this_thread::get_id() );
+  }
+  // joins the readers that have left read_loop, so that a server seeing many short
+  // connections keeps no thread per closed one; called with mutex held, which a
+  // finished reader no longer needs
+  void join_finished(){
+    for(int f = 0; f < finished.size(); f++){
+      for(int r = 0; r < readers.size(); r++){
+        if( readers[r].get_id() == finished[f] ){
+          readers[r].join();
+          readers.erase( readers.begin() + r );
+          break;
+        }
+      }
+    }
+    finished.clear();
+  }
+  void work(){
+    ExecutionContext * ctx = net.create_context( INFERENCE );
+    std::vector<Request> batch;
+    vec in, response( 2 + classes );
+    while( true ){
+      batch.clear();
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        ready.wait( lock, [this]{ return stopping || !queue.empty(); } );
+        if( stopping ) break;
+        // the oldest request decides how long the batch may still wait
+        ready.wait_until( lock, queue.front().arrival + max_latency,
+                          [this]{ return stopping || queue.size() >= max_batch; } );
+        if( stopping ) break;
+        while( !queue.empty() && batch.size() < max_batch ){
+          batch.push_back( std::move( queue.front() ) );
+          queue.pop_front();
+        }
+        if( !queue.empty() ){
+          ready.notify_one();
+        }
+      }
+      if( batch.empty() ){
+        // taken by another worker meanwhile
+        continue;
+      }
+      int n = batch.size();
+      in.resize( (size_t)n * inputs );
+      for(int k = 0; k < n; k++){
+        std::copy( batch[k].input.begin(), batch[k].input.end(), in.begin() + k * inputs );
+      }
+      net.forward( *ctx, in.data(), n );
+      const TensorView & out = net.output().activated_output( *ctx );
+      for(int k = 0; k < n; k++){
+        const F * y = &out[ k * classes ];
+        int32_t cls = std::max_element( y, y + classes ) - y;
+        uint32_t header[2] = { batch[k].id, (uint32_t)cls };
+        std::memcpy( &response[0], header, sizeof( header ) );
+        std::copy( y, y + classes, response.begin() + 2 );
+        Connection & c = *batch[k].connection;
+        std::lock_guard<std::mutex> lock( c.write_mutex );
+        write_full( c.fd, response.data(), response.size() * sizeof( F ) );
+      }
+      served += n;
+      batch_count++;
+      batch_sizes[n]++;
+    }
+    delete ctx;
+  }
+};
+
+// one connection to an InferenceServer
+//   InferenceClient client( connect_unix( "/tmp/nn.sock" ) );
+//   int digit = client.classify( image.data() );
+class InferenceClient {
+public:
+  int inputs, classes;
+
+  // fd is a connected socket, which the client then owns
+  InferenceClient( int f ) : fd( f ) {
+    uint32_t hello[4];
+    if( !read_full( fd, hello, sizeof( hello ) ) || std::memcmp( &hello[0], INFERENCE_MAGIC, 4 ) != 0 ){
+      ::close( fd );
+      throw "not an inference server";
+    }
+    if( hello[1] != INFERENCE_PROTOCOL_VERSION ){
+      ::close( fd );
+      throw "unsupported inference protocol version " + std::to_string( hello[1] );
+    }
+    inputs = hello[2];
+    classes = hello[3];
+  }
+  ~InferenceClient(){
+    ::close( fd );
+  }
+  // a request of the inputs floats x
+  bool send( uint32_t id, const F * x ){
+    std::lock_guard<std::mutex> lock( write_mutex );
+    return write_full( fd, &id, sizeof( id ) ) && write_full( fd, x, inputs * sizeof( F ) );
+  }
+  // the next response; probabilities, of classes floats, may be nullptr
+  bool receive( uint32_t & id, int & cls, F * probabilities ){
+    uint32_t header[2];
+    if( !read_full( fd, header, sizeof( header ) ) ){
+      return false;
+    }
+    id = header[0];
+    cls = (int32_t)header[1];
+    buffer.resize( classes );
+    if( !read_full( fd, buffer.data(), classes * sizeof( F ) ) ){
+      return false;
+    }
+    if( probabilities != nullptr ){
+      std::copy( buffer.begin(), buffer.end(), probabilities );
+    }
+    return true;
+  }
+  // the class of x, waiting for the answer; only when no other request is pending
+  int classify( const F * x, F * probabilities = nullptr ){
+    uint32_t id;
+    int cls;
+    if( !send( 0, x ) || !receive( id, cls, probabilities ) ){
+      throw "inference server closed the connection";
+    }
+    return cls;
+  }
+  // stops the reads of receive() and the writes of send()
+  void shutdown(){
+    ::shutdown( fd, SHUT_RDWR );
+  }
+private:
+  int fd;
+  std::mutex write_mutex;
+  vec buffer;
+  InferenceClient( const InferenceClient & );
+  InferenceClient & operator=( const InferenceClient & );
+};
+
+// latencies counted in buckets of an eighth of a power of two of microseconds
+// ( 9% wide ), from 1 us to about 70 minutes
+class LatencyHistogram {
+public:
+  static const int SUB_BUCKETS = 8;
+  static const int BUCKETS = 32 * SUB_BUCKETS;
+
+  LatencyHistogram() : count( BUCKETS, 0 ), samples( 0 ), sum( 0 ), largest( 0 ) { }
+  void record( double seconds ){
+    double us = seconds * 1e6;
+    count[ bucket( us ) ]++;
+    samples++;
+    sum += us;
+    largest = std::max( largest, us );
+  }
+  void merge( const LatencyHistogram & h ){
+    for(int b = 0; b < BUCKETS; b++){
+      count[b] += h.count[b];
+    }
+    samples += h.samples;
+    sum += h.sum;
+    largest = std::max( largest, h.largest );
+  }
+  long size() const {
+    return samples;
+  }
+  double mean() const {
+    return samples > 0 ? sum / samples : 0;
+  }
+  double max() const {
+    return largest;
+  }
+  // in microseconds, the upper end of the bucket holding the p-th fraction of the samples
+  double percentile( double p ) const {
+    long rank = (long)std::ceil( p * samples ), seen = 0;
+    for(int b = 0; b < BUCKETS; b++){
+      seen += count[b];
+      if( seen >= rank && seen > 0 ){
+        return std::min( upper( b ), largest );
+      }
+    }
+    return largest;
+  }
+  void print() const {
+    std::printf( "  latency us: mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                 mean(), percentile( 0.5 ), percentile( 0.9 ), percentile( 0.99 ), percentile( 0.999 ), max() );
+    long most = *std::max_element( count.begin(), count.end() );
+    for(int b = 0; b < BUCKETS; b++){
+      if( count[b] == 0 ) continue;
+      std::printf( "  %10.1f - %10.1f us %10ld %s\n", b == 0 ? 0.0 : upper( b - 1 ), upper( b ), count[b],
+                   std::string( 40 * count[b] / most, '#' ).c_str() );
+    }
+  }
+private:
+  std::vector<long> count;
+  long samples;
+  double sum, largest;
+
+  static int bucket( double us ){
+    if( us < 1 ) return 0;
+    int b = (int)( std::log2( us ) * SUB_BUCKETS ) + 1;
+    return std::min( b, BUCKETS - 1 );
+  }
+  static double upper( int b ){
+    return std::exp2( (double)b / SUB_BUCKETS );
+  }
+};
+
+#endif
@@ -3,11 +3,19 @@
 #include <opencv2/opencv.hpp>
 #include "common.hpp"
 #include "matrix.hpp"
+#include "dataset.hpp"
 
 std::vector<std::string> enum_filenames(const std::string path);
 vec mat_to_vec( cv::Mat m );
 
 void load_dataset(std::string dataset_dir, std::vector<std::vector<vec> > & dataset, int size){
+  struct stat st;
+  if( stat( dataset_dir.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) ){
+    // a packed tensor file made by convert_dataset
+    TensorDataset d( dataset_dir );
+    load_dataset( d, dataset, size );
+    return;
+  }
   dataset.resize(10);
   for(int i = 0; i < 10; i++){
     std::vector<std::string> mnist_dataset_filenames;
@@ -24,7 +32,39 @@ void load_dataset(std::string dataset_dir, std::vector<std::vector<vec> > & data
   load_dataset(dataset_dir, dataset, -1);
 }
 
-void save_image( std::string filename, std::vector<F> v, int h, int w ){
+// packs the PNG directories dataset_dir/0, ..., dataset_dir/9 into one file
+void convert_dataset( std::string dataset_dir, std::string filename, TensorType t ){
+  std::vector<unsigned char> labels;
+  std::vector<unsigned char> pixels;
+  vec values;
+  int h = 0, w = 0;
+  for(int i = 0; i < 10; i++){
+    for( std::string f : enum_filenames( dataset_dir + "/" + std::to_string(i) + "/" ) ){
+      cv::Mat m = cv::imread( f, 0 );
+      if( labels.empty() ){
+        h = m.rows;
+        w = m.cols;
+      }
+      if( m.rows != h || m.cols != w ){
+        throw "image size differs: " + f;
+      }
+      labels.push_back( i );
+      for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++){
+          if( t == FLOAT32_TENSOR ){
+            values.push_back( (F)m.at<uchar>( y, x ) / 255.0 );
+          }else{
+            pixels.push_back( m.at<uchar>( y, x ) );
+          }
+        }
+      }
+    }
+  }
+  const void * data = ( t == FLOAT32_TENSOR ) ? (const void *)values.data() : (const void *)pixels.data();
+  save_packed_dataset( filename, t, labels.size(), 1, h, w, labels.data(), data );
+}
+
+void save_image( std::string filename, const vec & v, int h, int w ){
   std::cout << "saving image... " << filename << std::endl;
   cv::Mat image = cv::Mat::zeros( h, w, CV_8UC1);
   for(int i = 0; i < h; i++){
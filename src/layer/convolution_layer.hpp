@@ -2,12 +2,45 @@
 #define CONVLUTIONLAYER
 #include "layer_base.hpp"
 #include "layer_2d.hpp"
+#include "../winograd.hpp"
+
+// how a convolution layer computes its forward pass
+enum ConvolutionEngine {
+  DIRECT_CONVOLUTION, // nested loop over every filter tap
+  IM2COL_CONVOLUTION,      // lowers the input with im2col, then one GEMM per mini-batch
+  WINOGRAD_2X2_CONVOLUTION, // Winograd F(2x2,3x3), 2.25x fewer multiplications
+  WINOGRAD_4X4_CONVOLUTION, // Winograd F(4x4,3x3), 4x fewer multiplications
+  BLOCKED_CONVOLUTION       // direct convolution on channel blocked images, one vector of output channels per pixel
+};
+
+// per context buffers of the im2col and Winograd engines
+struct ConvolutionState : public LayerState {
+  // lowered input [ taps x (batch_size * unit_h * unit_w) ] and its product with the filters
+  // ( Winograd: transformed input tiles [ alpha^2 x tiles x prev_channel ] and their products )
+  vec cols;
+  vec conv_output;
+  // delta as [ channel x (batch_size * unit_h * unit_w) ] and its product with the filters
+  // ( Winograd: transformed delta tiles and their products )
+  vec conv_delta;
+  vec cols_delta;
+  // channel last image of the Winograd engines
+  vec tile_image;
+  // rows of a pooling window, fused with a pooling
+  std::vector<const F *> window_rows;
+  // gradients of the blocked engine in its own order
+  vec blocked_grad;
+  // gradient of the transformed filters of the Winograd engines [ alpha^2 x prev_channel x channel ]
+  vec winograd_grad;
+  // blocked engine: cols and conv_delta hold the padded blocked inputs and deltas of
+  // the whole mini-batch, conv_output and cols_delta the products of one sample
+};
 
 class ConvolutionLayer : public Layer2D {
   // stride = 1
 public:
   ConvolutionLayer(){ }
   ConvolutionLayer(int ch, int fs, Layer * prev, int pch, int ph, int pw, ActivationFunction * af, std::string ln) {
+    channel = ch;
     filter_size = fs;
     prev_channel = pch;
     prev_h = ph;
@@ -15,6 +48,7 @@ public:
     if( prev->units != prev_channel * prev_h * prev_w ){
       throw "not compatible layer size";
     }
+    padding = 0;
     unit_h = prev_h - 2 * ( filter_size / 2 );
     unit_w = prev_w - 2 * ( filter_size / 2 );
     init( channel * unit_h * unit_w, prev, af, "convolution : " + ln );
@@ -23,87 +57,513 @@ public:
   ConvolutionLayer(int ch, int fs, Layer2D * prev, ActivationFunction * af, std::string ln) {
     channel = ch;
     filter_size = fs;
+    padding = 0;
     unit_h = prev->unit_h - 2 * ( filter_size / 2 );
-    unit_w = prev->unit_h - 2 * ( filter_size / 2 );
+    unit_w = prev->unit_w - 2 * ( filter_size / 2 );
     prev_channel = prev->channel;
     prev_h = prev->unit_h;
     prev_w = prev->unit_w;
     init( channel * unit_h * unit_w, prev, af, "[convolution]" + ln );
     init_conv();
   }
-  virtual void propagate(){
-    vec & z = previous_layer->activated_output;
-    for(int ch = 0; ch < channel; ch++){
-      for(int h = 0; h < unit_h; h++){
-        for(int w = 0; w < unit_w; w++){
-          int idx = unit_coord(ch, h, w);
-          unit_output[ idx ] = bias[ ch ];
-          for(int pch = 0; pch < prev_channel; pch++){
-            for(int p = 0; p < filter_size; p++){
-              for(int q = 0; q < filter_size; q++){
-                unit_output[ idx ] += z[ prev_coord( pch, h + p, w + q ) ] * filter[ filter_coord(ch, pch, p, q) ];
+  virtual void forward( ExecutionContext & ctx ){
+    if( fused_pooling ){
+      // the next layer runs propagate_pooled()
+      return;
+    }
+    if( state( ctx ).activated_output.size() != ctx.batch_size * units ){
+      throw "the context was planned while " + layer_name + " was fused, set its batch size again";
+    }
+    if( engine == IM2COL_CONVOLUTION ){
+      propagate_im2col( ctx );
+    }else if( engine == WINOGRAD_2X2_CONVOLUTION ){
+      propagate_winograd<2>( ctx );
+    }else if( engine == WINOGRAD_4X4_CONVOLUTION ){
+      propagate_winograd<4>( ctx );
+    }else if( engine == BLOCKED_CONVOLUTION ){
+      propagate_blocked( ctx );
+    }else{
+      propagate_direct( ctx );
+    }
+  }
+  virtual void propagate_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    for(int n = 0; n < st.batch_size; n++){
+      const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+      F * y = &st.unit_output[ n * units ];
+      F * a = &st.activated_output[ n * units ];
+      for(int ch = 0; ch < channel; ch++){
+        for(int h = 0; h < unit_h; h++){
+          for(int w = 0; w < unit_w; w++){
+            int idx = unit_coord(ch, h, w);
+            y[ idx ] = bias[ ch ];
+            for(int pch = 0; pch < prev_channel; pch++){
+              for(int p = 0; p < filter_size; p++){
+                for(int q = 0; q < filter_size; q++){
+                  y[ idx ] += z[ prev_coord( pch, h + p, w + q ) ] * filter[ filter_coord(ch, pch, p, q) ];
+                }
               }
             }
           }
-          activated_output[ idx ] = activation_func->f( unit_output[ idx ] );
+        }
+      }
+      activate( activation_func, units, y, a );
+    }
+  }
+  void propagate_im2col( ExecutionContext & ctx ){
+    // unit_output[n][ch] = bias[ch] + filter[ch] * cols[n]
+    ConvolutionState & st = conv_state( ctx );
+    int taps = prev_channel * filter_size * filter_size;
+    int plane = unit_h * unit_w;
+    int ld = st.batch_size * plane;
+    st.cols.resize( taps * ld );
+    st.conv_output.resize( channel * ld );
+    for(int n = 0; n < st.batch_size; n++){
+      im2col( &previous_layer->activated_output( ctx )[ n * inputs ], prev_channel, prev_h, prev_w,
+              filter_size, padding, unit_h, unit_w, &st.cols[ n * plane ], ld );
+    }
+    std::fill( st.conv_output.begin(), st.conv_output.end(), 0 );
+    gemm_nn( channel, ld, taps, filter.data(), taps, st.cols.data(), ld, st.conv_output.data(), ld );
+    for(int n = 0; n < st.batch_size; n++){
+      for(int ch = 0; ch < channel; ch++){
+        bias_activate( activation_func, plane, bias[ ch ], &st.conv_output[ ch * ld + n * plane ],
+                       &st.unit_output[ n * units + ch * plane ], &st.activated_output[ n * units + ch * plane ] );
+      }
+    }
+  }
+  template <int M>
+  void propagate_winograd( ExecutionContext & ctx ){
+    // transformed products [ tiles x channel ] = transformed input [ tiles x prev_channel ]
+    // * transformed filters [ prev_channel x channel ], one GEMM per xi
+    ConvolutionState & st = conv_state( ctx );
+    const int A2 = Winograd<M>::ALPHA * Winograd<M>::ALPHA;
+    int tiles_h = ( unit_h + M - 1 ) / M, tiles_w = ( unit_w + M - 1 ) / M;
+    int tiles = tiles_h * tiles_w;
+    int ld = st.batch_size * tiles;
+    int ldc = winograd_lanes( prev_channel ), ldk = winograd_lanes( channel );
+    st.cols.resize( A2 * ld * ldc );
+    st.conv_output.resize( A2 * ld * ldk );
+    st.tile_image.resize( ( tiles_h * M + 2 ) * ( tiles_w * M + 2 ) * std::max( ldc, ldk ) );
+    for(int n = 0; n < st.batch_size; n++){
+      winograd_input_tiles<M>( &previous_layer->activated_output( ctx )[ n * inputs ], prev_channel, prev_h, prev_w, padding,
+                               tiles_h, tiles_w, st.tile_image.data(), &st.cols[ n * tiles * ldc ], ld, ldc );
+    }
+    std::fill( st.conv_output.begin(), st.conv_output.end(), 0 );
+    for(int xi = 0; xi < A2; xi++){
+      gemm_nn( ld, ldk, prev_channel, &st.cols[ xi * ld * ldc ], ldc,
+               &winograd_filters[ xi * ldc * ldk ], ldk, &st.conv_output[ xi * ld * ldk ], ldk );
+    }
+    int plane = unit_h * unit_w;
+    for(int n = 0; n < st.batch_size; n++){
+      F * y = &st.unit_output[ n * units ];
+      winograd_output_tiles<M>( &st.conv_output[ n * tiles * ldk ], ld, ldk, channel, unit_h, unit_w,
+                                tiles_h, tiles_w, st.tile_image.data(), y );
+      for(int ch = 0; ch < channel; ch++){
+        bias_activate( activation_func, plane, bias[ ch ], y + ch * plane, y + ch * plane,
+                       &st.activated_output[ n * units + ch * plane ] );
+      }
+    }
+  }
+  void propagate_blocked( ExecutionContext & ctx ){
+    // each sample is copied into a padded blocked image, convolved, and written in this layer's layout
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int cblocks = ( prev_channel + B - 1 ) / B, kblocks = ( channel + B - 1 ) / B;
+    int ph = unit_h + filter_size - 1, pw = unit_w + filter_size - 1;
+    long isize = (long)cblocks * ph * pw * B;
+    st.cols.resize( st.batch_size * isize );
+    st.conv_output.resize( (long)kblocks * unit_h * unit_w * B );
+    for(int n = 0; n < st.batch_size; n++){
+      to_blocked( &previous_layer->activated_output( ctx )[ n * inputs ], prev_channel, prev_h, prev_w, prev_block,
+                  &st.cols[ n * isize ], B, ph, pw, padding, padding );
+      simd.conv_blocked( prev_channel, filter_size, &st.cols[ n * isize ], ph, pw, blocked_filters.data(), blocked_bias.data(),
+                         kblocks, unit_h, unit_w, st.conv_output.data() );
+      from_blocked( st.conv_output.data(), B, channel, unit_h, unit_w, &st.unit_output[ n * units ], block, false );
+      // the bias is added by the kernel, the activation follows while the sample is in cache
+      activate( activation_func, units, &st.unit_output[ n * units ], &st.activated_output[ n * units ] );
+    }
+  }
+  // this layer followed by a max pooling of ps x ps windows every stride pixels, in one
+  // pass: the rows of the convolution are computed into a ring of ps rows, activated and
+  // pooled while they are still in cache, so the full resolution outputs are never written
+  // for each of the out_h x out_w pooled units ( in blocks of out_block channels ), out gets
+  // the max of the activated outputs in its window, arg its position k = s ps + t in the
+  // window ( row ws[k], column wt[k] ) and u the output before the activation there
+  void propagate_pooled( ExecutionContext & ctx, int ps, int stride, int out_h, int out_w, int out_block,
+                         const int * ws, const int * wt, F * out, int8_t * arg, F * u ){
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int kblocks = ( channel + B - 1 ) / B, cblocks = ( prev_channel + B - 1 ) / B;
+    int ph = unit_h + filter_size - 1, pw = unit_w + filter_size - 1;
+    long isize = (long)cblocks * ph * pw * B, row = (long)kblocks * unit_w * B;
+    int out_units = channel * out_h * out_w;
+    st.cols.resize( st.batch_size * isize );
+    st.conv_output.resize( ( 2 * ps + 2 ) * row );
+    F * ring_u = st.conv_output.data(), * ring_a = ring_u + ps * row;
+    F * m = ring_a + ps * row, * k = m + B;
+    st.window_rows.resize( ps );
+    const F ** rows = st.window_rows.data();
+    for(int n = 0; n < st.batch_size; n++){
+      const F * in = &st.cols[ n * isize ];
+      to_blocked( &previous_layer->activated_output( ctx )[ n * inputs ], prev_channel, prev_h, prev_w, prev_block,
+                  &st.cols[ n * isize ], B, ph, pw, padding, padding );
+      int computed = -1;
+      for(int h = 0; h < out_h; h++){
+        int top = h * stride - ps / 2;
+        int r0 = std::max( top, 0 ), r1 = std::min( top + ps, unit_h );
+        for(int r = std::max( r0, computed + 1 ); r < r1; r++){
+          // row r of the convolution into slot r % ps
+          simd.conv_blocked( prev_channel, filter_size, in + (long)r * pw * B, ph, pw, blocked_filters.data(), blocked_bias.data(),
+                             kblocks, 1, unit_w, ring_u + r % ps * row );
+          activate( activation_func, row, ring_u + r % ps * row, ring_a + r % ps * row );
+          computed = r;
+        }
+        for(int kb = 0; kb < kblocks; kb++){
+          int lanes = std::min( B, channel - kb * B );
+          for(int w = 0; w < out_w; w++){
+            int left = w * stride - ps / 2;
+            int q0 = std::max( left, 0 ), q1 = std::min( left + ps, unit_w );
+            for(int r = r0; r < r1; r++){
+              rows[ r - r0 ] = ring_a + r % ps * row + ( (long)kb * unit_w + q0 ) * B;
+            }
+            simd.max_window( rows, r1 - r0, q1 - q0, B, ( r0 - top ) * ps + q0 - left, ps, m, k );
+            for(int i = 0; i < lanes; i++){
+              int a = (int)k[i];
+              int o = n * out_units + blocked_index( kb * B + i, h, w, channel, out_h, out_w, out_block );
+              out[o] = m[i];
+              arg[o] = a;
+              u[o] = ring_u[ ( top + ws[a] ) % ps * row + ( (long)kb * unit_w + left + wt[a] ) * B + i ];
+            }
+          }
         }
       }
     }
-    if( next_layer != nullptr )
-      next_layer->propagate();
   }
-  virtual void back_propagate(){
+  // the delta d of the units of propagate_pooled(), already multiplied by this layer's
+  // activation derivative, added onto the pixels they came from; backward and
+  // compute_gradient read it from there
+  void scatter_pooled_delta( ExecutionContext & ctx, int ps, int stride, int out_h, int out_w, int out_block,
+                             const int * ws, const int * wt, const F * d, const int8_t * arg ){
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int kblocks = ( channel + B - 1 ) / B;
+    int pad = filter_size - 1 - padding;
+    int dh = unit_h + 2 * pad, dw = unit_w + 2 * pad;
+    long dsize = (long)kblocks * dh * dw * B;
+    int out_units = channel * out_h * out_w;
+    st.conv_delta.assign( st.batch_size * dsize, 0 );
+    for(int n = 0; n < st.batch_size; n++){
+      F * cd = &st.conv_delta[ n * dsize ];
+      for(int c = 0; c < channel; c++){
+        F * p = cd + (long)( c / B ) * dh * dw * B + c % B;
+        for(int h = 0; h < out_h; h++){
+          for(int w = 0; w < out_w; w++){
+            int k = n * out_units + blocked_index( c, h, w, channel, out_h, out_w, out_block );
+            int y = h * stride - ps / 2 + ws[ arg[k] ] + pad, x = w * stride - ps / 2 + wt[ arg[k] ] + pad;
+            p[ ( (long)y * dw + x ) * B ] += d[k];
+          }
+        }
+      }
+    }
+  }
+  void set_engine( ConvolutionEngine e ){
+    if( ( e == WINOGRAD_2X2_CONVOLUTION || e == WINOGRAD_4X4_CONVOLUTION ) && filter_size != 3 ){
+      // Winograd is only for 3x3 filters, others use the GEMM engine
+      e = IM2COL_CONVOLUTION;
+    }
+    if( block > 1 || prev_block > 1 ){
+      // the other engines read and write planar images
+      e = BLOCKED_CONVOLUTION;
+    }
+    engine = e;
+    size_blocked_filters();
+    parameters_updated();
+  }
+  virtual bool keeps_outputs(){
+    return !fused_pooling;
+  }
+  // the multiply-adds of the direct convolution whatever the engine, reading the
+  // filters and inputs and writing the outputs of n samples
+  LayerCost convolution_cost( int n ){
+    LayerCost c = { 2.0 * n * units * prev_channel * filter_size * filter_size,
+                    sizeof( F ) * ( (double)filter.size() + n * ( inputs + (double)units ) ) };
+    return c;
+  }
+  // a fused forward is counted by the pooling layer
+  virtual LayerCost cost( ProfilePhase p, int n ){
+    LayerCost c = convolution_cost( n );
+    if( p == FORWARD_PHASE && fused_pooling ){
+      c.flops = c.bytes = 0;
+    }else if( p != GRADIENT_PHASE ){
+      c.bytes += sizeof( F ) * n * (double)( p == FORWARD_PHASE ? units : inputs );
+    }
+    return c;
+  }
+  virtual void set_layout( int in_block, int out_block ){
+    Layer2D::set_layout( in_block, out_block );
+    set_engine( engine );
+  }
+  // the transformed filters of the Winograd engines are computed once per update
+  virtual void parameters_updated(){
+    if( engine == WINOGRAD_2X2_CONVOLUTION || engine == WINOGRAD_4X4_CONVOLUTION ){
+      int alpha = engine == WINOGRAD_2X2_CONVOLUTION ? 4 : 6;
+      int ldc = winograd_lanes( prev_channel ), ldk = winograd_lanes( channel );
+      winograd_filters.resize( alpha * alpha * ldc * ldk );
+      if( alpha == 4 ){
+        winograd_filter<2>( filter.data(), channel, prev_channel, winograd_filters.data(), ldc, ldk );
+      }else{
+        winograd_filter<4>( filter.data(), channel, prev_channel, winograd_filters.data(), ldc, ldk );
+      }
+    }else{
+      vec().swap( winograd_filters );
+    }
+    if( !blocked_filters.empty() ){
+      pack_blocked_filters();
+    }
+  }
+  virtual void backward( ExecutionContext & ctx ){
     // compute previous layer's delta
-    vec & prev_delta = previous_layer->delta;
-    std::fill( prev_delta.begin(), prev_delta.end(), 0 );
-    for(int ch = 0; ch < channel; ch++){
-      for(int pch = 0; pch < prev_channel; pch++){
-        for(int h = 0; h < unit_h; h++){
-          for(int w = 0; w < unit_w; w++){
-            for(int p = 0; p < filter_size; p++){
-              for(int q = 0; q < filter_size; q++){
-                prev_delta[ prev_coord(pch, h + p, w + q) ]
-                += delta[ unit_coord(ch, h, w) ]
-                * filter[ filter_coord(ch, pch, p, q) ]
-                * previous_layer->activation_func->df( previous_layer->unit_output[ prev_coord(pch, h + p, w + q) ] );
+    LayerState & p = previous_layer->state( ctx );
+    std::fill( p.delta.begin(), p.delta.end(), 0 );
+    if( engine == BLOCKED_CONVOLUTION || fused_pooling ){
+      // fused: the delta is already in the blocked engine's buffer, whatever the engine
+      back_propagate_blocked( ctx );
+    }else if( engine == IM2COL_CONVOLUTION ){
+      back_propagate_im2col( ctx );
+    }else if( engine == WINOGRAD_2X2_CONVOLUTION ){
+      back_propagate_winograd<2>( ctx );
+    }else if( engine == WINOGRAD_4X4_CONVOLUTION ){
+      back_propagate_winograd<4>( ctx );
+    }else{
+      back_propagate_direct( ctx );
+    }
+    // the activation derivative is applied once per previous layer unit
+    mul_activation_derivative( previous_layer->activation_func, ctx.batch_size * inputs,
+                               p.unit_output.data(), p.activated_output.data(), p.delta.data() );
+  }
+  virtual void back_propagate_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    TensorView & prev_delta = previous_layer->delta( ctx );
+    for(int n = 0; n < st.batch_size; n++){
+      F * pd = &prev_delta[ n * inputs ];
+      const F * d = &st.delta[ n * units ];
+      for(int ch = 0; ch < channel; ch++){
+        for(int pch = 0; pch < prev_channel; pch++){
+          for(int h = 0; h < unit_h; h++){
+            for(int w = 0; w < unit_w; w++){
+              for(int p = 0; p < filter_size; p++){
+                for(int q = 0; q < filter_size; q++){
+                  pd[ prev_coord(pch, h + p, w + q) ]
+                  += d[ unit_coord(ch, h, w) ]
+                  * filter[ filter_coord(ch, pch, p, q) ];
+                }
               }
             }
           }
         }
       }
     }
-    if( previous_layer != nullptr )
-      previous_layer->back_propagate();
   }
-  virtual void gradient_descent(F learning_rate, F momentum){
-    // update filter weight
+  void back_propagate_im2col( ExecutionContext & ctx ){
+    // prev_delta[n] = col2im( filter^T * delta[n] )
+    ConvolutionState & st = conv_state( ctx );
+    int taps = prev_channel * filter_size * filter_size;
+    int plane = unit_h * unit_w;
+    int ld = st.batch_size * plane;
+    gather_conv_delta( st );
+    st.cols_delta.resize( taps * ld );
+    std::fill( st.cols_delta.begin(), st.cols_delta.end(), 0 );
+    gemm_tn( taps, ld, channel, filter.data(), taps, st.conv_delta.data(), ld, st.cols_delta.data(), ld );
+    for(int n = 0; n < st.batch_size; n++){
+      col2im( &st.cols_delta[ n * plane ], ld, prev_channel, prev_h, prev_w,
+              filter_size, padding, unit_h, unit_w, &previous_layer->delta( ctx )[ n * inputs ] );
+    }
+  }
+  template <int M>
+  void back_propagate_winograd( ExecutionContext & ctx ){
+    // the transpose of propagate_winograd: transformed delta tiles times the transposed
+    // transformed filters, transformed back and added onto the pixels of each input tile
+    ConvolutionState & st = conv_state( ctx );
+    const int A2 = Winograd<M>::ALPHA * Winograd<M>::ALPHA;
+    int tiles_h = ( unit_h + M - 1 ) / M, tiles_w = ( unit_w + M - 1 ) / M;
+    int tiles = tiles_h * tiles_w;
+    int ld = st.batch_size * tiles;
+    int ldc = winograd_lanes( prev_channel ), ldk = winograd_lanes( channel );
+    st.conv_delta.resize( A2 * ld * ldk );
+    st.cols_delta.resize( A2 * ld * ldc );
+    st.tile_image.resize( ( tiles_h * M + 2 ) * ( tiles_w * M + 2 ) * std::max( ldc, ldk ) );
+    for(int n = 0; n < st.batch_size; n++){
+      winograd_output_tiles_t<M>( &st.delta[ n * units ], channel, unit_h, unit_w, tiles_h, tiles_w,
+                                  st.tile_image.data(), &st.conv_delta[ n * tiles * ldk ], ld, ldk );
+    }
+    std::fill( st.cols_delta.begin(), st.cols_delta.end(), 0 );
+    for(int xi = 0; xi < A2; xi++){
+      gemm_nt( ld, prev_channel, ldk, &st.conv_delta[ xi * ld * ldk ], ldk,
+               &winograd_filters[ xi * ldc * ldk ], ldk, &st.cols_delta[ xi * ld * ldc ], ldc );
+    }
+    for(int n = 0; n < st.batch_size; n++){
+      winograd_input_tiles_t<M>( &st.cols_delta[ n * tiles * ldc ], ld, ldc, prev_channel, prev_h, prev_w, padding,
+                                 tiles_h, tiles_w, st.tile_image.data(), &previous_layer->delta( ctx )[ n * inputs ] );
+    }
+  }
+  void back_propagate_blocked( ExecutionContext & ctx ){
+    // the full convolution of the delta, padded by filter_size - 1 - padding, with the
+    // flipped transposed filters
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int cblocks = ( prev_channel + B - 1 ) / B, kblocks = ( channel + B - 1 ) / B;
+    int pad = filter_size - 1 - padding;
+    int dh = unit_h + 2 * pad, dw = unit_w + 2 * pad;
+    long dsize = (long)kblocks * dh * dw * B;
+    st.conv_delta.resize( st.batch_size * dsize );
+    st.cols_delta.resize( (long)cblocks * prev_h * prev_w * B );
+    for(int n = 0; n < st.batch_size; n++){
+      if( !fused_pooling ){
+        // fused: set by scatter_pooled_delta()
+        to_blocked( &st.delta[ n * units ], channel, unit_h, unit_w, block, &st.conv_delta[ n * dsize ], B, dh, dw, pad, pad );
+      }
+      simd.conv_blocked( channel, filter_size, &st.conv_delta[ n * dsize ], dh, dw, blocked_filters_t.data(), nullptr,
+                         cblocks, prev_h, prev_w, st.cols_delta.data() );
+      from_blocked( st.cols_delta.data(), B, prev_channel, prev_h, prev_w, &previous_layer->delta( ctx )[ n * inputs ],
+                    prev_block, true );
+    }
+  }
+  virtual void compute_gradient( ExecutionContext & ctx ){
+    vec & grad_filter = state( ctx ).grads[0];
+    std::fill( grad_filter.begin(), grad_filter.end(), 0 );
+    if( fused_pooling ){
+      compute_filter_gradient_blocked( ctx );
+      compute_bias_gradient_pooled( ctx );
+      return;
+    }
+    if( engine == IM2COL_CONVOLUTION ){
+      compute_filter_gradient_im2col( ctx );
+    }else if( engine == WINOGRAD_2X2_CONVOLUTION ){
+      compute_filter_gradient_winograd<2>( ctx );
+    }else if( engine == WINOGRAD_4X4_CONVOLUTION ){
+      compute_filter_gradient_winograd<4>( ctx );
+    }else if( engine == BLOCKED_CONVOLUTION ){
+      compute_filter_gradient_blocked( ctx );
+    }else{
+      compute_filter_gradient_direct( ctx );
+    }
+    compute_bias_gradient( ctx );
+  }
+  std::vector<Parameter> parameters(){
+    Parameter f = { &filter, &dfilter, &sum_square_grad_filter };
+    Parameter b = { &bias, &dbias, &sum_square_grad_bias };
+    std::vector<Parameter> ps;
+    ps.push_back( f );
+    ps.push_back( b );
+    return ps;
+  }
+  virtual LayerState * create_state(){
+    return new ConvolutionState();
+  }
+  virtual void compute_filter_gradient_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    vec & grad_filter = st.grads[0];
     for(int ch = 0; ch < channel; ch++){
       for(int pch = 0; pch < prev_channel; pch++){
         for(int p = 0; p < filter_size; p++){
           for(int q = 0; q < filter_size; q++){
-            // update filter[ch][pch][p][q] here
-            int filter_idx = filter_coord(ch, pch, p, q);
+            // gradient of filter[ch][pch][p][q]
             F grad = 0;
-            for(int h = 0; h < unit_h; h++){
-              for(int w = 0; w < unit_w; w++){
-                grad += delta[ unit_coord(ch, h, w) ] * previous_layer->activated_output[ prev_coord(pch, h + p, w + q) ];
+            for(int n = 0; n < st.batch_size; n++){
+              const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+              const F * d = &st.delta[ n * units ];
+              for(int h = 0; h < unit_h; h++){
+                for(int w = 0; w < unit_w; w++){
+                  grad += d[ unit_coord(ch, h, w) ] * z[ prev_coord(pch, h + p, w + q) ];
+                }
               }
             }
-            // AdaGrad
-            sum_square_grad_filter[ filter_idx ] += grad * grad;
-            dfilter[ filter_idx ] = - learning_rate * grad / std::sqrt( std::max(sum_square_grad_filter[ filter_idx ], (F)1.0) ) + momentum * dfilter[ filter_idx ];
-            filter[ filter_idx ] += dfilter[ filter_idx ];
+            grad_filter[ filter_coord(ch, pch, p, q) ] = grad;
+          }
+        }
+      }
+    }
+  }
+  void compute_filter_gradient_im2col( ExecutionContext & ctx ){
+    // grad_filter = delta * cols^T, cols is still the lowered input of propagate_im2col()
+    ConvolutionState & st = conv_state( ctx );
+    int taps = prev_channel * filter_size * filter_size;
+    int ld = st.batch_size * unit_h * unit_w;
+    gemm_nt( channel, taps, ld, st.conv_delta.data(), ld, st.cols.data(), ld, st.grads[0].data(), taps );
+  }
+  template <int M>
+  void compute_filter_gradient_winograd( ExecutionContext & ctx ){
+    // gradient of the transformed filters = transformed input^T * transformed delta, per xi,
+    // both still in the context from propagate_winograd() and back_propagate_winograd()
+    ConvolutionState & st = conv_state( ctx );
+    const int A2 = Winograd<M>::ALPHA * Winograd<M>::ALPHA;
+    int ld = st.batch_size * ( ( unit_h + M - 1 ) / M ) * ( ( unit_w + M - 1 ) / M );
+    int ldc = winograd_lanes( prev_channel ), ldk = winograd_lanes( channel );
+    vec & dU = st.winograd_grad;
+    dU.resize( A2 * ldc * ldk );
+    std::fill( dU.begin(), dU.end(), 0 );
+    for(int xi = 0; xi < A2; xi++){
+      gemm_tn( prev_channel, ldk, ld, &st.cols[ xi * ld * ldc ], ldc,
+               &st.conv_delta[ xi * ld * ldk ], ldk, &dU[ xi * ldc * ldk ], ldk );
+    }
+    winograd_filter_t<M>( dU.data(), channel, prev_channel, ldc, ldk, st.grads[0].data() );
+  }
+  void compute_bias_gradient_pooled( ExecutionContext & ctx ){
+    // the delta only exists in the padded blocked buffer of scatter_pooled_delta()
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int kblocks = ( channel + B - 1 ) / B;
+    int pad = filter_size - 1 - padding;
+    int dh = unit_h + 2 * pad, dw = unit_w + 2 * pad;
+    long dsize = (long)kblocks * dh * dw * B;
+    vec & grad = st.blocked_grad;
+    grad.assign( kblocks * B, 0 );
+    for(int n = 0; n < st.batch_size; n++){
+      for(int kb = 0; kb < kblocks; kb++){
+        for(int y = 0; y < unit_h; y++){
+          const F * p = &st.conv_delta[ n * dsize + ( ( (long)kb * dh + y + pad ) * dw + pad ) * B ];
+          for(int x = 0; x < unit_w; x++){
+            for(int i = 0; i < B; i++){
+              grad[ kb * B + i ] += p[ x * B + i ];
+            }
+          }
+        }
+      }
+    }
+    std::copy( grad.begin(), grad.begin() + channel, st.grads[1].begin() );
+  }
+  void compute_filter_gradient_blocked( ExecutionContext & ctx ){
+    // from the padded inputs of propagate_blocked() and deltas of back_propagate_blocked()
+    ConvolutionState & st = conv_state( ctx );
+    const int B = simd.channel_block;
+    int cblocks = ( prev_channel + B - 1 ) / B, kblocks = ( channel + B - 1 ) / B;
+    int ph = unit_h + filter_size - 1, pw = unit_w + filter_size - 1;
+    int pad = filter_size - 1 - padding;
+    int dh = unit_h + 2 * pad, dw = unit_w + 2 * pad;
+    long isize = (long)cblocks * ph * pw * B, dsize = (long)kblocks * dh * dw * B;
+    vec & grad = st.blocked_grad;
+    grad.assign( blocked_filters.size(), 0 );
+    for(int n = 0; n < st.batch_size; n++){
+      simd.conv_blocked_gradient( prev_channel, filter_size, &st.cols[ n * isize ], ph, pw,
+                                  &st.conv_delta[ n * dsize + ( (long)pad * dw + pad ) * B ], dh, dw,
+                                  kblocks, unit_h, unit_w, grad.data() );
+    }
+    for(int k = 0; k < channel; k++){
+      for(int c = 0; c < prev_channel; c++){
+        for(int s = 0; s < filter_size; s++){
+          for(int t = 0; t < filter_size; t++){
+            st.grads[0][ filter_coord( k, c, s, t ) ] = grad[ blocked_filter_coord( k, c, s, t ) ];
           }
         }
       }
     }
-    // update bias
-    update_bias( learning_rate, momentum );
-    if( next_layer != nullptr )
-      next_layer->gradient_descent(learning_rate, momentum);
   }
   
   int filter_size;
+  int padding;
+  ConvolutionEngine engine;
+  // set by MaxPoolingLayer::set_fused, the next layer then computes this one
+  bool fused_pooling;
 
 protected:
   vec bias;
@@ -112,19 +572,82 @@ protected:
   vec filter;
   vec dfilter;
   vec sum_square_grad_filter;
+  vec winograd_filters; // [ alpha^2 x prev_channel x channel ], channels padded by winograd_lanes
+  // filters of the blocked engine [ kblocks x cblocks x fs x fs x B x B ] ( output channel innermost ),
+  // the same flipped and transposed for the backward pass, and the bias [ kblocks x B ]
+  vec blocked_filters, blocked_filters_t, blocked_bias;
 
-  void update_bias(F learning_rate, F momentum){
-    for(int ch = 0; ch < channel; ch++){
-      F grad = 0;
-      for(int h = 0; h < unit_h; h++){
-        for(int w = 0; w < unit_w; w++){
-          grad += delta[ unit_coord( ch, h, w ) ];
+  ConvolutionState & conv_state( ExecutionContext & ctx ){
+    return static_cast<ConvolutionState &>( state( ctx ) );
+  }
+
+  void gather_conv_delta( ConvolutionState & st ){
+    int plane = unit_h * unit_w;
+    int ld = st.batch_size * plane;
+    st.conv_delta.resize( channel * ld );
+    for(int n = 0; n < st.batch_size; n++){
+      for(int ch = 0; ch < channel; ch++){
+        std::copy( &st.delta[ n * units + ch * plane ], &st.delta[ n * units + ch * plane ] + plane,
+                   &st.conv_delta[ ch * ld + n * plane ] );
+      }
+    }
+  }
+
+  void compute_bias_gradient( ExecutionContext & ctx ){
+    // the delta is read in memory order, a block of channels per pixel
+    LayerState & st = state( ctx );
+    vec & grad_bias = st.grads[1];
+    int plane = unit_h * unit_w;
+    std::fill( grad_bias.begin(), grad_bias.end(), 0 );
+    for(int n = 0; n < st.batch_size; n++){
+      const F * d = &st.delta[ n * units ];
+      for(int c0 = 0; c0 < channel; c0 += block){
+        int lanes = std::min( block, channel - c0 );
+        const F * p = d + c0 * plane;
+        for(int k = 0; k < plane; k++){
+          for(int i = 0; i < lanes; i++){
+            grad_bias[ c0 + i ] += p[ k * lanes + i ];
+          }
+        }
+      }
+    }
+  }
+  long blocked_filter_coord( int tc, int pc, int s, int t ){
+    const int B = simd.channel_block;
+    long cblocks = ( prev_channel + B - 1 ) / B;
+    return ( ( ( ( tc / B * cblocks + pc / B ) * filter_size + s ) * filter_size + t ) * B + pc % B ) * B + tc % B;
+  }
+  // the blocked filters are sized and zeroed once per engine, an update only rewrites
+  // their taps in place ( pack_blocked_filters ), the padding lanes staying zero
+  void size_blocked_filters(){
+    if( engine == BLOCKED_CONVOLUTION || fused_pooling ){
+      const int B = simd.channel_block;
+      long cblocks = ( prev_channel + B - 1 ) / B, kblocks = ( channel + B - 1 ) / B;
+      long size = kblocks * cblocks * filter_size * filter_size * B * B;
+      blocked_filters.assign( size, 0 );
+      blocked_filters_t.assign( size, 0 );
+      blocked_bias.assign( kblocks * B, 0 );
+    }else{
+      vec().swap( blocked_filters );
+      vec().swap( blocked_filters_t );
+      vec().swap( blocked_bias );
+    }
+  }
+  void pack_blocked_filters(){
+    const int B = simd.channel_block;
+    long kblocks = ( channel + B - 1 ) / B;
+    for(int k = 0; k < channel; k++){
+      for(int c = 0; c < prev_channel; c++){
+        for(int s = 0; s < filter_size; s++){
+          for(int t = 0; t < filter_size; t++){
+            F v = filter[ filter_coord( k, c, s, t ) ];
+            int fs = filter_size - 1 - s, ft = filter_size - 1 - t;
+            blocked_filters[ blocked_filter_coord( k, c, s, t ) ] = v;
+            blocked_filters_t[ ( ( ( ( c / B * kblocks + k / B ) * filter_size + fs ) * filter_size + ft ) * B + k % B ) * B + c % B ] = v;
+          }
         }
       }
-      // AdaGrad
-      sum_square_grad_bias[ ch ] += grad * grad;
-      dbias[ ch ] = - learning_rate * grad / std::sqrt( std::max(sum_square_grad_bias[ ch ], (F)1.0 ) ) + momentum * dbias[ ch ];
-      bias[ ch ] += dbias[ ch ];
+      blocked_bias[k] = bias[k];
     }
   }
   int filter_coord( int tc, int pc, int s, int t ){
@@ -137,6 +660,8 @@ protected:
 	    && 0 <= t && t < filter_size );
   }
   void init_conv(){
+    engine = DIRECT_CONVOLUTION;
+    fused_pooling = false;
     int filter_total = channel * prev_channel * filter_size * filter_size;
     filter.resize( filter_total );
     dfilter.resize( filter_total, 0 );
@@ -14,6 +14,7 @@ public:
     if( prev->units != prev_channel * prev_h * prev_w ){
       throw "not compatible layer size";
     }
+    padding = filter_size / 2;
     unit_h = prev_h;
     unit_w = prev_w;
     init( channel * unit_h * unit_w, prev, af, "[convolution zero padding]" + ln );
@@ -25,93 +26,94 @@ public:
     prev_channel = prev->channel;
     prev_h = prev->unit_h;
     prev_w = prev->unit_w;
+    padding = filter_size / 2;
     unit_h = prev_h;
     unit_w = prev_w;
     init( channel * unit_h * unit_w, prev, af, "[convolution zero padding]" + ln );
     init_conv();
   }
-  void propagate(){
-    vec & z = previous_layer->activated_output;
-    for(int ch = 0; ch < channel; ch++){
-      for(int h = 0; h < unit_h; h++){
-        for(int w = 0; w < unit_w; w++){
-          int idx = unit_coord(ch, h, w);
-          unit_output[ idx ] = bias[ ch ];
-          for(int pch = 0; pch < prev_channel; pch++){
-            for(int s = 0; s < filter_size; s++){
-              for(int t = 0; t < filter_size; t++){
-		int p = s - filter_size / 2;
-		int q = t - filter_size / 2;
-		if( is_in_prev( pch, h + p, w + q ) ){
-		  unit_output[ idx ] += z[ prev_coord( pch, h + p, w + q ) ] * filter[ filter_coord(ch, pch, s, t) ];
-		}
+  void propagate_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    for(int n = 0; n < st.batch_size; n++){
+      const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+      F * y = &st.unit_output[ n * units ];
+      F * a = &st.activated_output[ n * units ];
+      for(int ch = 0; ch < channel; ch++){
+        for(int h = 0; h < unit_h; h++){
+          for(int w = 0; w < unit_w; w++){
+            int idx = unit_coord(ch, h, w);
+            y[ idx ] = bias[ ch ];
+            for(int pch = 0; pch < prev_channel; pch++){
+              for(int s = 0; s < filter_size; s++){
+                for(int t = 0; t < filter_size; t++){
+                  int p = s - filter_size / 2;
+                  int q = t - filter_size / 2;
+                  if( is_in_prev( pch, h + p, w + q ) ){
+                    y[ idx ] += z[ prev_coord( pch, h + p, w + q ) ] * filter[ filter_coord(ch, pch, s, t) ];
+                  }
+                }
               }
             }
           }
-          activated_output[ idx ] = activation_func->f( unit_output[ idx ] );
         }
       }
+      activate( activation_func, units, y, a );
     }
-    if( next_layer != nullptr )
-      next_layer->propagate();
   }
-  void back_propagate(){
-    // compute previous layer's delta
-    vec & prev_delta = previous_layer->delta;
-    fill( prev_delta.begin(), prev_delta.end(), 0 );
-    for(int ch = 0; ch < channel; ch++){
-      for(int pch = 0; pch < prev_channel; pch++){
-        for(int h = 0; h < unit_h; h++){
-          for(int w = 0; w < unit_w; w++){
-            for(int s = 0; s < filter_size; s++){
-              for(int t = 0; t < filter_size; t++){
-		int p = s - filter_size / 2;
-		int q = t - filter_size / 2;
-		if( is_in_prev( pch, h + p, w + q ) ){
-		  prev_delta[ prev_coord(pch, h + p, w + q) ]
-		    += delta[ unit_coord(ch, h, w) ]
-		    * filter[ filter_coord(ch, pch, s, t) ]
-		    * previous_layer->activation_func->df( previous_layer->unit_output[ prev_coord(pch, h + p, w + q) ] );
-		}
+  void back_propagate_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    TensorView & prev_delta = previous_layer->delta( ctx );
+    for(int n = 0; n < st.batch_size; n++){
+      F * pd = &prev_delta[ n * inputs ];
+      const F * d = &st.delta[ n * units ];
+      for(int ch = 0; ch < channel; ch++){
+        for(int pch = 0; pch < prev_channel; pch++){
+          for(int h = 0; h < unit_h; h++){
+            for(int w = 0; w < unit_w; w++){
+              for(int s = 0; s < filter_size; s++){
+                for(int t = 0; t < filter_size; t++){
+                  int p = s - filter_size / 2;
+                  int q = t - filter_size / 2;
+                  if( is_in_prev( pch, h + p, w + q ) ){
+                    pd[ prev_coord(pch, h + p, w + q) ]
+                      += d[ unit_coord(ch, h, w) ]
+                      * filter[ filter_coord(ch, pch, s, t) ];
+                  }
+                }
               }
             }
           }
         }
       }
     }
-    if( previous_layer != nullptr )
-      previous_layer->back_propagate();
   }
-  void gradient_descent(F learning_rate, F momentum){
-    // update filter weight
+  void compute_filter_gradient_direct( ExecutionContext & ctx ){
+    LayerState & st = state( ctx );
+    vec & grad_filter = st.grads[0];
     for(int ch = 0; ch < channel; ch++){
       for(int pch = 0; pch < prev_channel; pch++){
         for(int s = 0; s < filter_size; s++){
           for(int t = 0; t < filter_size; t++){
             int p = s - filter_size / 2;
             int q = t - filter_size / 2;
-            // update filter[ch][pch][s][t]
-            int filter_idx = filter_coord(ch, pch, s, t);
+            // gradient of filter[ch][pch][s][t]
             F grad = 0;
-            for(int h = 0; h < unit_h; h++){
-              for(int w = 0; w < unit_w; w++){
-                if( is_in_prev( pch, h + p, w + q ) ){
-                  grad += delta[ unit_coord(ch, h, w) ] * previous_layer->activated_output[ prev_coord(pch, h + p, w + q) ];
+            for(int n = 0; n < st.batch_size; n++){
+              const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+              const F * d = &st.delta[ n * units ];
+              for(int h = 0; h < unit_h; h++){
+                for(int w = 0; w < unit_w; w++){
+                  if( is_in_prev( pch, h + p, w + q ) ){
+                    grad += d[ unit_coord(ch, h, w) ] * z[ prev_coord(pch, h + p, w + q) ];
+                  }
                 }
               }
             }
-            // AdaGrad
-            sum_square_grad_filter[ filter_idx ] += grad * grad;
-            dfilter[ filter_idx ] = - learning_rate * grad / std::sqrt( std::max(sum_square_grad_filter[ filter_idx ], (F)1.0) ) + momentum * dfilter[ filter_idx ];
-            filter[ filter_idx ] += dfilter[ filter_idx ];
+            grad_filter[ filter_coord(ch, pch, s, t) ] = grad;
           }
         }
       }
     }
-    // update bias
-    update_bias( learning_rate, momentum );
-    if( next_layer != nullptr )
-      next_layer->gradient_descent(learning_rate, momentum);
   }
 };
 
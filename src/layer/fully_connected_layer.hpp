@@ -1,19 +1,27 @@
 #ifndef FULLLYCONNECTEDLAYER
 #define FULLLYCONNECTEDLAYER
 #include "layer_base.hpp"
+#include "../sparse.hpp"
+
+// per context spans of the inputs that can be nonzero ( see sparse.hpp )
+struct FullyConnectedState : public LayerState {
+  std::vector<int> spans;      // of the inputs of the last forward, for the gradient and the update
+  std::vector<int> live_spans; // of the previous layer's units with a nonzero derivative, in backward
+  std::vector<int> folds;      // of the weights whose velocity is folded by the update
+  std::vector<uint8_t> blocks; // scratch
+  bool sparse_update;          // the last update was update_sparse, its spans and folds pending
+};
 
 class FullyConnectedLayer : public Layer {
 public:
   FullyConnectedLayer(int u, Layer * prev, ActivationFunction * af, std::string ln){
     init( u, prev, af, "[fully connected]" + ln );
-    weight.resize( units );
-    dweight.resize( units );
-    sum_square_grad_weight.resize( units );
-    for(int i = 0; i < units; i++){
-      weight[i].resize( inputs );
-      dweight[i].resize( inputs );
-      sum_square_grad_weight[i].resize( inputs, 0 );
-    }
+    // weights are a flat row-major [ units x inputs ] matrix
+    weight.resize( units * inputs );
+    dweight.resize( units * inputs, 0 );
+    sum_square_grad_weight.resize( units * inputs, 0 );
+    velocity_folded.assign( span_blocks( inputs ), 0 );
+    precision = FP32;
     bias.resize( units, 0 );
     dbias.resize( units, 0 );
     sum_square_grad_bias.resize( units, 0 );
@@ -21,74 +29,300 @@ public:
     std::random_device seed_gen;
     std::default_random_engine engine(seed_gen());
     std::normal_distribution<> dist(0.0, 0.1);
-    for(int i = 0; i < units; i++){
-      for(int j = 0; j < inputs; j++){
-        weight[i][j] = dist(engine);
-      }
+    for(int i = 0; i < units * inputs; i++){
+      weight[i] = dist(engine);
     }
   }
-  virtual void propagate(){
-    vec & z = previous_layer->activated_output;
-    unit_output = vec_plus_vec(mat_prod_vec( weight, z ), bias);
-    activated_output = function_apply_to_vec(activation_func, unit_output);
-    if( next_layer != nullptr )
-      next_layer->propagate();
+  virtual void forward( ExecutionContext & ctx ){
+    LayerState & s = state( ctx );
+    compute_unit_output( ctx );
+    for(int n = 0; n < s.batch_size; n++){
+      bias_activate( activation_func, units, bias.data(), &s.unit_output[ n * units ], &s.activated_output[ n * units ] );
+    }
   }
-  virtual void back_propagate() {
+  virtual void backward( ExecutionContext & ctx ) {
     if( next_layer == nullptr ){
-      compute_this_layer_delta();
-    }
-    compute_previous_layer_delta();
-    if( previous_layer != nullptr )
-      previous_layer->back_propagate();
-  }
-  void compute_previous_layer_delta(){
-    vec & prev_delta = previous_layer->delta;
-    std::fill( prev_delta.begin(), prev_delta.end(), 0 );
-    for(int pu = 0; pu < inputs; pu++){
-      for(int u = 0; u < units; u++){
-        prev_delta[pu] += delta[u] * weight[u][pu] * previous_layer->activation_func->df( previous_layer->unit_output[pu] );
+      compute_this_layer_delta( ctx );
+    }
+    compute_previous_layer_delta( ctx );
+  }
+  void compute_unit_output( ExecutionContext & ctx ){
+    // unit_output = z W^T, the bias is added together with the activation
+    FullyConnectedState & s = fc_state( ctx );
+    const F * x = previous_layer->activated_output( ctx ).data();
+    std::fill( s.unit_output.begin(), s.unit_output.end(), 0 );
+    // the columns of W met by a nonzero input ( the blank pixels of an image, the dead
+    // units of a ReLU layer are skipped ), also those of the gradient
+    live_spans( s.batch_size, inputs, x, false, s.blocks, s.spans );
+    if( pruned() ){
+      // the kept blocks of W only
+      for(int n = 0; n < s.batch_size; n++){
+        sparse.gemv( x + (size_t)n * inputs, &s.unit_output[ n * units ] );
+      }
+    }else if( precision == FP32 && s.batch_size == 1 ){
+      // a single sample reuses no panel of W, one dot product per row streams it once
+      for(int k = 0; k < s.spans.size(); k += 2){
+        int b = s.spans[k], e = s.spans[k + 1];
+        gemv( units, e - b, weight.data() + b, inputs, x + b, s.unit_output.data() );
       }
+    }else if( precision == FP32 ){
+      for(int k = 0; k < s.spans.size(); k += 2){
+        int b = s.spans[k], e = s.spans[k + 1];
+        gemm_nt( s.batch_size, units, e - b, x + b, inputs, weight.data() + b, inputs, s.unit_output.data(), units );
+      }
+    }else{
+      gemm_nt_half( precision, s.batch_size, units, inputs,
+                    previous_layer->activated_output( ctx ).data(), inputs,
+                    weight_half.data(), inputs,
+                    s.unit_output.data(), units );
     }
   }
-  void compute_this_layer_delta(){
-    std::fill( delta.begin(), delta.end(), 0 );
-    for(int u = 0; u < units; u++){
-      delta[u] = activated_output[u] - target[u];
+  void compute_previous_layer_delta( ExecutionContext & ctx ){
+    // prev_delta = ( delta W ) * df( prev_unit_output ); nothing reads the delta of an input layer
+    if( previous_layer->index == 0 ){
+      return;
+    }
+    FullyConnectedState & s = fc_state( ctx );
+    LayerState & p = previous_layer->state( ctx );
+    std::fill( p.delta.begin(), p.delta.end(), 0 );
+    if( previous_layer->activation_func->kind == RELU_ACTIVATION ){
+      // df( u ) = 0 for u < 0, only the columns of the other units are computed
+      live_spans( s.batch_size, inputs, p.unit_output.data(), true, s.blocks, s.live_spans );
+    }else{
+      s.live_spans.assign( { 0, inputs } );
+    }
+    for(int k = 0; k < s.live_spans.size(); k += 2){
+      int b = s.live_spans[k], e = s.live_spans[k + 1];
+      gemm_nn( s.batch_size, e - b, units, s.delta.data(), units, weight.data() + b, inputs, p.delta.data() + b, inputs );
     }
+    mul_activation_derivative( previous_layer->activation_func, s.batch_size * inputs,
+                               p.unit_output.data(), p.activated_output.data(), p.delta.data() );
   }
-  virtual void gradient_descent( F learning_rate, F momentum ){
-    vec & z = previous_layer->activated_output;
-    for(int i = 0; i < units; i++){
-      for(int j = 0; j < inputs; j++){
-        F grad = delta[i] * z[j];
-        // AdaGrad
-        sum_square_grad_weight[i][j] += grad * grad;
-        dweight[i][j] = - learning_rate * grad / std::sqrt( std::max(sum_square_grad_weight[i][j], (F)1.0) ) + momentum * dweight[i][j];
-        weight[i][j] += dweight[i][j];
+  void compute_this_layer_delta( ExecutionContext & ctx ){
+    LayerState & s = state( ctx );
+    for(int k = 0; k < s.batch_size * units; k++){
+      s.delta[k] = s.activated_output[k] - s.target[k];
+    }
+  }
+  virtual void compute_gradient( ExecutionContext & ctx ){
+    FullyConnectedState & s = fc_state( ctx );
+    vec & grad_weight = s.grads[0];
+    vec & grad_bias = s.grads[1];
+    // grad_weight = delta^T z, zero outside the spans of z
+    const F * x = previous_layer->activated_output( ctx ).data();
+    std::fill( grad_weight.begin(), grad_weight.end(), 0 );
+    for(int k = 0; k < s.spans.size(); k += 2){
+      int b = s.spans[k], e = s.spans[k + 1];
+      gemm_tn( units, e - b, s.batch_size, s.delta.data(), units, x + b, inputs, grad_weight.data() + b, inputs );
+    }
+    std::fill( grad_bias.begin(), grad_bias.end(), 0 );
+    for(int n = 0; n < s.batch_size; n++){
+      simd.add_vec( units, &s.delta[ n * units ], grad_bias.data() );
+    }
+  }
+  // every phase is one GEMM with the weights
+  virtual LayerCost cost( ProfilePhase p, int n ){
+    double w = (double)units * inputs, weight_bytes = ( precision == FP32 || p != FORWARD_PHASE ) ? sizeof( F ) : 2;
+    LayerCost c = { 2 * n * w, w * weight_bytes + sizeof( F ) * n * ( inputs + 2.0 * units ) };
+    if( p == GRADIENT_PHASE ){
+      c.bytes = 2 * w * sizeof( F ) + sizeof( F ) * n * ( inputs + (double)units );
+    }
+    if( p == FORWARD_PHASE && pruned() ){
+      // the values and column of every kept block
+      double kept = (double)sparse.blocks() * sparse.block;
+      c.flops = 2 * n * kept;
+      c.bytes = kept * sizeof( F ) + sparse.blocks() * sizeof( int ) + sizeof( F ) * n * ( inputs + 2.0 * units );
+    }
+    return c;
+  }
+  virtual LayerState * create_state(){
+    return new FullyConnectedState();
+  }
+  virtual void resize_state( LayerState & st, int n ){
+    FullyConnectedState & s = static_cast<FullyConnectedState &>( st );
+    // all the inputs until a forward, room for every span so that none is allocated later
+    s.blocks.assign( span_blocks( inputs ), 1 );
+    s.spans.reserve( span_blocks( inputs ) + 1 );
+    s.live_spans.reserve( span_blocks( inputs ) + 1 );
+    s.folds.reserve( span_blocks( inputs ) + 1 );
+    s.sparse_update = false;
+    block_spans( inputs, s.blocks, s.spans );
+    Layer::resize_state( st, n );
+  }
+  // the gradients of two shards of a mini-batch are zero outside both of their spans
+  virtual void add_gradient( LayerState & from, LayerState & to ){
+    Layer::add_gradient( from, to );
+    FullyConnectedState & t = static_cast<FullyConnectedState &>( to );
+    merge_spans( inputs, static_cast<FullyConnectedState &>( from ).spans, t.spans, t.blocks );
+  }
+  // the weights of the inputs that were zero over the whole mini-batch have no gradient;
+  // their update only continues the momentum ( d = m d, w += d ), so instead of every
+  // step touching them the velocity still to come is added to w the first time
+  // ( w += m / ( 1 - m ) d, d = 0 ) and they are skipped from then on; the weight ends
+  // where the momentum would have taken it, only sooner, the one difference from the
+  // dense update ( SGD has no velocity and is exact; Adam scales by its second moment,
+  // which decays meanwhile, and stays dense ); the blocks of inputs folded are marked in
+  // velocity_folded by updates_applied, so that the next steps skip them without reading
+  // their velocity
+  virtual bool updates_sparsely( ExecutionContext & ctx, UpdateRule rule, const UpdateStep & u ){
+    FullyConnectedState & s = fc_state( ctx );
+    bool all = s.spans.size() == 2 && s.spans[0] == 0 && s.spans[1] == inputs;
+    return rule != ADAM_UPDATE && u.momentum < 1 && !all;
+  }
+  virtual void update_sparse( ExecutionContext & ctx, UpdateRule rule, const UpdateStep & u ){
+    FullyConnectedState & s = fc_state( ctx );
+    F fold = rule == SGD_UPDATE ? 0 : u.momentum / ( 1 - u.momentum );
+    // the runs of the blocks outside the spans whose velocity is not folded yet
+    s.folds.clear();
+    if( fold != 0 ){
+      for(int k = 0; k < span_blocks( inputs ); k++){
+        s.blocks[k] = !velocity_folded[k];
       }
+      mark_spans( s.spans, s.blocks, 0 );
+      block_spans( inputs, s.blocks, s.folds, false );
     }
     for(int i = 0; i < units; i++){
-      F grad = delta[i];
-      // AdaGrad
-      sum_square_grad_bias[i] += grad * grad;
-      dbias[i] = - learning_rate * grad / std::sqrt( std::max(sum_square_grad_bias[i], (F)1.0) ) + momentum * dbias[i];
-      bias[i] += dbias[i];
+      size_t row = (size_t)i * inputs;
+      for(int k = 0; k < s.spans.size(); k += 2){
+        int b = s.spans[k], e = s.spans[k + 1];
+        simd.update[ rule ]( e - b, u, &s.grads[0][ row + b ], &sum_square_grad_weight[ row + b ],
+                             &dweight[ row + b ], &weight[ row + b ] );
+      }
+      for(int k = 0; k < s.folds.size(); k += 2){
+        fold_velocity( fold, row + s.folds[k], s.folds[k + 1] - s.folds[k] );
+      }
     }
-    if( next_layer != nullptr ){
-      next_layer->gradient_descent( learning_rate, momentum );
+    s.sparse_update = true;
+    simd.update[ rule ]( units, u, s.grads[1].data(), sum_square_grad_bias.data(), dbias.data(), bias.data() );
+  }
+  std::vector<Parameter> parameters(){
+    Parameter w = { &weight, &dweight, &sum_square_grad_weight };
+    Parameter b = { &bias, &dbias, &sum_square_grad_bias };
+    std::vector<Parameter> ps;
+    ps.push_back( w );
+    ps.push_back( b );
+    return ps;
+  }
+  // the forward pass reads the weights rounded to p, halving the memory traffic
+  // of large layers; backward and the updates keep working on the fp32 weights,
+  // which are rounded again after every update
+  virtual void set_precision( Precision p ){
+    precision = p;
+    parameters_updated();
+  }
+  virtual void parameters_updated(){
+    // a checkpoint may give a folded block a velocity
+    std::fill( velocity_folded.begin(), velocity_folded.end(), 0 );
+    weights_updated();
+  }
+  // the blocks folded by the contexts have no velocity left, but for those in the span
+  // of another; a dense update may have given any block one
+  virtual void updates_applied( ExecutionContext * const * ctxs, int n ){
+    bool sparse = true;
+    for(int k = 0; k < n; k++){
+      FullyConnectedState & s = fc_state( *ctxs[k] );
+      sparse = sparse && s.sparse_update;
+      if( s.sparse_update ){
+        mark_spans( s.folds, velocity_folded, 1 );
+      }
+    }
+    for(int k = 0; k < n; k++){
+      FullyConnectedState & s = fc_state( *ctxs[k] );
+      if( s.sparse_update ){
+        mark_spans( s.spans, velocity_folded, 0 );
+      }
+      s.sparse_update = false;
     }
+    if( !sparse ){
+      std::fill( velocity_folded.begin(), velocity_folded.end(), 0 );
+    }
+    weights_updated();
+  }
+  // magnitude pruning: the fraction sparsity of the weights, in groups of block ( 1, 4
+  // or 8 ) units of one input with the smallest sums of squares, is set to zero and
+  // kept zero by every later update; the forward pass then runs in fp32 on the kept
+  // blocks only ( SparseMatrix, CSR for block = 1 ), while backward and the gradients
+  // stay dense; pruning again with a higher sparsity continues from the pruned weights,
+  // so it can be done gradually while training
+  //   full1.prune( 0.9, 8 );
+  void prune( F sparsity, int block = 1 ){
+    sparse.set_structure( units, inputs, block, magnitude_mask( units, inputs, block, weight.data(), sparsity ) );
+    parameters_updated();
+  }
+  // the groups of block whose weights are all zero become the pruned ones, as after
+  // prune; block = 0 makes the layer dense again
+  void prune_zeros( int block ){
+    if( block == 0 ){
+      sparse = SparseMatrix();
+      return;
+    }
+    prune( zero_groups( units, inputs, block, weight.data() ), block );
+  }
+  // the height of the pruned groups, 0 when dense
+  int pruning_block(){
+    return pruned() ? sparse.block : 0;
+  }
+  // the fraction of the weights pruned
+  F sparsity(){
+    return pruned() ? 1 - (F)sparse.kept() / weight.size() : 0;
+  }
+  bool pruned(){
+    return sparse.rows > 0;
   }
   void print_weight(){
-    print_mat( weight );
+    print_mat( weight, units, inputs );
+  }
+  virtual void print_info( ){
+    std::cout << layer_name << std::endl;
+    std::cout << "  inputs = " << inputs << std::endl;
+    std::cout << "  units = " << units << std::endl;
+    if( pruned() ){
+      std::cout << "  pruned = " << 100 * sparsity() << "% in blocks of " << sparse.block << " x 1" << std::endl;
+    }
+    std::cout << "  activation function = " << activation_func->func_name << std::endl;
+    std::cout << std::endl;
   }
 protected:
-  mat weight;
-  mat dweight;
-  mat sum_square_grad_weight;
+  // the weights read by forward, from weight
+  void weights_updated(){
+    if( pruned() ){
+      // the pruned weights are reset to zero; their velocity is left alone, it never
+      // reaches a kept weight
+      sparse.zero_pruned( weight.data() );
+      sparse.set_values( weight.data() );
+    }
+    if( precision == FP32 ){
+      hvec().swap( weight_half );
+      return;
+    }
+    weight_half.resize( weight.size() );
+    pack_half( precision, weight.size(), weight.data(), weight_half.data() );
+  }
+  FullyConnectedState & fc_state( ExecutionContext & ctx ){
+    return static_cast<FullyConnectedState &>( state( ctx ) );
+  }
+  // w += fold d, d = 0 on the n weights from at, once their velocity is nonzero
+  // ( one too small for its square to be a float, below 1e-19, moves no weight and is dropped )
+  void fold_velocity( F fold, size_t at, int n ){
+    F * d = &dweight[ at ];
+    if( fold == 0 || n == 0 || simd.dot( n, d, d ) == 0 ){
+      return;
+    }
+    simd.axpy( n, fold, d, &weight[ at ] );
+    std::fill( d, d + n, (F)0 );
+  }
+  vec weight;
+  vec dweight;
+  vec sum_square_grad_weight;
+  // per block of SPAN_COLUMNS inputs, set when its velocity is folded into the weights
+  // and zero in every row ( see update_sparse ), cleared when it is updated again
+  std::vector<uint8_t> velocity_folded;
   vec bias;
   vec dbias;
   vec sum_square_grad_bias;
+  Precision precision;
+  hvec weight_half;
+  SparseMatrix sparse; // the weights kept by prune, read by forward; no rows when dense
 };
 
 #endif
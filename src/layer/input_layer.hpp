@@ -1,41 +1,88 @@
 #ifndef INPUTLAYER
 #define INPUTLAYER
 #include "layer_base.hpp"
+#include "../dataset.hpp"
+#include "../batch_pipeline.hpp"
 
 class InputLayer : public Layer {
 public:
   InputLayer( int u ){
-    units = u;
-    unit_output.resize( units );
-    delta.resize( units );
-    activated_output.resize( units );
-    activation_func = &id;
+    init_input( u );
     layer_name = "[input]";
   }
+  using Layer::propagate;
+  void set_input( ExecutionContext & ctx, const vec * in, int n ) {
+    // a mini-batch of the n samples in[0], ..., in[n-1]
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    TensorView & a = activated_output( ctx );
+    for(int k = 0; k < n; k++){
+      std::copy( in[k].begin(), in[k].end(), a.begin() + k * units );
+    }
+  }
+  void set_input( ExecutionContext & ctx, const F * in, int n ) {
+    // n samples stored one after another, in = [ n x units ]
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    std::copy( in, in + n * units, activated_output( ctx ).begin() );
+  }
+  void propagate( ExecutionContext & ctx, const vec * in, int n ) {
+    set_input( ctx, in, n );
+    propagate( ctx );
+  }
+  void propagate( ExecutionContext & ctx, const F * in, int n ) {
+    set_input( ctx, in, n );
+    propagate( ctx );
+  }
+  void propagate( ExecutionContext & ctx, const TensorDataset & d, int i, int n ) {
+    // the n samples d[i], ..., d[i+n-1], read straight from the mapped file
+    if( d.sample_size() != units ){
+      throw "not compatible dataset size";
+    }
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    d.read( i, n, activated_output( ctx ).data() );
+    propagate( ctx );
+  }
   void propagate( vec & in ) {
-    input_vec = in;
-    propagate();
+    // a single sample
+    propagate( default_context(), &in, 1 );
   }
-  void propagate(){
-    unit_output = input_vec;
-    activated_output = input_vec;
-    next_layer->propagate();
+  void propagate( std::vector<vec> & in ) {
+    // a mini-batch of in.size() samples
+    propagate( default_context(), in.data(), in.size() );
   }
-  void back_propagate(){
-    return;
+  void propagate( const vec * in, int n ) {
+    propagate( default_context(), in, n );
+  }
+  void propagate( const F * in, int n ) {
+    propagate( default_context(), in, n );
+  }
+  void propagate( const Batch & b ) {
+    propagate( default_context(), b.data.data(), b.size );
+  }
+  void propagate( const TensorDataset & d, int i, int n ) {
+    propagate( default_context(), d, i, n );
   }
-  void gradient_descent(F learning_rate, F momentum){
-    if( next_layer != nullptr )
-      next_layer->gradient_descent( learning_rate, momentum );
+  void forward( ExecutionContext & ctx ){
+    // the same span in an inference context
+    LayerState & s = state( ctx );
+    if( s.unit_output.data() != s.activated_output.data() ){
+      std::copy( s.activated_output.begin(), s.activated_output.end(), s.unit_output.begin() );
+    }
+  }
+  void backward( ExecutionContext & ctx ){
+    return;
   }
   void print_network_info( ){
+    std::cout << "[simd kernels = " << simd.name << "]" << std::endl;
+    std::cout << std::endl;
     Layer * l = this;
     while( l != nullptr ){
       l->print_info();
       l = l->next_layer;
     }
   }
-  vec input_vec;
 private:
 };
 
@@ -1,6 +1,15 @@
 #ifndef INPUTLAYER2D
 #define INPUTLAYER2D
 #include "layer_2d.hpp"
+#include "../dataset.hpp"
+#include "../batch_pipeline.hpp"
+
+// a sample being converted to the channel blocked layout
+struct InputState2D : public LayerState {
+  vec sample;
+  bool converted; // set_input already wrote the samples blocked
+  InputState2D() : converted( false ) { }
+};
 
 class InputLayer2D : public Layer2D {
 public:
@@ -8,38 +17,125 @@ public:
     channel = ch;
     unit_h = h;
     unit_w = w;
-    units = channel * unit_h * unit_w;
-    unit_output.resize( units, 0 );
-    activated_output.resize( units, 0 );
-    delta.resize( units, 0 );
-    activation_func = &id;
+    init_input( channel * unit_h * unit_w );
     layer_name = "[input 2D]";
   }
+  using Layer::propagate;
+  void set_input( ExecutionContext & ctx, const vec * in, int n ) {
+    // a mini-batch of the n samples in[0], ..., in[n-1]
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    for(int k = 0; k < n; k++){
+      write_sample( ctx, k, in[k].data() );
+    }
+    static_cast<InputState2D &>( state( ctx ) ).converted = block > 1;
+  }
+  void set_input( ExecutionContext & ctx, const F * in, int n ) {
+    // n samples stored one after another, in = [ n x units ]
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    for(int k = 0; k < n; k++){
+      write_sample( ctx, k, in + k * units );
+    }
+    static_cast<InputState2D &>( state( ctx ) ).converted = block > 1;
+  }
+  void propagate( ExecutionContext & ctx, const vec * in, int n ) {
+    set_input( ctx, in, n );
+    propagate( ctx );
+  }
+  void propagate( ExecutionContext & ctx, const F * in, int n ) {
+    set_input( ctx, in, n );
+    propagate( ctx );
+  }
+  void propagate( ExecutionContext & ctx, const TensorDataset & d, int i, int n ) {
+    // the n samples d[i], ..., d[i+n-1], read straight from the mapped file
+    if( d.sample_size() != units ){
+      throw "not compatible dataset size";
+    }
+    if( ctx.batch_size != n )
+      ctx.set_batch_size( n );
+    d.read( i, n, activated_output( ctx ).data() );
+    propagate( ctx );
+  }
   void propagate( vec & in ) {
-    input_vec = in;
-    propagate();
+    // a single sample
+    propagate( default_context(), &in, 1 );
   }
-  void propagate(){
-    unit_output = input_vec;
-    activated_output = input_vec;
-    next_layer->propagate();
+  void propagate( std::vector<vec> & in ) {
+    // a mini-batch of in.size() samples
+    propagate( default_context(), in.data(), in.size() );
   }
-  void back_propagate(){
-    return;
+  void propagate( const vec * in, int n ) {
+    propagate( default_context(), in, n );
+  }
+  void propagate( const F * in, int n ) {
+    propagate( default_context(), in, n );
   }
-  void gradient_descent(F learning_rate, F momentum){
-    if( next_layer != nullptr )
-      next_layer->gradient_descent( learning_rate, momentum );
+  void propagate( const Batch & b ) {
+    propagate( default_context(), b.data.data(), b.size );
+  }
+  void propagate( const TensorDataset & d, int i, int n ) {
+    propagate( default_context(), d, i, n );
+  }
+  // keeps the images between the 2D layers in blocks of b channels ( NCHWc ), so that
+  // a vector holds one pixel of b channels; simd.channel_block fits the vectors of
+  // this CPU and b = 1 is back to planar
+  // samples are still given planar and converted by this layer, and the last 2D
+  // layer writes its output planar for the layers after it
+  void set_channel_block( int b ){
+    if( b < 1 || ( b & ( b - 1 ) ) != 0 ){
+      throw "channel block must be a power of two";
+    }
+    int in = 1;
+    for(Layer2D * l = this; l != nullptr; ){
+      Layer2D * next = dynamic_cast<Layer2D *>( l->next_layer );
+      int out = next == nullptr ? 1 : b;
+      l->set_layout( in, out );
+      in = out;
+      l = next;
+    }
+  }
+  LayerState * create_state(){
+    return new InputState2D();
+  }
+  void forward( ExecutionContext & ctx ){
+    // unit_output is the same span as activated_output in an inference context
+    InputState2D & s = static_cast<InputState2D &>( state( ctx ) );
+    if( block > 1 && !s.converted ){
+      s.sample.resize( units );
+      for(int n = 0; n < s.batch_size; n++){
+        F * a = &s.activated_output[ n * units ];
+        from_blocked( a, 1, channel, unit_h, unit_w, s.sample.data(), block, false );
+        std::copy( s.sample.begin(), s.sample.end(), a );
+      }
+    }
+    s.converted = false;
+    if( s.unit_output.data() != s.activated_output.data() ){
+      std::copy( s.activated_output.begin(), s.activated_output.end(), s.unit_output.begin() );
+    }
+  }
+  void backward( ExecutionContext & ctx ){
+    return;
   }
   void print_network_info( ){
+    std::cout << "[simd kernels = " << simd.name << ", channel block = " << simd.channel_block << "]" << std::endl;
+    std::cout << std::endl;
     Layer * l = this;
     while( l != nullptr ){
       l->print_info();
       l = l->next_layer;
     }
   }
-  vec input_vec;
 private:
+  // the k-th sample of ctx from the planar x, converted on the way when blocked
+  void write_sample( ExecutionContext & ctx, int k, const F * x ){
+    F * a = &activated_output( ctx )[ k * units ];
+    if( block > 1 ){
+      from_blocked( x, 1, channel, unit_h, unit_w, a, block, false );
+    }else{
+      std::copy( x, x + units, a );
+    }
+  }
 };
 
 #endif
@@ -4,26 +4,38 @@
 
 class Layer2D : public Layer {
 public: 
-  virtual void propagate() = 0;
-  virtual void back_propagate() = 0;
-  virtual void gradient_descent(F learning_rate, F momentum) = 0;
-  
   int channel, unit_h, unit_w;
   int prev_channel, prev_h, prev_w;
+  // channels per block of the output and the input images, 1 for planar [ channel x h x w ]
+  // ( see blocked_index in matrix.hpp and InputLayer2D::set_channel_block )
+  int block, prev_block;
+
+  Layer2D() : block( 1 ), prev_block( 1 ) { }
+  // the number of units is the same in every layout
+  virtual void set_layout( int in_block, int out_block ){
+    prev_block = in_block;
+    block = out_block;
+  }
 
   virtual void print_info( ){
     std::cout << layer_name << std::endl;
     std::cout << "  inputs = [ channel=" << prev_channel << ", h=" << prev_h << ", w=" << prev_w << "]" << std::endl;
     std::cout << "  units = [ channel=" << channel << ", h=" << unit_h << ", w=" << unit_w << "]" << std::endl;
+    if( block > 1 || prev_block > 1 ){
+      std::cout << "  layout = [ input=" << layout_name( prev_block ) << ", units=" << layout_name( block ) << "]" << std::endl;
+    }
     std::cout << "  activation function = " << activation_func->func_name << std::endl;
     std::cout << std::endl;
   }  
+  static std::string layout_name( int b ){
+    return b == 1 ? "NCHW" : "NCHW" + std::to_string( b ) + "c";
+  }
 protected:
   int unit_coord( int c, int h, int w ){
-    return c * unit_h * unit_w + h * unit_w + w;
+    return blocked_index( c, h, w, channel, unit_h, unit_w, block );
   }
   int prev_coord( int c, int h, int w ){
-    return c * prev_h * prev_w + h * prev_w + w;
+    return blocked_index( c, h, w, prev_channel, prev_h, prev_w, prev_block );
   }
   bool is_in_prev(int c, int h, int w){
     return (0 <= c && c < prev_channel
@@ -5,24 +5,296 @@
 #include "../common.hpp"
 #include "../activation_functions.hpp"
 #include "../matrix.hpp"
+#include "../half.hpp"
+#include "../memory_plan.hpp"
+#include "../profiler.hpp"
+
+class Layer;
+
+// everything a layer writes while running a mini-batch
+struct LayerState {
+  int batch_size;
+  // outputs and deltas of a mini-batch are stored sample by sample
+  // i.e. unit_output[ n * units + u ] is unit u of the n-th sample
+  // they are spans of the context's arena ( see MemoryPlan )
+  TensorView unit_output, activated_output;
+  TensorView delta;
+  vec target;
+  // gradient of each of the layer's parameters, summed over the mini-batch
+  std::vector<vec> grads;
+  virtual ~LayerState(){ }
+};
+
+// the execution state of a whole network, one LayerState per layer
+// parameters stay in the layers, so any number of contexts can run
+// through the same network at the same time
+// the activation tensors of all layers live in one arena laid out by a
+// MemoryPlan for the order the layers are run in; by default that of
+// propagate, back_propagate and gradient_descent
+class ExecutionContext {
+public:
+  ExecutionContext( Layer * input, ExecutionMode m = TRAINING );
+  ~ExecutionContext();
+  // plans the arena for n samples, it only grows when n does
+  void set_batch_size( int n );
+  // the order the layers are run in from now on
+  void set_schedule( const std::vector<ScheduleStep> & s );
+  int batch_size;
+  ExecutionMode mode;
+  std::vector<Layer *> layers;
+  std::vector<LayerState *> states;
+  std::vector<ScheduleStep> schedule;
+  MemoryPlan plan;
+  vec arena;
+  int arena_allocations; // times the arena was (re)allocated
+  Profiler * profiler;   // times the steps run on this context when set
+private:
+  ExecutionContext( const ExecutionContext & );
+  ExecutionContext & operator=( const ExecutionContext & );
+};
 
 class Layer{
 public:
+  // a trainable tensor of a layer with its AdaGrad/momentum state
+  struct Parameter {
+    vec * value;
+    vec * d;
+    vec * sum_square_grad;
+  };
   Layer * previous_layer;
   Layer * next_layer;
+  int index; // position in the network, the input layer is 0
   int units;
   int inputs;
   ActivationFunction * activation_func;
-  vec unit_output, activated_output;
-  vec delta;
   std::string layer_name;
 
-  virtual void propagate() = 0;
-  virtual void back_propagate() = 0;
-  virtual void gradient_descent(F learning_rate, F momentum) = 0;
+  virtual ~Layer(){
+    delete own_context;
+  }
+
+  // computes this layer's outputs in ctx from those of the previous layer
+  virtual void forward( ExecutionContext & ctx ) = 0;
+  // computes the previous layer's delta in ctx from this layer's delta
+  virtual void backward( ExecutionContext & ctx ) = 0;
+  // sets the grads of ctx to the gradients summed over its mini-batch
+  virtual void compute_gradient( ExecutionContext & ctx ){ }
+  // false when the next layer computes this one's outputs itself, which
+  // are then not kept ( a convolution fused with a pooling )
+  virtual bool keeps_outputs(){
+    return true;
+  }
+  // puts the n samples in = [ n x units ] into ctx, for input layers
+  virtual void set_input( ExecutionContext & ctx, const F * in, int n ){
+    throw layer_name + " is not an input layer";
+  }
+  virtual void set_input( ExecutionContext & ctx, const vec * in, int n ){
+    throw layer_name + " is not an input layer";
+  }
+  // the trainable tensors of this layer
+  virtual std::vector<Parameter> parameters(){
+    return std::vector<Parameter>();
+  }
+  // stores the weights read by forward in p ( see half.hpp ), if the layer supports it
+  virtual void set_precision( Precision p ){ }
+  // called after the parameters have been changed, by a checkpoint or a setting
+  virtual void parameters_updated(){ }
+  // called once the updates from the grads of the n contexts ctxs are all in and no
+  // thread changes the parameters any more ( apply_gradient, Optimizer::step, the
+  // Hogwild steps of DataParallelTrainer ); what is derived from the parameters, packed
+  // filters or bookkeeping of the updates, is rebuilt here and not by the updates
+  virtual void updates_applied( ExecutionContext * const * ctxs, int n ){
+    parameters_updated();
+  }
+  // true when the layer knows most of the grads of ctx to be zero ( see FullyConnectedLayer )
+  // and updates its parameters by rule with update_sparse, instead of apply_gradient or
+  // the Optimizer updating every element
+  virtual bool updates_sparsely( ExecutionContext & ctx, UpdateRule rule, const UpdateStep & u ){
+    return false;
+  }
+  virtual void update_sparse( ExecutionContext & ctx, UpdateRule rule, const UpdateStep & u ){ }
+  // adds the grads of the state from to those of to, two contexts of this layer
+  virtual void add_gradient( LayerState & from, LayerState & to ){
+    for(int p = 0; p < from.grads.size(); p++){
+      simd.add_vec( from.grads[p].size(), from.grads[p].data(), to.grads[p].data() );
+    }
+  }
+  virtual LayerState * create_state(){
+    return new LayerState();
+  }
+  // the outputs and delta are bound by the context, the rest of the state is sized here
+  virtual void resize_state( LayerState & s, int n ){
+    s.batch_size = n;
+    const std::vector<Parameter> & ps = cached_parameters();
+    s.grads.resize( ps.size() );
+    for(int i = 0; i < ps.size(); i++){
+      s.grads[i].resize( ps[i].value->size(), 0 );
+    }
+  }
+
+  // the work of a phase on n samples, for the profiler; by default reading the
+  // inputs and writing the outputs
+  virtual LayerCost cost( ProfilePhase p, int n ){
+    LayerCost c = { 0, (double)sizeof( F ) * n * ( inputs + units ) };
+    return c;
+  }
+  // forward, backward or compute_gradient, timed when ctx has a profiler
+  void run_step( ExecutionContext & ctx, StepKind k ){
+    Profiler * p = ctx.profiler;
+    long long start = p != nullptr ? p->now() : 0;
+    if( k == FORWARD_STEP ){
+      forward( ctx );
+    }else if( k == BACKWARD_STEP ){
+      backward( ctx );
+    }else{
+      compute_gradient( ctx );
+    }
+    if( p != nullptr ){
+      ProfilePhase phase = k == FORWARD_STEP ? FORWARD_PHASE : k == BACKWARD_STEP ? BACKWARD_PHASE : GRADIENT_PHASE;
+      p->record( index, layer_name.c_str(), phase, start, p->now(), cost( phase, ctx.batch_size ) );
+    }
+  }
+
+  // this layer and the ones after it, in a loop ( see also Network in network.hpp )
+  void propagate( ExecutionContext & ctx ){
+    for(Layer * l = this; l != nullptr; l = l->next_layer){
+      l->run_step( ctx, FORWARD_STEP );
+    }
+  }
+  void back_propagate( ExecutionContext & ctx ){
+    if( ctx.mode == INFERENCE ){
+      throw "an inference context keeps no delta";
+    }
+    for(Layer * l = this; l != nullptr; l = l->previous_layer){
+      l->run_step( ctx, BACKWARD_STEP );
+    }
+  }
+  void gradient_descent( ExecutionContext & ctx, F learning_rate, F momentum ){
+    // gradients are averaged over the mini-batch, then applied once
+    for(Layer * l = this; l != nullptr; l = l->next_layer){
+      if( !l->cached_parameters().empty() ){
+        l->run_step( ctx, GRADIENT_STEP );
+      }
+      l->apply_gradient( ctx, learning_rate, momentum, (F)1.0 / ctx.batch_size );
+    }
+  }
+  // AdaGrad with momentum on every parameter, using the grads of ctx times grad_scale
+  // ( the other rules and a single pass over all the layers are in optimizer.hpp )
+  void apply_gradient( ExecutionContext & ctx, F learning_rate, F momentum, F grad_scale ){
+    if( cached_parameters().empty() ){
+      return;
+    }
+    update_parameters( ctx, learning_rate, momentum, grad_scale );
+    ExecutionContext * c = &ctx;
+    updates_applied( &c, 1 );
+  }
+  // the update of apply_gradient alone, which may run on several contexts at once;
+  // updates_applied follows when they are done
+  void update_parameters( ExecutionContext & ctx, F learning_rate, F momentum, F grad_scale ){
+    const std::vector<Parameter> & ps = cached_parameters();
+    if( ps.empty() ){
+      return;
+    }
+    Profiler * p = ctx.profiler;
+    long long start = p != nullptr ? p->now() : 0;
+    std::vector<vec> & grads = state( ctx ).grads;
+    UpdateStep u = { learning_rate, momentum, 0, 0, grad_scale, 1, 1 };
+    bool sparse = updates_sparsely( ctx, ADAGRAD_UPDATE, u );
+    if( sparse ){
+      update_sparse( ctx, ADAGRAD_UPDATE, u );
+    }
+    size_t size = 0;
+    for(int i = 0; i < ps.size(); i++){
+      if( !sparse ){
+        simd.update[ ADAGRAD_UPDATE ]( ps[i].value->size(), u, grads[i].data(),
+                                       ps[i].sum_square_grad->data(), ps[i].d->data(), ps[i].value->data() );
+      }
+      size += ps[i].value->size();
+    }
+    if( p != nullptr ){
+      p->record( index, layer_name.c_str(), UPDATE_PHASE, start, p->now(), update_cost( ADAGRAD_UPDATE, size ) );
+    }
+  }
+  void set_target( ExecutionContext & ctx, const vec * t, int n ){
+    // targets of n samples
+    vec & target = state( ctx ).target;
+    target.resize( n * units );
+    for(int k = 0; k < n; k++){
+      std::copy( t[k].begin(), t[k].end(), target.begin() + k * units );
+    }
+  }
+
+  void set_target( ExecutionContext & ctx, const F * t, int n ){
+    // n targets stored one after another, t = [ n x units ]
+    vec & target = state( ctx ).target;
+    target.assign( t, t + n * units );
+  }
 
+  LayerState & state( ExecutionContext & ctx ){
+    return *ctx.states[ index ];
+  }
+  TensorView & unit_output( ExecutionContext & ctx ){
+    return state( ctx ).unit_output;
+  }
+  TensorView & activated_output( ExecutionContext & ctx ){
+    return state( ctx ).activated_output;
+  }
+  TensorView & delta( ExecutionContext & ctx ){
+    return state( ctx ).delta;
+  }
+
+  // the same operations on the network's default context, for single threaded use
+  ExecutionContext & default_context(){
+    Layer * input = this;
+    int depth = 1;
+    while( input->previous_layer != nullptr ){
+      input = input->previous_layer;
+    }
+    for(Layer * l = input; l->next_layer != nullptr; l = l->next_layer){
+      depth++;
+    }
+    if( input->own_context == nullptr || input->own_context->layers.size() != depth ){
+      // (re)built when the network has grown
+      delete input->own_context;
+      input->own_context = new ExecutionContext( input );
+    }
+    return *input->own_context;
+  }
+  void propagate(){
+    propagate( default_context() );
+  }
+  void back_propagate(){
+    back_propagate( default_context() );
+  }
+  void gradient_descent( F learning_rate, F momentum ){
+    gradient_descent( default_context(), learning_rate, momentum );
+  }
   void set_target( vec & t ){
-    target = t;
+    // t = [ batch_size x units ]
+    state( default_context() ).target = t;
+  }
+  void set_target( std::vector<vec> & t ){
+    set_target( default_context(), t.data(), t.size() );
+  }
+  void set_target( const F * t, int n ){
+    set_target( default_context(), t, n );
+  }
+  TensorView & unit_output(){
+    return unit_output( default_context() );
+  }
+  TensorView & activated_output(){
+    return activated_output( default_context() );
+  }
+  TensorView & delta(){
+    return delta( default_context() );
+  }
+
+  // parameters() does not change, this copy saves building it every step
+  const std::vector<Parameter> & cached_parameters(){
+    if( parameter_cache.empty() ){
+      parameter_cache = parameters();
+    }
+    return parameter_cache;
   }
 
   virtual void print_info( ){
@@ -33,19 +305,90 @@ public:
     std::cout << std::endl;
   }
 protected:
-  vec target;
+  // the default context, owned by the input layer
+  ExecutionContext * own_context;
+  std::vector<Parameter> parameter_cache;
+
   void init( int u, Layer * prev, ActivationFunction * af, std::string ln) {
+    own_context = nullptr;
     next_layer = nullptr;
     previous_layer = prev;
     previous_layer->next_layer = this;
+    index = prev->index + 1;
     units = u;
     inputs = prev->units;
     activation_func = af;
     layer_name = ln;
-    unit_output.resize( units );
-    activated_output.resize( units );
-    delta.resize( units, 0 );
+  }
+  void init_input( int u ){
+    own_context = nullptr;
+    next_layer = nullptr;
+    previous_layer = nullptr;
+    index = 0;
+    units = u;
+    inputs = 0;
+    activation_func = &id;
   }
 };
 
+ExecutionContext::ExecutionContext( Layer * input, ExecutionMode m ){
+  mode = m;
+  arena_allocations = 0;
+  profiler = nullptr;
+  for(Layer * l = input; l != nullptr; l = l->next_layer){
+    layers.push_back( l );
+    states.push_back( l->create_state() );
+  }
+  // propagate, then back_propagate, then gradient_descent
+  int n = layers.size();
+  for(int i = 0; i < n; i++){
+    ScheduleStep f = { i, FORWARD_STEP };
+    schedule.push_back( f );
+  }
+  for(int i = n - 1; m == TRAINING && i >= 0; i--){
+    ScheduleStep b = { i, BACKWARD_STEP };
+    schedule.push_back( b );
+  }
+  for(int i = 0; m == TRAINING && i < n; i++){
+    ScheduleStep g = { i, GRADIENT_STEP };
+    schedule.push_back( g );
+  }
+  set_batch_size( 1 );
+}
+
+ExecutionContext::~ExecutionContext(){
+  for(int i = 0; i < states.size(); i++){
+    delete states[i];
+  }
+}
+
+void ExecutionContext::set_batch_size( int n ){
+  batch_size = n;
+  std::vector<int> units;
+  std::vector<bool> keeps;
+  for(int i = 0; i < layers.size(); i++){
+    units.push_back( layers[i]->units );
+    keeps.push_back( layers[i]->keeps_outputs() );
+  }
+  plan.plan( units, keeps, n, mode, schedule );
+  if( arena.size() < plan.peak ){
+    vec().swap( arena );
+    arena.resize( plan.peak );
+    arena_allocations++;
+  }
+  for(int i = 0; i < layers.size(); i++){
+    TensorView * t[ TENSOR_KINDS ] = { &states[i]->unit_output, &states[i]->activated_output, &states[i]->delta };
+    for(int k = 0; k < TENSOR_KINDS; k++){
+      int idx = TENSOR_KINDS * i + k;
+      t[k]->bind( arena.data() + plan.offset[ idx ], plan.size[ idx ] > 0 ? (size_t)n * units[i] : 0 );
+    }
+    layers[i]->resize_state( *states[i], n );
+  }
+}
+
+void ExecutionContext::set_schedule( const std::vector<ScheduleStep> & s ){
+  schedule = s;
+  set_batch_size( batch_size );
+}
+
 #endif
@@ -2,6 +2,20 @@
 #define POOLINGLAYER
 #include "layer_base.hpp"
 #include "layer_2d.hpp"
+#include "convolution_layer.hpp"
+
+// per context record of where each maximum came from
+struct MaxPoolingState : public LayerState {
+  std::vector< std::pair<int,int> > unit_max_coord;
+  vec row_max;
+  std::vector<const F *> window_rows; // blocked input
+  // fused with the convolution: position of each maximum in its window, the convolution's
+  // output before its activation there, and the delta passed back to the convolution
+  std::vector<int8_t> window_max;
+  vec conv_u;
+  vec conv_delta;
+
+};
 
 class MaxPoolingLayer : public Layer2D {
 public:
@@ -14,65 +28,221 @@ public:
     prev_w = prev->unit_w;
     unit_h = prev_h / stride;
     unit_w = prev_w / stride;
+    fused = false;
+    for(int k = 0; k < pooling_size * pooling_size; k++){
+      window_row.push_back( k / pooling_size );
+      window_col.push_back( k % pooling_size );
+    }
     init( channel * unit_h * unit_w, prev, af, "[max pooling]" + ln );
-    unit_max_coord.resize( units );
   }
 
-  void propagate(){
-    for(int c = 0; c < channel; c++){
-      for(int h = 0; h < unit_h; h++){
-	for(int w = 0; w < unit_w; w++){
-	  int mph = -1, mpw = -1;
-	  F mv = -inf;
-	  for(int s = 0; s < pooling_size; s++){
-	    for(int t = 0; t < pooling_size; t++){
-	      int ph = h * stride + s - pooling_size / 2;
-	      int pw = w * stride + t - pooling_size / 2;
-	      if( is_in_prev( c, ph, pw ) && mv < previous_layer->activated_output[ prev_coord( c, ph, pw ) ] ){
-	        mv = previous_layer->activated_output[ prev_coord( c, ph, pw ) ];
-		mph = ph;
-		mpw = pw;
-	      }
-	    }
-	  }
-	  int unit_idx = unit_coord(c, h, w);
-	  unit_max_coord[ unit_idx ] = std::make_pair(mph, mpw);
-	  unit_output[ unit_idx ] = mv;
-	  activated_output[ unit_idx ] = activation_func->f( mv );
-	}
+  // computes the previous convolution layer too, without writing its full resolution
+  // outputs ( see ConvolutionLayer::propagate_pooled ); the parameters, checkpoints and
+  // outputs of this layer are the same, the convolution's own outputs are not set any more
+  void set_fused( bool f ){
+    ConvolutionLayer * conv = dynamic_cast<ConvolutionLayer *>( previous_layer );
+    if( f && conv == nullptr ){
+      throw "max pooling can only be fused with a convolution : " + layer_name;
+    }
+    if( f && pooling_size * pooling_size > 127 ){
+      throw "pooling window too large to fuse : " + layer_name;
+    }
+    fused = f;
+    if( conv != nullptr ){
+      conv->fused_pooling = f;
+      conv->set_engine( conv->engine );
+    }
+  }
+
+  LayerState * create_state(){
+    return new MaxPoolingState();
+  }
+  void resize_state( LayerState & s, int n ){
+    MaxPoolingState & ms = static_cast<MaxPoolingState &>( s );
+    ms.unit_max_coord.resize( n * units );
+    ms.row_max.resize( prev_w );
+    Layer::resize_state( s, n );
+  }
+
+  // a comparison per pixel of a window, and the convolution of a fused forward
+  virtual LayerCost cost( ProfilePhase p, int n ){
+    LayerCost c = Layer::cost( p, n );
+    if( p == FORWARD_PHASE ){
+      c.flops = (double)n * units * pooling_size * pooling_size;
+    }
+    if( p == FORWARD_PHASE && fused ){
+      LayerCost conv = static_cast<ConvolutionLayer *>( previous_layer )->convolution_cost( n );
+      c.flops += conv.flops;
+      c.bytes = conv.bytes + sizeof( F ) * n * (double)units;
+    }
+    return c;
+  }
+
+  void forward( ExecutionContext & ctx ){
+    if( fused ){
+      forward_fused( ctx );
+      return;
+    }
+    if( prev_block > 1 ){
+      forward_blocked( ctx );
+      return;
+    }
+    MaxPoolingState & st = static_cast<MaxPoolingState &>( state( ctx ) );
+    vec & row_max = st.row_max;
+    for(int n = 0; n < st.batch_size; n++){
+      const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+      std::pair<int,int> * mc = &st.unit_max_coord[ n * units ];
+      for(int c = 0; c < channel; c++){
+        for(int h = 0; h < unit_h; h++){
+          // column-wise max over the pooling rows
+          bool first = true;
+          for(int s = 0; s < pooling_size; s++){
+            int ph = h * stride + s - pooling_size / 2;
+            if( ph < 0 || prev_h <= ph ) continue;
+            const F * row = &z[ prev_coord( c, ph, 0 ) ];
+            if( first ){
+              std::copy( row, row + prev_w, row_max.begin() );
+              first = false;
+            }else{
+              simd.max_vec( prev_w, row, row_max.data() );
+            }
+          }
+          for(int w = 0; w < unit_w; w++){
+            F mv = -inf;
+            for(int t = 0; t < pooling_size; t++){
+              int pw = w * stride + t - pooling_size / 2;
+              if( 0 <= pw && pw < prev_w ){
+                mv = std::max( mv, row_max[ pw ] );
+              }
+            }
+            int unit_idx = unit_coord(c, h, w);
+            mc[ unit_idx ] = find_max( z, c, h, w, mv );
+            st.unit_output[ n * units + unit_idx ] = mv;
+          }
+        }
       }
     }
-    if( next_layer != nullptr )
-      next_layer->propagate();
+    activate( activation_func, st.batch_size * units, st.unit_output.data(), st.activated_output.data() );
   }
 
-  void back_propagate(){
-    vec & prev_delta = previous_layer->delta;
-    std::fill( prev_delta.begin(), prev_delta.end(), 0 );
-    for(int c = 0; c < channel; c++){
-      for(int h = 0; h < unit_h; h++){
-	for(int w = 0; w < unit_w; w++){
-	  int ph = unit_max_coord[ unit_coord(c, h, w) ].first;
-	  int pw = unit_max_coord[ unit_coord(c, h, w) ].second;
-	  prev_delta[ prev_coord(c, ph, pw) ]
-	    += delta[ unit_coord(c, h, w) ] * previous_layer->activation_func->df( previous_layer->unit_output[ prev_coord(c, ph, pw) ] );
-	}
+  // channel blocked input: the window max of a pixel is taken for all the channels
+  // of a block at once, keeping the first position of each maximum as find_max does
+  void forward_blocked( ExecutionContext & ctx ){
+    MaxPoolingState & st = static_cast<MaxPoolingState &>( state( ctx ) );
+    const int B = simd.channel_block;
+    int half = pooling_size / 2, lanes_max = std::max( prev_block, B );
+    st.row_max.resize( std::max( prev_w, 2 * lanes_max ) );
+    st.window_rows.resize( pooling_size );
+    F * m = st.row_max.data(), * arg = m + lanes_max;
+    for(int n = 0; n < st.batch_size; n++){
+      const F * z = &previous_layer->activated_output( ctx )[ n * inputs ];
+      std::pair<int,int> * mc = &st.unit_max_coord[ n * units ];
+      for(int c0 = 0; c0 < channel; c0 += prev_block){
+        int lanes = std::min( prev_block, channel - c0 );
+        for(int h = 0; h < unit_h; h++){
+          int top = h * stride - half;
+          int r0 = std::max( top, 0 ), r1 = std::min( top + pooling_size, prev_h );
+          for(int w = 0; w < unit_w; w++){
+            int left = w * stride - half;
+            int q0 = std::max( left, 0 ), q1 = std::min( left + pooling_size, prev_w );
+            int k0 = ( r0 - top ) * pooling_size + q0 - left;
+            if( lanes == B ){
+              for(int r = r0; r < r1; r++){
+                st.window_rows[ r - r0 ] = &z[ prev_coord( c0, r, q0 ) ];
+              }
+              simd.max_window( st.window_rows.data(), r1 - r0, q1 - q0, B, k0, pooling_size, m, arg );
+            }else{
+              // a block narrower than the vectors
+              std::fill( m, m + lanes, -inf );
+              for(int r = r0; r < r1; r++){
+                for(int q = q0; q < q1; q++){
+                  const F * p = &z[ prev_coord( c0, r, q ) ];
+                  F k = k0 + ( r - r0 ) * pooling_size + q - q0;
+                  for(int i = 0; i < lanes; i++){
+                    bool g = p[i] > m[i];
+                    m[i] = g ? p[i] : m[i];
+                    arg[i] = g ? k : arg[i];
+                  }
+                }
+              }
+            }
+            for(int i = 0; i < lanes; i++){
+              int k = (int)arg[i];
+              int unit_idx = unit_coord( c0 + i, h, w );
+              mc[ unit_idx ] = std::make_pair( top + window_row[k], left + window_col[k] );
+              st.unit_output[ n * units + unit_idx ] = m[i];
+            }
+          }
+        }
       }
     }
-    if( previous_layer != nullptr )
-      previous_layer->back_propagate();
+    activate( activation_func, st.batch_size * units, st.unit_output.data(), st.activated_output.data() );
   }
 
-  void gradient_descent(F learning_rate, F momentum){
-    if( next_layer != nullptr )
-      next_layer->gradient_descent(learning_rate, momentum);
+  void forward_fused( ExecutionContext & ctx ){
+    MaxPoolingState & st = static_cast<MaxPoolingState &>( state( ctx ) );
+    ConvolutionLayer * conv = static_cast<ConvolutionLayer *>( previous_layer );
+    st.window_max.resize( st.batch_size * units );
+    st.conv_u.resize( st.batch_size * units );
+    conv->propagate_pooled( ctx, pooling_size, stride, unit_h, unit_w, block, window_row.data(), window_col.data(),
+                            st.unit_output.data(), st.window_max.data(), st.conv_u.data() );
+    activate( activation_func, st.batch_size * units, st.unit_output.data(), st.activated_output.data() );
+  }
+
+  void backward( ExecutionContext & ctx ){
+    if( fused ){
+      // the convolution's activation derivative at the maxima, then straight to its padded delta
+      MaxPoolingState & st = static_cast<MaxPoolingState &>( state( ctx ) );
+      ConvolutionLayer * conv = static_cast<ConvolutionLayer *>( previous_layer );
+      st.conv_delta.assign( st.delta.begin(), st.delta.end() );
+      mul_activation_derivative( conv->activation_func, st.batch_size * units,
+                                 st.conv_u.data(), st.unit_output.data(), st.conv_delta.data() );
+      conv->scatter_pooled_delta( ctx, pooling_size, stride, unit_h, unit_w, block, window_row.data(), window_col.data(),
+                                  st.conv_delta.data(), st.window_max.data() );
+      return;
+    }
+    MaxPoolingState & st = static_cast<MaxPoolingState &>( state( ctx ) );
+    LayerState & p = previous_layer->state( ctx );
+    std::fill( p.delta.begin(), p.delta.end(), 0 );
+    for(int n = 0; n < st.batch_size; n++){
+      F * pd = &p.delta[ n * inputs ];
+      const F * d = &st.delta[ n * units ];
+      const std::pair<int,int> * mc = &st.unit_max_coord[ n * units ];
+      for(int c = 0; c < channel; c++){
+        for(int h = 0; h < unit_h; h++){
+          for(int w = 0; w < unit_w; w++){
+            int unit_idx = unit_coord(c, h, w);
+            pd[ prev_coord(c, mc[ unit_idx ].first, mc[ unit_idx ].second) ] += d[ unit_idx ];
+          }
+        }
+      }
+    }
+    // the activation derivative is applied once per previous layer unit
+    mul_activation_derivative( previous_layer->activation_func, st.batch_size * inputs,
+                               p.unit_output.data(), p.activated_output.data(), p.delta.data() );
   }
 
   int stride;
   int pooling_size;
+  bool fused;
 private:
   const F inf = 1e9;
-  std::vector< std::pair<int,int> > unit_max_coord;
+  // row and column of each position s pooling_size + t of a window
+  std::vector<int> window_row, window_col;
+
+  // the first unit in the window of unit ( c, h, w ) holding the maximum mv
+  std::pair<int,int> find_max( const F * z, int c, int h, int w, F mv ){
+    for(int s = 0; s < pooling_size; s++){
+      for(int t = 0; t < pooling_size; t++){
+        int ph = h * stride + s - pooling_size / 2;
+        int pw = w * stride + t - pooling_size / 2;
+        if( is_in_prev( c, ph, pw ) && z[ prev_coord( c, ph, pw ) ] == mv ){
+          return std::make_pair( ph, pw );
+        }
+      }
+    }
+    return std::make_pair( -1, -1 );
+  }
 };
 
 #endif
@@ -6,41 +6,52 @@ class SoftmaxLayer : public FullyConnectedLayer {
 public:
   SoftmaxLayer(int u, Layer * prev ) : FullyConnectedLayer( u, prev, &softmax, "[softmax]" ){}
   
-  void propagate(){
-    vec & z = previous_layer->activated_output;
-    unit_output = vec_plus_vec(mat_prod_vec( weight, z ), bias);
-    F sum = 0;
-    for(int i = 0; i < units; i++){
-      sum += std::exp( unit_output[i] );
-    }
-    for(int i = 0; i < units; i++){
-      activated_output[i] = std::exp( unit_output[i] ) / sum;
+  void forward( ExecutionContext & ctx ){
+    LayerState & s = state( ctx );
+    compute_unit_output( ctx );
+    for(int n = 0; n < s.batch_size; n++){
+      F * y = &s.unit_output[ n * units ];
+      F * o = &s.activated_output[ n * units ];
+      simd.add_vec( units, bias.data(), y );
+      // exp( y - max ) / sum keeps exp from overflowing
+      simd.add_scalar( units, - simd.max_reduce( units, y ), y, o );
+      simd.exp( units, o, o );
+      F sum = 0;
+      for(int i = 0; i < units; i++){
+        sum += o[i];
+      }
+      simd.scale( units, 1 / sum, o );
     }
-    if( next_layer != nullptr )
-      next_layer->propagate();
   }
-  void back_propagate(){
+  void backward( ExecutionContext & ctx ){
     // compute this layer's delta
-    for(int i = 0; i < units; i++){
+    LayerState & s = state( ctx );
+    for(int k = 0; k < s.batch_size * units; k++){
       // differenciate cross entropy
-      delta[i] = activated_output[i] - target[i];
+      s.delta[k] = s.activated_output[k] - s.target[k];
     }
     // compute previous layer's delta
-    compute_previous_layer_delta();
-    if( previous_layer != nullptr )
-      previous_layer->back_propagate();
+    compute_previous_layer_delta( ctx );
   }
-  int get_class(){
-    F p = activated_output[0];
+  int get_class( ExecutionContext & ctx, int n ){
+    // class of the n-th sample in the mini-batch
+    const F * o = &activated_output( ctx )[ n * units ];
+    F p = o[0];
     int i = 0;
     for(int k = 1; k < units; k++){
-      if( p < activated_output[k] ){
-        p = activated_output[k];
+      if( p < o[k] ){
+        p = o[k];
         i = k;
       }
     }
     return i;
   }
+  int get_class( int n ){
+    return get_class( default_context(), n );
+  }
+  int get_class(){
+    return get_class( 0 );
+  }
 };
 
 #endif
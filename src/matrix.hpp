@@ -4,33 +4,326 @@
 #include <iomanip>
 #include "common.hpp"
 #include "activation_functions.hpp"
+#include "simd.hpp"
+
+// block sizes of the cache blocked kernels below
+const int GEMM_BLOCK_M = 64;
+const int GEMM_BLOCK_N = 256;
+const int GEMM_BLOCK_K = 128;
+
+// all matrices are row-major; ld* is the distance between two rows
+
+// y += A x  ( A = [m x n] )
+void gemv( int m, int n, const F * A, int lda, const F * x, F * y ){
+  for(int i = 0; i < m; i++){
+    y[i] += simd.dot( n, A + (long)i * lda, x );
+  }
+}
+
+// y += A^T x  ( A = [m x n] ), streams A row by row
+void gemv_t( int m, int n, const F * A, int lda, const F * x, F * y ){
+  for(int j0 = 0; j0 < n; j0 += GEMM_BLOCK_N){
+    int j1 = std::min( n, j0 + GEMM_BLOCK_N );
+    for(int i = 0; i < m; i++){
+      simd.axpy( j1 - j0, x[i], A + (long)i * lda + j0, y + j0 );
+    }
+  }
+}
+
+// C += A B  ( A = [m x k], B = [k x n], C = [m x n] )
+void gemm_nn( int m, int n, int k, const F * A, int lda, const F * B, int ldb, F * C, int ldc ){
+  for(int i0 = 0; i0 < m; i0 += GEMM_BLOCK_M){
+    int i1 = std::min( m, i0 + GEMM_BLOCK_M );
+    for(int p0 = 0; p0 < k; p0 += GEMM_BLOCK_K){
+      int p1 = std::min( k, p0 + GEMM_BLOCK_K );
+      for(int j0 = 0; j0 < n; j0 += GEMM_BLOCK_N){
+        int j1 = std::min( n, j0 + GEMM_BLOCK_N );
+        for(int i = i0; i < i1; i++){
+          F * c = C + (long)i * ldc;
+          for(int p = p0; p < p1; p++){
+            simd.axpy( j1 - j0, A[ (long)i * lda + p ], B + (long)p * ldb + j0, c + j0 );
+          }
+        }
+      }
+    }
+  }
+}
+
+// C += A B^T  ( A = [m x k], B = [n x k], C = [m x n] )
+void gemm_nt( int m, int n, int k, const F * A, int lda, const F * B, int ldb, F * C, int ldc ){
+  // a [ GEMM_BLOCK_M x GEMM_BLOCK_N ] panel of B stays in cache across all rows of A
+  for(int j0 = 0; j0 < n; j0 += GEMM_BLOCK_M){
+    int j1 = std::min( n, j0 + GEMM_BLOCK_M );
+    for(int p0 = 0; p0 < k; p0 += GEMM_BLOCK_N){
+      int p1 = std::min( k, p0 + GEMM_BLOCK_N );
+      for(int i = 0; i < m; i++){
+        const F * a = A + (long)i * lda;
+        F * c = C + (long)i * ldc;
+        for(int j = j0; j < j1; j++){
+          c[j] += simd.dot( p1 - p0, a + p0, B + (long)j * ldb + p0 );
+        }
+      }
+    }
+  }
+}
+
+// C += A^T B  ( A = [k x m], B = [k x n], C = [m x n] )
+void gemm_tn( int m, int n, int k, const F * A, int lda, const F * B, int ldb, F * C, int ldc ){
+  for(int i0 = 0; i0 < m; i0 += GEMM_BLOCK_M){
+    int i1 = std::min( m, i0 + GEMM_BLOCK_M );
+    for(int j0 = 0; j0 < n; j0 += GEMM_BLOCK_N){
+      int j1 = std::min( n, j0 + GEMM_BLOCK_N );
+      for(int p = 0; p < k; p++){
+        const F * a = A + (long)p * lda;
+        const F * b = B + (long)p * ldb;
+        for(int i = i0; i < i1; i++){
+          simd.axpy( j1 - j0, a[i], b + j0, C + (long)i * ldc + j0 );
+        }
+      }
+    }
+  }
+}
+
+// lowers a [ch x h x w] image for a stride 1 convolution with filter fs x fs
+// and zero padding pad; row ( c * fs + s ) * fs + t of cols holds the pixels
+// seen by filter tap (c, s, t) at each of the out_h x out_w output positions
+void im2col( const F * in, int ch, int h, int w, int fs, int pad, int out_h, int out_w, F * cols, int ldc ){
+  for(int c = 0; c < ch; c++){
+    for(int s = 0; s < fs; s++){
+      for(int t = 0; t < fs; t++){
+        F * col = cols + (long)( ( c * fs + s ) * fs + t ) * ldc;
+        for(int y = 0; y < out_h; y++){
+          int iy = y + s - pad;
+          F * dst = col + y * out_w;
+          if( iy < 0 || h <= iy ){
+            std::fill( dst, dst + out_w, (F)0 );
+            continue;
+          }
+          const F * src = in + ( c * h + iy ) * w;
+          for(int x = 0; x < out_w; x++){
+            int ix = x + t - pad;
+            dst[x] = ( 0 <= ix && ix < w ) ? src[ix] : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+// inverse of im2col: adds every entry of cols back onto the pixel it was read from
+void col2im( const F * cols, int ldc, int ch, int h, int w, int fs, int pad, int out_h, int out_w, F * out ){
+  for(int c = 0; c < ch; c++){
+    for(int s = 0; s < fs; s++){
+      for(int t = 0; t < fs; t++){
+        const F * col = cols + (long)( ( c * fs + s ) * fs + t ) * ldc;
+        for(int y = 0; y < out_h; y++){
+          int iy = y + s - pad;
+          if( iy < 0 || h <= iy ) continue;
+          const F * src = col + y * out_w;
+          F * dst = out + ( c * h + iy ) * w;
+          for(int x = 0; x < out_w; x++){
+            int ix = x + t - pad;
+            if( 0 <= ix && ix < w ){
+              dst[ix] += src[x];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// index of channel c of pixel ( y, x ) in an image of ch channels stored in blocks of
+// block channels, [ blocks x h x w x block ] ( NCHWc ); the last block holds only the
+// remaining channels, so the image has ch h w elements whatever the block is, and
+// block = 1 is the planar layout [ ch x h x w ]; block is a power of two
+inline int blocked_index( int c, int y, int x, int ch, int h, int w, int block ){
+  int c0 = c & -block;
+  return c0 * h * w + ( y * w + x ) * std::min( block, ch - c0 ) + ( c & ( block - 1 ) );
+}
+
+// copies the image in = [ ch x h x w ] stored in blocks of in_block channels into
+// out = [ ceil( ch / block ) x oh x ow x block ], with its pixel ( 0, 0 ) at ( top, left )
+// and zeros everywhere else, including the channels of the last block past ch
+void to_blocked( const F * in, int ch, int h, int w, int in_block, F * out, int block, int oh, int ow, int top, int left ){
+  int blocks = ( ch + block - 1 ) / block;
+  std::fill( out, out + (long)blocks * oh * ow * block, (F)0 );
+  if( in_block == block ){
+    // pixels are already blocked, rows are copied as they are
+    for(int c0 = 0; c0 < ch; c0 += block){
+      int lanes = std::min( block, ch - c0 );
+      for(int y = 0; y < h; y++){
+        const F * src = in + (long)c0 * h * w + (long)y * w * lanes;
+        F * dst = out + ( (long)( c0 / block ) * oh * ow + (long)( top + y ) * ow + left ) * block;
+        if( lanes == block ){
+          std::copy( src, src + w * block, dst );
+        }else{
+          for(int x = 0; x < w; x++){
+            std::copy( src + x * lanes, src + ( x + 1 ) * lanes, dst + x * block );
+          }
+        }
+      }
+    }
+    return;
+  }
+  for(int c = 0; c < ch; c++){
+    F * dst = out + ( (long)( c / block ) * oh * ow + (long)top * ow + left ) * block + c % block;
+    for(int y = 0; y < h; y++){
+      for(int x = 0; x < w; x++){
+        dst[ ( (long)y * ow + x ) * block ] = in[ blocked_index( c, y, x, ch, h, w, in_block ) ];
+      }
+    }
+  }
+}
+
+// the inverse of to_blocked without padding: out = [ ch x h x w ] in blocks of out_block
+// channels from in = [ ceil( ch / block ) x h x w x block ], which is planar for block = 1;
+// with add, the pixels are added onto out
+void from_blocked( const F * in, int block, int ch, int h, int w, F * out, int out_block, bool add ){
+  if( out_block == block ){
+    for(int c0 = 0; c0 < ch; c0 += block){
+      int lanes = std::min( block, ch - c0 );
+      for(long p = 0; p < (long)h * w; p++){
+        const F * src = in + ( (long)c0 / block * h * w + p ) * block;
+        F * dst = out + (long)c0 * h * w + p * lanes;
+        for(int i = 0; i < lanes; i++){
+          dst[i] = add ? dst[i] + src[i] : src[i];
+        }
+      }
+    }
+    return;
+  }
+  for(int c = 0; c < ch; c++){
+    const F * src = in + (long)( c / block ) * h * w * block + c % block;
+    for(int y = 0; y < h; y++){
+      for(int x = 0; x < w; x++){
+        F v = src[ ( (long)y * w + x ) * block ];
+        F & o = out[ blocked_index( c, y, x, ch, h, w, out_block ) ];
+        o = add ? o + v : v;
+      }
+    }
+  }
+}
+
+// copies the image [ ch x h x w ] channel last into out = [ oh x ow x ldc ],
+// with its pixel ( 0, 0 ) at ( top, left ) and zeros everywhere else
+void to_channel_last( const F * in, int ch, int h, int w, F * out, int oh, int ow, int top, int left, int ldc ){
+  std::fill( out, out + (long)oh * ow * ldc, (F)0 );
+  for(int c = 0; c < ch; c++){
+    for(int y = 0; y < h; y++){
+      F * dst = out + ( (long)( y + top ) * ow + left ) * ldc + c;
+      const F * src = in + ( c * h + y ) * w;
+      for(int x = 0; x < w; x++){
+        dst[ x * ldc ] = src[x];
+      }
+    }
+  }
+}
+
+// out[c][y][x] = in[ y + top ][ x + left ][c] for the image out = [ ch x h x w ],
+// in = [ * x iw x ldc ]; with add, the pixels are added onto out
+void from_channel_last( const F * in, int iw, int top, int left, int ldc, F * out, int ch, int h, int w, bool add ){
+  for(int c = 0; c < ch; c++){
+    for(int y = 0; y < h; y++){
+      const F * src = in + ( (long)( y + top ) * iw + left ) * ldc + c;
+      F * dst = out + ( c * h + y ) * w;
+      if( add ){
+        for(int x = 0; x < w; x++){
+          dst[x] += src[ x * ldc ];
+        }
+      }else{
+        for(int x = 0; x < w; x++){
+          dst[x] = src[ x * ldc ];
+        }
+      }
+    }
+  }
+}
+
+// Winograd F(M x M, 3 x 3) tiles of a stride 1 convolution ( see winograd.hpp )
+// tile t = ty tiles_w + tx of an image covers the outputs from ( ty M, tx M );
+// transformed tiles go to V = [ alpha^2 x ld x ldc ], where ld counts the tiles
+// of all images side by side, so V, t and the output tiles below point at the
+// first tile of the image
+// image is a channel last scratch buffer of ( tiles_h M + 2 ) x ( tiles_w M + 2 ) x ldc
+
+// transformed input tiles of the image in = [ ch x h x w ] with zero padding pad
+template <int M>
+void winograd_input_tiles( const F * in, int ch, int h, int w, int pad, int tiles_h, int tiles_w,
+                           F * image, F * V, long ld, int ldc ){
+  int iw = tiles_w * M + 2;
+  to_channel_last( in, ch, h, w, image, tiles_h * M + 2, iw, pad, pad, ldc );
+  for(int ty = 0; ty < tiles_h; ty++){
+    for(int tx = 0; tx < tiles_w; tx++){
+      simd.winograd_input[ M == 4 ]( ch, image + ( (long)ty * M * iw + tx * M ) * ldc, iw * ldc, ldc,
+                                     V + (long)( ty * tiles_w + tx ) * ldc, ld * ldc );
+    }
+  }
+}
+
+// transpose of winograd_input_tiles: adds the pixels of every tile of dV onto out = [ ch x h x w ]
+template <int M>
+void winograd_input_tiles_t( const F * dV, long ld, int ldc, int ch, int h, int w, int pad, int tiles_h, int tiles_w,
+                             F * image, F * out ){
+  int iw = tiles_w * M + 2;
+  std::fill( image, image + (long)( tiles_h * M + 2 ) * iw * ldc, (F)0 );
+  for(int ty = 0; ty < tiles_h; ty++){
+    for(int tx = 0; tx < tiles_w; tx++){
+      simd.winograd_input_t[ M == 4 ]( ch, dV + (long)( ty * tiles_w + tx ) * ldc, ld * ldc,
+                                       image + ( (long)ty * M * iw + tx * M ) * ldc, iw * ldc, ldc );
+    }
+  }
+  from_channel_last( image, iw, pad, pad, ldc, out, ch, h, w, true );
+}
+
+// outputs out = [ ch x h x w ] of the transformed products Mt = [ alpha^2 x ld x ldc ]
+template <int M>
+void winograd_output_tiles( const F * Mt, long ld, int ldc, int ch, int h, int w, int tiles_h, int tiles_w,
+                            F * image, F * out ){
+  int iw = tiles_w * M;
+  for(int ty = 0; ty < tiles_h; ty++){
+    for(int tx = 0; tx < tiles_w; tx++){
+      simd.winograd_output[ M == 4 ]( ch, Mt + (long)( ty * tiles_w + tx ) * ldc, ld * ldc,
+                                      image + ( (long)ty * M * iw + tx * M ) * ldc, iw * ldc, ldc );
+    }
+  }
+  from_channel_last( image, iw, 0, 0, ldc, out, ch, h, w, false );
+}
+
+// transpose of winograd_output_tiles for the gradient delta = [ ch x h x w ] of the outputs
+template <int M>
+void winograd_output_tiles_t( const F * delta, int ch, int h, int w, int tiles_h, int tiles_w,
+                              F * image, F * dM, long ld, int ldc ){
+  int iw = tiles_w * M;
+  to_channel_last( delta, ch, h, w, image, tiles_h * M, iw, 0, 0, ldc );
+  for(int ty = 0; ty < tiles_h; ty++){
+    for(int tx = 0; tx < tiles_w; tx++){
+      simd.winograd_output_t[ M == 4 ]( ch, image + ( (long)ty * M * iw + tx * M ) * ldc, iw * ldc, ldc,
+                                        dM + (long)( ty * tiles_w + tx ) * ldc, ld * ldc );
+    }
+  }
+}
 
 vec mat_prod_vec(const mat & M, const vec & v){
   vec r(M.size(), 0);
   for(int i = 0; i < M.size(); i++){
-    for(int j = 0; j < M[0].size(); j++){
-      if( M[i].size() != v.size() ){
-        throw "ERR";
-      }
-      r[i] += M[i][j] * v[j];
+    if( M[i].size() != v.size() ){
+      throw "ERR";
     }
+    gemv( 1, v.size(), M[i].data(), v.size(), v.data(), &r[i] );
   }
   return r;
 }
 
 vec vec_plus_vec(const vec & v, const vec & u){
-  vec r(v.size());
-  for(int i = 0; i < v.size(); i++){
-    r[i] = v[i] + u[i];
-  }
+  vec r(u);
+  simd.add_vec( v.size(), v.data(), r.data() );
   return r;
 }
 
 vec function_apply_to_vec(ActivationFunction * af, const vec & v){
   vec r(v.size());
-  for(int i = 0; i < v.size(); i++){
-    r[i] = af->f(v[i]);
-  }
+  activate( af, v.size(), v.data(), r.data() );
   return r;
 }
 
@@ -45,6 +338,18 @@ void print_mat(const mat & M){
   }
 }
 
+void print_mat(const vec & M, int rows, int cols){
+  // M = [ rows x cols ], row-major
+  std::cout << std::fixed;
+  std::cout << std::setprecision(2);
+  for(int i = 0; i < rows; i++){
+    for(int j = 0; j < cols; j++){
+      std::cout << M[i * cols + j] << " ";
+    }
+    std::cout << std::endl;
+  }
+}
+
 void print_vec(const vec & v){
   std::cout << std::fixed;
   std::cout << std::setprecision(2);
@@ -0,0 +1,199 @@
+#ifndef MEMORYPLAN
+#define MEMORYPLAN
+#include <iostream>
+#include "common.hpp"
+
+// a span of the arena of an ExecutionContext, holding one activation tensor
+// of a layer; it is bound by the context, so it is not assignable
+class TensorView {
+public:
+  TensorView() : p( nullptr ), n( 0 ) { }
+  void bind( F * data, size_t size ){
+    p = data;
+    n = size;
+  }
+  F * data(){ return p; }
+  const F * data() const { return p; }
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  F * begin(){ return p; }
+  F * end(){ return p + n; }
+  const F * begin() const { return p; }
+  const F * end() const { return p + n; }
+  F & operator[]( size_t i ){ return p[i]; }
+  const F & operator[]( size_t i ) const { return p[i]; }
+private:
+  F * p;
+  size_t n;
+  TensorView & operator=( const TensorView & );
+};
+
+#ifdef NN_COUNT_ALLOCATIONS
+// defined before including this library in the one translation unit of a program,
+// counts every allocation through new and the aligned vectors
+void * operator new( size_t n ){
+  heap_allocation_count++;
+  void * p = malloc( n == 0 ? 1 : n );
+  if( p == nullptr ){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete( void * p ) noexcept {
+  free( p );
+}
+void operator delete( void * p, size_t ) noexcept {
+  free( p );
+}
+long heap_allocations(){
+  return heap_allocation_count;
+}
+#else
+// -1: not counted
+long heap_allocations(){
+  return -1;
+}
+#endif
+
+// what a context is used for; inference contexts keep neither deltas nor the
+// outputs before the activation
+enum ExecutionMode {
+  TRAINING,
+  INFERENCE
+};
+
+enum StepKind {
+  FORWARD_STEP,
+  BACKWARD_STEP,
+  GRADIENT_STEP
+};
+// the layer-th layer's forward, backward or compute_gradient
+struct ScheduleStep {
+  int layer;
+  StepKind kind;
+};
+
+// the activation tensors of every layer ( unit_output, activated_output and
+// delta, tensor 3 i + k is kind k of layer i ) placed in one arena
+// the lifetime of a tensor runs from the first to the last step of the schedule
+// touching it, where
+//   forward i         reads activated_output of i-1, writes the outputs of i
+//   backward i        reads the delta and outputs of i, writes the delta of i-1
+//                     and reads its outputs
+//   compute_gradient  reads the delta of i and activated_output of i-1
+// the input's activated_output is written before the schedule and the output's
+// is read after it; tensors whose lifetimes do not overlap share memory
+// in inference unit_output is activated_output ( the activations are computed in
+// place ) and there is no delta; a layer not keeping its outputs ( a convolution
+// computed by the next layer ) has empty tensors, its consumer reading the layer before
+enum TensorKind {
+  UNIT_OUTPUT_TENSOR = 0,
+  ACTIVATED_OUTPUT_TENSOR = 1,
+  DELTA_TENSOR = 2
+};
+const int TENSOR_KINDS = 3;
+// offsets are multiples of a cache line
+const size_t TENSOR_ALIGN = 64 / sizeof( F );
+
+class MemoryPlan {
+public:
+  std::vector<size_t> size, offset; // in F
+  std::vector<int> first, last;     // steps, -1 before and schedule.size() after the schedule
+  size_t peak;  // arena size in F
+  size_t total; // the same without any reuse
+
+  MemoryPlan() : peak( 0 ), total( 0 ) { }
+  // units and keeps of every layer, for n samples
+  void plan( const std::vector<int> & units, const std::vector<bool> & keeps, int n,
+             ExecutionMode mode, const std::vector<ScheduleStep> & schedule ){
+    int layers = units.size(), tensors = TENSOR_KINDS * layers;
+    int end = schedule.size();
+    size.assign( tensors, 0 );
+    offset.assign( tensors, 0 );
+    first.assign( tensors, end );
+    last.assign( tensors, -1 );
+    for(int i = 0; i < layers; i++){
+      if( !keeps[i] ) continue;
+      size_t s = ( (size_t)n * units[i] + TENSOR_ALIGN - 1 ) / TENSOR_ALIGN * TENSOR_ALIGN;
+      size[ TENSOR_KINDS * i + ACTIVATED_OUTPUT_TENSOR ] = s;
+      if( mode == TRAINING ){
+        size[ TENSOR_KINDS * i + UNIT_OUTPUT_TENSOR ] = s;
+        size[ TENSOR_KINDS * i + DELTA_TENSOR ] = s;
+      }
+    }
+    use( ACTIVATED_OUTPUT_TENSOR, 0, -1 );
+    use( ACTIVATED_OUTPUT_TENSOR, layers - 1, end );
+    for(int s = 0; s < end; s++){
+      int i = schedule[s].layer;
+      // the layer whose outputs layer i reads
+      int j = i - 1;
+      while( j > 0 && !keeps[j] ) j--;
+      if( schedule[s].kind == FORWARD_STEP ){
+        use( ACTIVATED_OUTPUT_TENSOR, j, s );
+        use( UNIT_OUTPUT_TENSOR, i, s );
+        use( ACTIVATED_OUTPUT_TENSOR, i, s );
+      }else if( schedule[s].kind == BACKWARD_STEP ){
+        for(int k = 0; k < TENSOR_KINDS; k++){
+          use( (TensorKind)k, i, s );
+          use( (TensorKind)k, i - 1, s );
+        }
+      }else{
+        use( DELTA_TENSOR, i, s );
+        use( ACTIVATED_OUTPUT_TENSOR, j, s );
+      }
+    }
+    // larger tensors first, each at the lowest offset free during its lifetime
+    std::vector<int> order;
+    for(int t = 0; t < tensors; t++){
+      if( size[t] > 0 && !( mode == INFERENCE && t % TENSOR_KINDS == UNIT_OUTPUT_TENSOR ) ){
+        order.push_back( t );
+      }
+    }
+    std::stable_sort( order.begin(), order.end(), [&]( int a, int b ){ return size[a] > size[b]; } );
+    peak = 0;
+    total = 0;
+    std::vector<int> placed;
+    for(int k = 0; k < order.size(); k++){
+      int t = order[k];
+      if( first[t] > last[t] ){
+        // never touched by the schedule, kept for the whole step
+        first[t] = -1;
+        last[t] = end;
+      }
+      size_t o = 0;
+      for(bool moved = true; moved; ){
+        moved = false;
+        for(int q = 0; q < placed.size(); q++){
+          int u = placed[q];
+          if( first[u] <= last[t] && first[t] <= last[u] && o < offset[u] + size[u] && offset[u] < o + size[t] ){
+            o = offset[u] + size[u];
+            moved = true;
+          }
+        }
+      }
+      offset[t] = o;
+      placed.push_back( t );
+      peak = std::max( peak, o + size[t] );
+      total += size[t];
+    }
+    if( mode == INFERENCE ){
+      for(int i = 0; i < layers; i++){
+        offset[ TENSOR_KINDS * i + UNIT_OUTPUT_TENSOR ] = offset[ TENSOR_KINDS * i + ACTIVATED_OUTPUT_TENSOR ];
+        size[ TENSOR_KINDS * i + UNIT_OUTPUT_TENSOR ] = size[ TENSOR_KINDS * i + ACTIVATED_OUTPUT_TENSOR ];
+      }
+    }
+  }
+  void print(){
+    std::cout << "activation memory = " << peak * sizeof( F ) << " bytes ( "
+              << total * sizeof( F ) << " bytes without reuse )" << std::endl;
+  }
+private:
+  void use( TensorKind k, int layer, int step ){
+    if( layer < 0 ) return;
+    int t = TENSOR_KINDS * layer + k;
+    first[t] = std::min( first[t], step );
+    last[t] = std::max( last[t], step );
+  }
+};
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef NETWORK
+#define NETWORK
+#include "common.hpp"
+#include "layer/layer.hpp"
+#include "batch_pipeline.hpp"
+#include "optimizer.hpp"
+
+// a network as a list of layers run by an explicit schedule, instead of each
+// layer calling the next one
+//   Network net( input );          the layers already linked after input
+//   net.compile();                 layout, engines and fusion chosen by shape
+//   net.train_step( batch, 0.01, 0.5 );      AdaGrad with momentum, or
+//   net.train_step( batch, optimizer );      any rule of optimizer.hpp
+// the layers stay usable on their own, compile() only changes how they compute,
+// not their parameters, outputs or checkpoints
+// the gradient of a layer is computed right after its backward step, so that its
+// delta and its input can be reused by the tensors of the layers before it ( see
+// MemoryPlan ); in steady state a step makes no heap allocation
+class Network {
+public:
+  std::vector<Layer *> layers;
+
+  // an empty network, built with add()
+  Network() : own_context( nullptr ), profiler( nullptr ), last_step_allocations( -1 ) { }
+  // the layers linked after input, which stay owned by the caller
+  Network( Layer & input ) : own_context( nullptr ), profiler( nullptr ), last_step_allocations( -1 ) {
+    for(Layer * l = &input; l != nullptr; l = l->next_layer){
+      layers.push_back( l );
+    }
+    schedule();
+  }
+  ~Network(){
+    delete own_context;
+    for(int i = (int)owned.size() - 1; i >= 0; i--){
+      delete owned[i];
+    }
+  }
+  // appends l, constructed with output() as its previous layer, and owns it
+  //   InputLayer2D & input = net.add( new InputLayer2D( 1, 28, 28 ) );
+  //   FullyConnectedLayer & full = net.add( new FullyConnectedLayer( 100, &input, &relu, "full" ) );
+  template <class L>
+  L & add( L * l ){
+    if( l->previous_layer != ( layers.empty() ? nullptr : layers.back() ) ){
+      std::string name = l->layer_name;
+      delete l;
+      throw "layer not linked after the last one : " + name;
+    }
+    owned.push_back( l );
+    layers.push_back( l );
+    schedule();
+    return *l;
+  }
+  Layer & input(){
+    return *layers.front();
+  }
+  Layer & output(){
+    return *layers.back();
+  }
+  // the network's own context, for single threaded use
+  ExecutionContext & context(){
+    if( own_context == nullptr ){
+      own_context = create_context( TRAINING );
+    }
+    return *own_context;
+  }
+  // a context running this network's schedule, owned by the caller
+  ExecutionContext * create_context( ExecutionMode mode ){
+    ExecutionContext * ctx = new ExecutionContext( &input(), mode );
+    ctx->set_schedule( mode == TRAINING ? steps : forward_only() );
+    ctx->profiler = profiler;
+    return ctx;
+  }
+  // times the steps of the network's own context and of the contexts created
+  // from now on ( see profiler.hpp ), nullptr stops
+  void set_profiler( Profiler * p ){
+    profiler = p;
+    if( own_context != nullptr ){
+      own_context->profiler = p;
+    }
+  }
+
+  // rewrites the network for the shapes of its layers
+  // - images between the 2D layers are channel blocked ( InputLayer2D::set_channel_block )
+  //   when every convolution has at least half a vector of output channels
+  // - planar 3x3 convolutions use Winograd, F(4x4) from 8x8 outputs and F(2x2) below,
+  //   the others im2col
+  // - a max pooling after a convolution computes both in one pass ( MaxPoolingLayer::set_fused );
+  //   its ReLU is dropped when the convolution's outputs are already non-negative
+  // bias + activation and FC + softmax ( + cross entropy ) are already single epilogues
+  // of the layers ( bias_activate, SoftmaxLayer )
+  void compile(){
+    choose_layout();
+    for(int i = 0; i < layers.size(); i++){
+      ConvolutionLayer * c = dynamic_cast<ConvolutionLayer *>( layers[i] );
+      if( c != nullptr ){
+        c->set_engine( engine_for( *c ) );
+      }
+      MaxPoolingLayer * p = dynamic_cast<MaxPoolingLayer *>( layers[i] );
+      if( p != nullptr ){
+        fuse_pooling( *p );
+      }
+    }
+    schedule();
+  }
+
+  void forward( ExecutionContext & ctx ){
+    for(int i = 0; i < forward_steps.size(); i++){
+      forward_steps[i]->run_step( ctx, FORWARD_STEP );
+    }
+  }
+  void forward( ExecutionContext & ctx, const F * in, int n ){
+    long a = heap_allocations();
+    input().set_input( ctx, in, n );
+    forward( ctx );
+    count_allocations( a );
+  }
+  void forward( ExecutionContext & ctx, const vec * in, int n ){
+    long a = heap_allocations();
+    input().set_input( ctx, in, n );
+    forward( ctx );
+    count_allocations( a );
+  }
+  // one sample on an inference context, the low latency path: in is written once into
+  // the arena ( already channel blocked ), the fully connected layers run as GEMV, and
+  // the outputs of the last layer are copied to out; once ctx holds a single sample
+  // nothing is allocated
+  //   ExecutionContext * ctx = net.create_context( INFERENCE );
+  //   net.infer( *ctx, image, probabilities );
+  void infer( ExecutionContext & ctx, const F * in, F * out ){
+    if( ctx.mode != INFERENCE ){
+      throw "infer needs an inference context";
+    }
+    forward( ctx, in, 1 );
+    const TensorView & o = output().activated_output( ctx );
+    std::copy( o.begin(), o.end(), out );
+  }
+  // the deltas and the gradients of every layer, from the targets set on output()
+  void backward( ExecutionContext & ctx ){
+    if( ctx.mode == INFERENCE ){
+      throw "an inference context keeps no delta";
+    }
+    for(int i = 0; i < backward_steps.size(); i++){
+      layers[ backward_steps[i].layer ]->run_step( ctx, backward_steps[i].kind );
+    }
+  }
+  void backward( ExecutionContext & ctx, const F * target ){
+    output().set_target( ctx, target, ctx.batch_size );
+    backward( ctx );
+  }
+  void apply_gradient( ExecutionContext & ctx, F learning_rate, F momentum, F grad_scale ){
+    for(int i = 0; i < gradient_steps.size(); i++){
+      gradient_steps[i]->apply_gradient( ctx, learning_rate, momentum, grad_scale );
+    }
+  }
+  // one step on the n samples in with targets target, gradients averaged over them
+  void train_step( ExecutionContext & ctx, const F * in, const F * target, int n, F learning_rate, F momentum ){
+    long a = heap_allocations();
+    forward( ctx, in, n );
+    backward( ctx, target );
+    apply_gradient( ctx, learning_rate, momentum, (F)1.0 / n );
+    count_allocations( a );
+    if( ctx.profiler != nullptr ){
+      ctx.profiler->step_done();
+    }
+  }
+  void train_step( ExecutionContext & ctx, const F * in, const F * target, int n, Optimizer & opt ){
+    long a = heap_allocations();
+    forward( ctx, in, n );
+    backward( ctx, target );
+    opt.step( ctx, (F)1.0 / n );
+    count_allocations( a );
+    if( ctx.profiler != nullptr ){
+      ctx.profiler->step_done();
+    }
+  }
+
+  // the same on the default context
+  void forward( const F * in, int n ){
+    forward( context(), in, n );
+  }
+  void forward( std::vector<vec> & in ){
+    forward( context(), in.data(), in.size() );
+  }
+  void forward( const Batch & b ){
+    forward( context(), b.data.data(), b.size );
+  }
+  void train_step( const Batch & b, F learning_rate, F momentum ){
+    train_step( context(), b.data.data(), b.target.data(), b.size, learning_rate, momentum );
+  }
+  void train_step( const Batch & b, Optimizer & opt ){
+    train_step( context(), b.data.data(), b.target.data(), b.size, opt );
+  }
+
+  void print_schedule(){
+    std::cout << "forward  :";
+    for(int i = 0; i < forward_steps.size(); i++){
+      std::cout << ( i == 0 ? " " : " > " ) << forward_steps[i]->layer_name;
+      ConvolutionLayer * c = dynamic_cast<ConvolutionLayer *>( forward_steps[i]->previous_layer );
+      if( c != nullptr && c->fused_pooling ){
+        std::cout << " ( + " << c->layer_name << " )";
+      }
+    }
+    std::cout << std::endl;
+    std::cout << "backward :";
+    for(int i = 0; i < backward_steps.size(); i++){
+      if( backward_steps[i].kind == BACKWARD_STEP ){
+        std::cout << ( i == 0 ? " " : " > " ) << layers[ backward_steps[i].layer ]->layer_name;
+      }else{
+        std::cout << " ( gradient )";
+      }
+    }
+    std::cout << std::endl;
+    std::cout << std::endl;
+  }
+  // the arena of ctx, and the heap allocations of the last step when counted
+  // ( NN_COUNT_ALLOCATIONS, see memory_plan.hpp )
+  void print_memory( ExecutionContext & ctx ){
+    ctx.plan.print();
+    std::cout << "arena allocations = " << ctx.arena_allocations << std::endl;
+    if( last_step_allocations >= 0 ){
+      std::cout << "heap allocations in the last step = " << last_step_allocations << std::endl;
+    }
+    std::cout << std::endl;
+  }
+private:
+  std::vector<Layer *> owned;
+  ExecutionContext * own_context;
+  Profiler * profiler;
+  // the layers whose forward is run, in order, the backward and gradient steps
+  // after them, and the layers with parameters
+  std::vector<Layer *> forward_steps, gradient_steps;
+  std::vector<ScheduleStep> backward_steps, steps;
+  long last_step_allocations;
+
+  void count_allocations( long before ){
+    if( before >= 0 ){
+      last_step_allocations = heap_allocations() - before;
+    }
+  }
+
+  void schedule(){
+    forward_steps.clear();
+    backward_steps.clear();
+    gradient_steps.clear();
+    steps.clear();
+    for(int i = 0; i < layers.size(); i++){
+      // a fused convolution is computed by the pooling after it
+      if( layers[i]->keeps_outputs() ){
+        forward_steps.push_back( layers[i] );
+        ScheduleStep f = { i, FORWARD_STEP };
+        steps.push_back( f );
+      }
+      if( !layers[i]->parameters().empty() ){
+        gradient_steps.push_back( layers[i] );
+      }
+    }
+    // the input layer has no delta to pass on
+    for(int i = (int)layers.size() - 1; i > 0; i--){
+      ScheduleStep b = { i, BACKWARD_STEP };
+      backward_steps.push_back( b );
+      if( !layers[i]->parameters().empty() ){
+        ScheduleStep g = { i, GRADIENT_STEP };
+        backward_steps.push_back( g );
+      }
+    }
+    steps.insert( steps.end(), backward_steps.begin(), backward_steps.end() );
+    // contexts made before are planned for the old schedule
+    delete own_context;
+    own_context = nullptr;
+  }
+  std::vector<ScheduleStep> forward_only(){
+    return std::vector<ScheduleStep>( steps.begin(), steps.begin() + forward_steps.size() );
+  }
+  void choose_layout(){
+    InputLayer2D * in = dynamic_cast<InputLayer2D *>( layers.front() );
+    if( in == nullptr ){
+      return;
+    }
+    int convolutions = 0;
+    bool wide = true;
+    for(int i = 0; i < layers.size(); i++){
+      ConvolutionLayer * c = dynamic_cast<ConvolutionLayer *>( layers[i] );
+      if( c != nullptr ){
+        convolutions++;
+        wide = wide && 2 * c->channel >= simd.channel_block;
+      }
+    }
+    in->set_channel_block( convolutions > 0 && wide ? simd.channel_block : 1 );
+  }
+  // only used in the planar layout, set_engine keeps the blocked engine otherwise
+  static ConvolutionEngine engine_for( const ConvolutionLayer & c ){
+    if( c.filter_size != 3 ){
+      return IM2COL_CONVOLUTION;
+    }
+    return c.unit_h >= 8 && c.unit_w >= 8 ? WINOGRAD_4X4_CONVOLUTION : WINOGRAD_2X2_CONVOLUTION;
+  }
+  void fuse_pooling( MaxPoolingLayer & p ){
+    ConvolutionLayer * c = dynamic_cast<ConvolutionLayer *>( p.previous_layer );
+    if( c == nullptr || p.pooling_size * p.pooling_size > 127 ){
+      return;
+    }
+    p.set_fused( true );
+    // max pooling keeps the sign, ReLU( max( a ) ) = max( a ) for a >= 0
+    ActivationKind k = c->activation_func->kind;
+    if( p.activation_func->kind == RELU_ACTIVATION && ( k == RELU_ACTIVATION || k == SIGMOID_ACTIVATION ) ){
+      p.activation_func = &id;
+    }
+  }
+};
+
+#endif
@@ -5,6 +5,14 @@
 #include "matrix.hpp"
 #include "activation_functions.hpp"
 #include "layer/layer.hpp"
+#include "dataset.hpp"
+#include "batch_pipeline.hpp"
 #include "io.hpp"
+#include "optimizer.hpp"
+#include "trainer.hpp"
+#include "network.hpp"
+#include "checkpoint.hpp"
+#include "quantized.hpp"
+#include "inference_server.hpp"
 
 #endif
@@ -0,0 +1,136 @@
+#ifndef OPTIMIZER
+#define OPTIMIZER
+#include <cmath>
+#include <atomic>
+#include "common.hpp"
+#include "thread_pool.hpp"
+#include "layer/layer.hpp"
+
+// the update of every parameter of a network in one pass
+//   Optimizer opt( ADAM_UPDATE, 0.001 );
+//   net.train_step( batch, opt );
+// the parameters of all the layers are seen as one array of size( ctx ) elements,
+// their gradients in ctx and their states d and sum_square_grad lying beside them;
+// a step cuts it into equal ranges, one per thread of the pool, each running the
+// rule's kernel ( SimdKernels::update ) over the pieces of parameters in its range,
+// so that the update is a single stream over the four arrays instead of a loop of
+// small calls per layer
+// the states of a Parameter hold
+//   SGD       nothing
+//   momentum  d = velocity
+//   AdaGrad   sum_square_grad = sum of g^2, d = velocity ( Layer::apply_gradient )
+//   Adam      d = first moment, sum_square_grad = second moment
+// so that checkpoints keep them for every rule
+// a layer knowing most of its gradient to be zero updates itself first ( Layer::updates_sparsely ),
+// and is left out of the ranges
+class Optimizer {
+public:
+  UpdateRule rule;
+  F learning_rate;
+  F momentum;      // Adam's beta1
+  F beta2, epsilon; // Adam only
+  std::atomic<long> steps; // taken so far, for Adam's bias correction
+
+  Optimizer( UpdateRule r, F lr, F m = 0.9, F b2 = 0.999, F eps = 1e-8 )
+    : rule( r ), learning_rate( lr ), momentum( m ), beta2( b2 ), epsilon( eps ), steps( 0 ) { }
+
+  // one update from the grads of ctx times grad_scale ( 1 / the mini-batch size ),
+  // split over pool when given
+  void step( ExecutionContext & ctx, F grad_scale, ThreadPool * pool = nullptr ){
+    update( ctx, grad_scale, pool );
+    ExecutionContext * c = &ctx;
+    for(int i = 0; i < ctx.layers.size(); i++){
+      if( !ctx.layers[i]->cached_parameters().empty() ){
+        ctx.layers[i]->updates_applied( &c, 1 );
+      }
+    }
+  }
+  // the update of step alone, which may run on several contexts at once; the layers'
+  // updates_applied follows when they are done
+  void update( ExecutionContext & ctx, F grad_scale, ThreadPool * pool = nullptr ){
+    Profiler * profiler = ctx.profiler;
+    long long start = profiler != nullptr ? profiler->now() : 0;
+    long t = ++steps;
+    UpdateStep u = { learning_rate, momentum, beta2, epsilon, grad_scale, 1, 1 };
+    if( rule == ADAM_UPDATE ){
+      u.bias1 = 1 / ( 1 - std::pow( (double)momentum, (double)t ) );
+      u.bias2 = 1 / ( 1 - std::pow( (double)beta2, (double)t ) );
+    }
+    for(int i = 0; i < ctx.layers.size(); i++){
+      if( sparse( ctx, i, u ) ){
+        ctx.layers[i]->update_sparse( ctx, rule, u );
+      }
+    }
+    size_t n = dense_size( ctx, u );
+    int parts = pool == nullptr ? 1 : std::max( 1, (int)std::min( (size_t)pool->size(), n / MIN_PART ) );
+    auto job = [&]( int k ){
+      update_range( ctx, u, part_begin( n, k, parts ), part_begin( n, k + 1, parts ) );
+    };
+    if( parts == 1 ){
+      job( 0 );
+    }else{
+      pool->run( parts, std::ref( job ) );
+    }
+    if( profiler != nullptr ){
+      profiler->record( profiler->update_row(), "optimizer", UPDATE_PHASE, start, profiler->now(), update_cost( rule, size( ctx ) ) );
+    }
+  }
+  // the number of parameters updated by a step on ctx
+  size_t size( ExecutionContext & ctx ){
+    size_t n = 0;
+    for(int i = 0; i < ctx.layers.size(); i++){
+      const std::vector<Layer::Parameter> & ps = ctx.layers[i]->cached_parameters();
+      for(int p = 0; p < ps.size(); p++){
+        n += ps[p].value->size();
+      }
+    }
+    return n;
+  }
+private:
+  // a thread is not worth waking for less
+  static const size_t MIN_PART = 16384;
+
+  // layer i updates itself from the grads of ctx
+  bool sparse( ExecutionContext & ctx, int i, const UpdateStep & u ){
+    return !ctx.layers[i]->cached_parameters().empty() && ctx.layers[i]->updates_sparsely( ctx, rule, u );
+  }
+  // the parameters of the layers left to the ranges
+  size_t dense_size( ExecutionContext & ctx, const UpdateStep & u ){
+    size_t n = 0;
+    for(int i = 0; i < ctx.layers.size(); i++){
+      if( sparse( ctx, i, u ) ) continue;
+      const std::vector<Layer::Parameter> & ps = ctx.layers[i]->cached_parameters();
+      for(int p = 0; p < ps.size(); p++){
+        n += ps[p].value->size();
+      }
+    }
+    return n;
+  }
+
+  // ranges start on a cache line, so that threads never write the same one
+  static size_t part_begin( size_t n, int k, int parts ){
+    if( k == parts ) return n;
+    return n * k / parts / 16 * 16;
+  }
+  // the parameters [ begin, end ) of the whole array
+  void update_range( ExecutionContext & ctx, const UpdateStep & u, size_t begin, size_t end ){
+    size_t offset = 0;
+    for(int i = 0; i < ctx.layers.size() && offset < end; i++){
+      if( sparse( ctx, i, u ) ) continue;
+      const std::vector<Layer::Parameter> & ps = ctx.layers[i]->cached_parameters();
+      std::vector<vec> & grads = ctx.states[i]->grads;
+      for(int p = 0; p < ps.size(); p++){
+        size_t s = ps[p].value->size();
+        size_t b = std::max( begin, offset ), e = std::min( end, offset + s );
+        if( b < e ){
+          b -= offset;
+          simd.update[ rule ]( e - offset - b, u, grads[p].data() + b, ps[p].sum_square_grad->data() + b,
+                               ps[p].d->data() + b, ps[p].value->data() + b );
+        }
+        offset += s;
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef PROFILER
+#define PROFILER
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include "common.hpp"
+#include "simd.hpp"
+
+// what a layer does in a step
+enum ProfilePhase {
+  FORWARD_PHASE = 0,
+  BACKWARD_PHASE = 1,
+  GRADIENT_PHASE = 2,
+  UPDATE_PHASE = 3,
+  LOAD_PHASE = 4, // a batch filled by the data pipeline
+  WAIT_PHASE = 5  // the training thread waiting for a batch
+};
+const int PROFILE_PHASES = 6;
+const char * const PROFILE_PHASE_NAMES[ PROFILE_PHASES ] = { "forward", "backward", "gradient", "update", "load", "wait" };
+
+// the work of one phase: floating point operations and bytes of memory touched,
+// nominal counts from the shapes ( a Winograd convolution is counted as the
+// direct one, so its GFLOP/s is the effective rate )
+struct LayerCost {
+  double flops;
+  double bytes;
+};
+
+// an update of n parameters by rule: the arithmetic of the kernel and the arrays
+// it streams ( grad and w, the states d and sum_square_grad for all but SGD )
+inline LayerCost update_cost( UpdateRule rule, size_t n ){
+  static const double flops[4] = { 3, 5, 9, 13 }, arrays[4] = { 3, 5, 7, 7 };
+  LayerCost c = { flops[ rule ] * n, arrays[ rule ] * sizeof( F ) * n };
+  return c;
+}
+
+// per layer instrumentation of the forward, backward, gradient and update phases,
+// and of the batch pipeline
+//   Profiler profiler( network.layers.size() );
+//   network.set_profiler( &profiler );      or trainer / pipeline.set_profiler
+//   ...
+//   profiler.print();                       time, GFLOP/s, GB/s and % of the step per layer
+//   profiler.write_chrome_trace( "trace.json" );   for chrome://tracing or Perfetto
+// a phase costs two clock reads and a few atomic additions, and nothing is
+// allocated after a row is first named, so it can stay on while training;
+// the totals cover every phase, the trace the last trace_capacity of them
+class Profiler {
+public:
+  // rows 0, ..., layers - 1 are the layers by index, then the optimizer and the data pipeline
+  Profiler( int layers, size_t trace_capacity = 1 << 16 )
+    : rows( layers + 2 ), events( trace_capacity ), next_event( 0 ), steps( 0 ), threads( 0 ) {
+    origin = clock();
+    rows[ update_row() ].name = "optimizer";
+    rows[ load_row() ].name = "batch pipeline";
+    for(int r = layers; r < rows.size(); r++){
+      rows[r].named = true;
+    }
+  }
+  int update_row() const {
+    return rows.size() - 2;
+  }
+  int load_row() const {
+    return rows.size() - 1;
+  }
+
+  // nanoseconds since the profiler was made
+  long long now() const {
+    return clock() - origin;
+  }
+  // a phase of row that ran from start to end ( now() )
+  void record( int row, const char * name, ProfilePhase phase, long long start, long long end, LayerCost cost ){
+    if( row < 0 || row >= rows.size() ){
+      throw "no profiler row " + std::to_string( row ) + " for " + std::string( name );
+    }
+    Row & r = rows[ row ];
+    if( !r.named.load( std::memory_order_acquire ) ){
+      std::lock_guard<std::mutex> lock( mutex );
+      if( !r.named.load( std::memory_order_relaxed ) ){
+        r.name = name;
+        r.named.store( true, std::memory_order_release );
+      }
+    }
+    Counter & c = r.phases[ phase ];
+    c.calls++;
+    c.ns += end - start;
+    c.flops += (long long)cost.flops;
+    c.bytes += (long long)cost.bytes;
+    if( !events.empty() ){
+      Event & e = events[ next_event++ % events.size() ];
+      e.row = row;
+      e.phase = phase;
+      e.thread = thread_index();
+      e.start = start;
+      e.end = end;
+      e.flops = cost.flops;
+      e.bytes = cost.bytes;
+    }
+  }
+  // counts a training step, for the times per step
+  void step_done(){
+    steps++;
+  }
+  void reset(){
+    for(int r = 0; r < rows.size(); r++){
+      for(int p = 0; p < PROFILE_PHASES; p++){
+        rows[r].phases[p].calls = 0;
+        rows[r].phases[p].ns = 0;
+        rows[r].phases[p].flops = 0;
+        rows[r].phases[p].bytes = 0;
+      }
+    }
+    next_event = 0;
+    steps = 0;
+  }
+
+  // one line per row and phase: calls, total and per step milliseconds, GFLOP/s,
+  // GB/s and the share of the time of all the phases
+  void print(){
+    double total = 0;
+    for(int r = 0; r < rows.size(); r++){
+      for(int p = 0; p < PROFILE_PHASES; p++){
+        total += rows[r].phases[p].ns;
+      }
+    }
+    long s = steps;
+    std::cout << "profile of " << s << " steps" << std::endl;
+    std::printf( "  %-40s %-9s %9s %11s %10s %9s %8s %6s\n",
+                 "layer", "phase", "calls", "total ms", "ms/step", "GFLOP/s", "GB/s", "%" );
+    for(int r = 0; r < rows.size(); r++){
+      for(int p = 0; p < PROFILE_PHASES; p++){
+        const Counter & c = rows[r].phases[p];
+        if( c.calls == 0 ) continue;
+        double ns = std::max( (double)c.ns, 1.0 );
+        std::printf( "  %-40.40s %-9s %9lld %11.3f %10.3f %9.2f %8.2f %6.1f\n",
+                     rows[r].name.c_str(), PROFILE_PHASE_NAMES[p], c.calls.load(), c.ns * 1e-6,
+                     s > 0 ? c.ns * 1e-6 / s : 0.0, c.flops / ns, c.bytes / ns,
+                     total > 0 ? 100 * c.ns / total : 0.0 );
+      }
+    }
+    std::cout << std::endl;
+  }
+  // the kept phases in the Chrome trace event format, one complete event each;
+  // must not run while phases are recorded
+  void write_chrome_trace( std::string filename ){
+    std::ofstream out( filename );
+    if( !out ){
+      throw "cannot write " + filename;
+    }
+    long long n = next_event, first = std::max( 0LL, n - (long long)events.size() );
+    out << "{\"traceEvents\":[";
+    for(long long i = first; i < n; i++){
+      const Event & e = events[ i % events.size() ];
+      char buf[160];
+      std::snprintf( buf, sizeof( buf ), "\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     e.thread, e.start * 1e-3, ( e.end - e.start ) * 1e-3 );
+      out << ( i == first ? "\n" : ",\n" ) << "{\"name\":\"" << escaped( rows[ e.row ].name ) << "\",\"cat\":\""
+          << PROFILE_PHASE_NAMES[ e.phase ] << "\"," << buf
+          << ",\"args\":{\"phase\":\"" << PROFILE_PHASE_NAMES[ e.phase ] << "\",\"flops\":" << e.flops
+          << ",\"bytes\":" << e.bytes << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+  }
+private:
+  struct Counter {
+    std::atomic<long long> calls, ns, flops, bytes;
+    Counter() : calls( 0 ), ns( 0 ), flops( 0 ), bytes( 0 ) { }
+  };
+  struct Row {
+    std::string name;
+    std::atomic<bool> named;
+    Counter phases[ PROFILE_PHASES ];
+    Row() : named( false ) { }
+  };
+  struct Event {
+    int row, thread;
+    ProfilePhase phase;
+    long long start, end;
+    double flops, bytes;
+  };
+  std::vector<Row> rows;
+  std::vector<Event> events;
+  std::atomic<long long> next_event;
+  std::atomic<long> steps;
+  std::atomic<int> threads;
+  std::mutex mutex;
+  long long origin;
+
+  static long long clock(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+  }
+  // threads are numbered in the order they first record
+  int thread_index(){
+    static thread_local const Profiler * owner = nullptr;
+    static thread_local int index = 0;
+    if( owner != this ){
+      owner = this;
+      index = threads++;
+    }
+    return index;
+  }
+  static std::string escaped( const std::string & s ){
+    std::string r;
+    for(int i = 0; i < s.size(); i++){
+      if( s[i] == '"' || s[i] == '\\' ) r += '\\';
+      r += s[i];
+    }
+    return r;
+  }
+};
+
+#endif
@@ -0,0 +1,554 @@
+#ifndef QUANTIZED
+#define QUANTIZED
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include "common.hpp"
+#include "simd.hpp"
+#include "layer/layer.hpp"
+
+// int8 inference of a trained network ( convolution, max pooling, fully connected, softmax )
+// activations are quantized to 0-127 and weights to -127-127, so that a
+// pair of products never saturates the int16 sums of maddubs
+// dot products are accumulated in int32, then rescaled to float for the
+// bias and the activation function, and quantized again for the next layer
+// quantized outputs of 2D layers are stored channel last, [ h x w x channel ],
+// so that patches, pooling windows and requantization read contiguous channels
+
+inline uint8_t quantize_activation( F a, F inv_scale ){
+  // a < 0 only happens for Id, which is clamped like everything out of range
+  F q = std::max( a * inv_scale, (F)0 ) + (F)0.5;
+  return (uint8_t)std::min( q, (F)127 );
+}
+
+// out[r][c] = sum_i x[r][i] w[i][c] for r < m, c < 8 n8; the int8 weights are packed as
+// w[ ( q * 8 n8 + c ) * 4 + j ] = w[ 4 q + j ][c], so that every step broadcasts
+// 4 bytes of a row of x and multiplies them with 4 bytes of 8 outputs at once
+// rows of x are ldx bytes apart, rows of out ldo elements apart
+// requantize: out[i] = quantize( acc[i] * scale[i] + bias[i] ), which is also
+// ReLU, as negative values are quantized to 0
+struct Int8Kernels {
+  std::string name;
+  void (*gemm)( int m, int kq, const uint8_t * x, int ldx, const int8_t * w, int n8, int32_t * out, int ldo );
+  void (*requantize)( int n, const int32_t * acc, const F * scale, const F * bias, F inv_scale, uint8_t * out );
+};
+
+namespace int8_scalar {
+  void gemm( int m, int kq, const uint8_t * x, int ldx, const int8_t * w, int n8, int32_t * out, int ldo ){
+    int n = 8 * n8;
+    for(int r = 0; r < m; r++){
+      int32_t * o = &out[ r * ldo ];
+      for(int c = 0; c < n; c++){
+        o[c] = 0;
+      }
+      for(int q = 0; q < kq; q++){
+        const uint8_t * xq = &x[ r * ldx + 4 * q ];
+        const int8_t * wq = &w[ q * n * 4 ];
+        for(int c = 0; c < n; c++){
+          o[c] += xq[0] * wq[ c * 4 ] + xq[1] * wq[ c * 4 + 1 ] + xq[2] * wq[ c * 4 + 2 ] + xq[3] * wq[ c * 4 + 3 ];
+        }
+      }
+    }
+  }
+  void requantize( int n, const int32_t * acc, const F * scale, const F * bias, F inv_scale, uint8_t * out ){
+    for(int i = 0; i < n; i++){
+      out[i] = quantize_activation( acc[i] * scale[i] + bias[i], inv_scale );
+    }
+  }
+}
+
+#ifdef SIMD_X86
+// MR rows times NB blocks of 8 outputs are accumulated in registers, so that
+// every weight load is used MR times and every broadcast NB times
+#define INT8_GEMM( madd )                                                              \
+  template <int MR, int NB>                                                            \
+  inline void gemm_kernel( int kq, const uint8_t * x, int ldx, const int8_t * w, int ld, int32_t * out, int ldo ){ \
+    __m256i acc[MR][NB];                                                               \
+    for(int r = 0; r < MR; r++)                                                        \
+      for(int i = 0; i < NB; i++) acc[r][i] = _mm256_setzero_si256();                  \
+    for(int q = 0; q < kq; q++){                                                       \
+      __m256i wv[NB];                                                                  \
+      for(int i = 0; i < NB; i++) wv[i] = _mm256_loadu_si256( (const __m256i *)( w + q * ld ) + i ); \
+      for(int r = 0; r < MR; r++){                                                     \
+        int32_t x4;                                                                    \
+        std::memcpy( &x4, x + r * ldx + 4 * q, 4 );                                    \
+        __m256i xv = _mm256_set1_epi32( x4 );                                          \
+        for(int i = 0; i < NB; i++) acc[r][i] = madd( acc[r][i], xv, wv[i] );          \
+      }                                                                                \
+    }                                                                                  \
+    for(int r = 0; r < MR; r++)                                                        \
+      for(int i = 0; i < NB; i++) _mm256_storeu_si256( (__m256i *)( out + r * ldo + 8 * i ), acc[r][i] ); \
+  }                                                                                    \
+  template <int MR, int NB>                                                            \
+  inline void gemm_rows( int kq, const uint8_t * x, int ldx, const int8_t * w, int n8, int32_t * out, int ldo ){ \
+    int b = 0;                                                                         \
+    for(; b + NB <= n8; b += NB){                                                      \
+      gemm_kernel<MR, NB>( kq, x, ldx, w + b * 32, n8 * 32, out + 8 * b, ldo );        \
+    }                                                                                  \
+    for(; b < n8; b++){                                                                \
+      gemm_kernel<MR, 1>( kq, x, ldx, w + b * 32, n8 * 32, out + 8 * b, ldo );         \
+    }                                                                                  \
+  }                                                                                    \
+  void gemm( int m, int kq, const uint8_t * x, int ldx, const int8_t * w, int n8, int32_t * out, int ldo ){ \
+    int r = 0;                                                                         \
+    for(; r + 4 <= m; r += 4){                                                         \
+      gemm_rows<4, 3>( kq, x + r * ldx, ldx, w, n8, out + r * ldo, ldo );              \
+    }                                                                                  \
+    for(; r < m; r++){                                                                 \
+      gemm_rows<1, 4>( kq, x + r * ldx, ldx, w, n8, out + r * ldo, ldo );              \
+    }                                                                                  \
+  }                                                                                    \
+  void requantize( int n, const int32_t * acc, const F * scale, const F * bias, F inv_scale, uint8_t * out ){ \
+    __m256 inv = _mm256_set1_ps( inv_scale ), half = _mm256_set1_ps( 0.5f );          \
+    __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps( 127.0f );                    \
+    int i = 0;                                                                         \
+    for(; i + 8 <= n; i += 8){                                                         \
+      __m256 v = _mm256_cvtepi32_ps( _mm256_loadu_si256( (const __m256i *)( acc + i ) ) ); \
+      v = _mm256_add_ps( _mm256_mul_ps( v, _mm256_loadu_ps( scale + i ) ), _mm256_loadu_ps( bias + i ) ); \
+      v = _mm256_min_ps( _mm256_add_ps( _mm256_max_ps( _mm256_mul_ps( v, inv ), lo ), half ), hi ); \
+      __m256i q = _mm256_cvttps_epi32( v );                                            \
+      __m128i q16 = _mm_packs_epi32( _mm256_castsi256_si128( q ), _mm256_extracti128_si256( q, 1 ) ); \
+      _mm_storel_epi64( (__m128i *)( out + i ), _mm_packus_epi16( q16, q16 ) );        \
+    }                                                                                  \
+    for(; i < n; i++){                                                                 \
+      out[i] = quantize_activation( acc[i] * scale[i] + bias[i], inv_scale );          \
+    }                                                                                  \
+  }
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace int8_avx2 {
+  inline __m256i madd( __m256i acc, __m256i x, __m256i w ){
+    // u8 x s8 pairs summed to int16, then pairs of int16 summed to int32
+    __m256i p = _mm256_maddubs_epi16( x, w );
+    return _mm256_add_epi32( acc, _mm256_madd_epi16( p, _mm256_set1_epi16( 1 ) ) );
+  }
+  INT8_GEMM( madd )
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512vl,avx512vnni")
+namespace int8_vnni {
+  inline __m256i madd( __m256i acc, __m256i x, __m256i w ){
+    return _mm256_dpbusd_epi32( acc, x, w );
+  }
+  INT8_GEMM( madd )
+}
+#pragma GCC pop_options
+#undef INT8_GEMM
+#endif
+
+Int8Kernels select_int8_kernels(){
+  // NN_SIMD=scalar or NN_SIMD=avx2 overrides the automatic choice as in simd.hpp
+  const char * env = std::getenv( "NN_SIMD" );
+  std::string isa = env == nullptr ? "" : env;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if( ( isa == "" || isa == "avx512" ) && __builtin_cpu_supports( "avx512vnni" ) && __builtin_cpu_supports( "avx512vl" ) ){
+    Int8Kernels k = { "avx512vnni", int8_vnni::gemm, int8_vnni::requantize };
+    return k;
+  }
+  if( isa != "scalar" && isa != "sse4" && __builtin_cpu_supports( "avx2" ) ){
+    Int8Kernels k = { "avx2", int8_avx2::gemm, int8_avx2::requantize };
+    return k;
+  }
+#endif
+  Int8Kernels k = { "scalar", int8_scalar::gemm, int8_scalar::requantize };
+  return k;
+}
+
+Int8Kernels int8_kernels = select_int8_kernels();
+
+// one layer of a QuantizedNetwork
+class QuantizedLayer {
+public:
+  virtual ~QuantizedLayer(){ }
+  // in = quantized outputs of the previous layer
+  virtual void propagate( const uint8_t * in ) = 0;
+  virtual size_t weight_bytes(){ return 0; }
+  std::vector<uint8_t> output;  // quantized activated outputs, channel last
+  vec float_output;             // activated outputs, kept by a fully connected output layer
+  F output_scale;               // a = output_scale * q
+};
+
+// weights [ rows x cols ] quantized row by row and packed for Int8Kernels::gemm
+// rows are padded to a multiple of 8 and cols to a multiple of 4
+class QuantizedWeights {
+public:
+  void quantize( const F * w, int r, int c ){
+    rows = r;
+    cols = c;
+    n8 = ( rows + 7 ) / 8;
+    kq = ( cols + 3 ) / 4;
+    data.assign( kq * n8 * 8 * 4, 0 );
+    scale.assign( rows, 0 );
+    for(int i = 0; i < rows; i++){
+      F m = 0;
+      for(int j = 0; j < cols; j++){
+        m = std::max( m, std::fabs( w[ i * cols + j ] ) );
+      }
+      scale[i] = ( m > 0 ) ? m / 127 : 1;
+      for(int j = 0; j < cols; j++){
+        data[ ( j / 4 * n8 * 8 + i ) * 4 + j % 4 ] = (int8_t)std::lrint( w[ i * cols + j ] / scale[i] );
+      }
+    }
+  }
+  // acc[r] = the int32 products of x[r] with every row for the m rows of x
+  // rows of x have ld() elements, rows of acc 8 n8
+  void multiply( int m, const uint8_t * x, int32_t * acc ){
+    int8_kernels.gemm( m, kq, x, ld(), data.data(), n8, acc, 8 * n8 );
+  }
+  int ld(){
+    return 4 * kq;
+  }
+  int rows, cols, n8, kq;
+  std::vector<int8_t> data;
+  std::vector<F> scale;
+};
+
+// index in the float layout of the i-th unit of l in channel last order
+int channel_last_index( Layer * l, int i ){
+  Layer2D * l2 = dynamic_cast<Layer2D *>( l );
+  if( l2 == nullptr ) return i;
+  int c = i % l2->channel, hw = i / l2->channel;
+  return c * l2->unit_h * l2->unit_w + hw;
+}
+
+// out[i] = quantize( f( acc[i] * scale[i] + bias[i] ) ) for n outputs
+void requantize( int n, const int32_t * acc, const F * scale, const F * bias, ActivationKind kind,
+                 F inv_scale, uint8_t * out ){
+  if( kind != SIGMOID_ACTIVATION ){
+    int8_kernels.requantize( n, acc, scale, bias, inv_scale, out );
+    return;
+  }
+  for(int i = 0; i < n; i++){
+    F y = acc[i] * scale[i] + bias[i];
+    out[i] = quantize_activation( 1 / ( 1 + std::exp( -y ) ), inv_scale );
+  }
+}
+
+class QuantizedConvolution : public QuantizedLayer {
+public:
+  QuantizedConvolution( ConvolutionLayer * l, F input_scale, F out_scale ) : layer( l ){
+    if( l->activation_func->kind == SOFTMAX_ACTIVATION || l->activation_func->kind == CUSTOM_ACTIVATION ){
+      throw "int8 convolution does not support " + l->activation_func->func_name + " : " + l->layer_name;
+    }
+    output_scale = out_scale;
+    taps = l->prev_channel * l->filter_size * l->filter_size;
+    plane = l->unit_h * l->unit_w;
+    // taps are reordered to ( s, t, pch ) to match the channel-last patches
+    std::vector<Layer::Parameter> ps = l->parameters();
+    int fs = l->filter_size, pc = l->prev_channel;
+    vec w( l->channel * taps );
+    for(int ch = 0; ch < l->channel; ch++){
+      for(int pch = 0; pch < pc; pch++){
+        for(int k = 0; k < fs * fs; k++){
+          w[ ch * taps + k * pc + pch ] = (*ps[0].value)[ ( ch * pc + pch ) * fs * fs + k ];
+        }
+      }
+    }
+    weights.quantize( w.data(), l->channel, taps );
+    bias = *ps[1].value;
+    for(int ch = 0; ch < l->channel; ch++){
+      scale.push_back( input_scale * weights.scale[ch] );
+    }
+    padded_h = l->prev_h + 2 * l->padding;
+    padded_w = l->prev_w + 2 * l->padding;
+    // 8 bytes of slack for the copies of propagate
+    padded.assign( padded_h * padded_w * pc + 8, 0 );
+    patches.assign( plane * weights.ld() + 8, 0 );
+    acc.resize( plane * weights.n8 * 8 );
+    output.resize( l->units );
+  }
+  void propagate( const uint8_t * in ){
+    ConvolutionLayer & l = *layer;
+    int fs = l.filter_size, pc = l.prev_channel;
+    // the input inside a zero border
+    for(int h = 0; h < l.prev_h; h++){
+      std::memcpy( &padded[ ( ( h + l.padding ) * padded_w + l.padding ) * pc ],
+                   &in[ h * l.prev_w * pc ], l.prev_w * pc );
+    }
+    // one row of taps per output position, made of fs runs of fs * pc bytes
+    // the runs are copied 8 bytes at a time; what is written past a run is
+    // overwritten by the next one, or lands in the padding columns whose weights are 0
+    int run = fs * pc;
+    for(int h = 0; h < l.unit_h; h++){
+      for(int w = 0; w < l.unit_w; w++){
+        uint8_t * p = &patches[ ( h * l.unit_w + w ) * weights.ld() ];
+        for(int s = 0; s < fs; s++, p += run){
+          const uint8_t * row = &padded[ ( ( h + s ) * padded_w + w ) * pc ];
+          for(int k = 0; k < run; k += 8){
+            std::memcpy( p + k, row + k, 8 );
+          }
+        }
+      }
+    }
+    weights.multiply( plane, patches.data(), acc.data() );
+    F inv = 1 / output_scale;
+    for(int pos = 0; pos < plane; pos++){
+      requantize( l.channel, &acc[ pos * weights.n8 * 8 ], scale.data(), bias.data(), l.activation_func->kind,
+                  inv, &output[ pos * l.channel ] );
+    }
+  }
+  size_t weight_bytes(){
+    return weights.data.size() + ( weights.scale.size() + bias.size() ) * sizeof( F );
+  }
+private:
+  ConvolutionLayer * layer;
+  QuantizedWeights weights;
+  vec bias;
+  std::vector<F> scale;          // input scale times weight scale of each channel
+  int taps, plane;
+  int padded_h, padded_w;
+  std::vector<uint8_t> padded;   // [ padded_h x padded_w x prev_channel ]
+  std::vector<uint8_t> patches;  // [ plane x ld ]
+  std::vector<int32_t> acc;      // [ plane x 8 n8 ]
+};
+
+class QuantizedMaxPooling : public QuantizedLayer {
+public:
+  QuantizedMaxPooling( MaxPoolingLayer * l, F input_scale ) : layer( l ){
+    // max commutes with the quantization, and ReLU / Id leave 0-127 unchanged
+    if( l->activation_func->kind != RELU_ACTIVATION && l->activation_func->kind != ID_ACTIVATION ){
+      throw "int8 max pooling supports ReLU and Id only : " + l->layer_name;
+    }
+    output_scale = input_scale;
+    output.resize( l->units );
+  }
+  void propagate( const uint8_t * in ){
+    MaxPoolingLayer & l = *layer;
+    int half = l.pooling_size / 2, ch = l.channel;
+    for(int h = 0; h < l.unit_h; h++){
+      for(int w = 0; w < l.unit_w; w++){
+        uint8_t * m = &output[ ( h * l.unit_w + w ) * ch ];
+        std::fill( m, m + ch, 0 );
+        for(int s = 0; s < l.pooling_size; s++){
+          int ph = h * l.stride + s - half;
+          if( ph < 0 || l.prev_h <= ph ) continue;
+          for(int t = 0; t < l.pooling_size; t++){
+            int pw = w * l.stride + t - half;
+            if( pw < 0 || l.prev_w <= pw ) continue;
+            const uint8_t * x = &in[ ( ph * l.prev_w + pw ) * ch ];
+            for(int c = 0; c < ch; c++){
+              m[c] = std::max( m[c], x[c] );
+            }
+          }
+        }
+      }
+    }
+  }
+private:
+  MaxPoolingLayer * layer;
+};
+
+class QuantizedFullyConnected : public QuantizedLayer {
+public:
+  QuantizedFullyConnected( FullyConnectedLayer * l, F input_scale, F out_scale ) : layer( l ){
+    if( l->activation_func->kind == CUSTOM_ACTIVATION ){
+      throw "int8 fully connected layer does not support " + l->activation_func->func_name + " : " + l->layer_name;
+    }
+    output_scale = out_scale;
+    // columns follow the channel last order of the previous layer
+    std::vector<Layer::Parameter> ps = l->parameters();
+    vec w( l->units * l->inputs );
+    for(int u = 0; u < l->units; u++){
+      for(int j = 0; j < l->inputs; j++){
+        w[ u * l->inputs + j ] = (*ps[0].value)[ u * l->inputs + channel_last_index( l->previous_layer, j ) ];
+      }
+    }
+    weights.quantize( w.data(), l->units, l->inputs );
+    bias = *ps[1].value;
+    for(int u = 0; u < l->units; u++){
+      scale.push_back( input_scale * weights.scale[u] );
+    }
+    x.assign( weights.ld(), 0 );
+    acc.resize( weights.n8 * 8 );
+    float_output.resize( l->units );
+    output.resize( l->units );
+  }
+  void propagate( const uint8_t * in ){
+    // the padding columns of x stay 0
+    std::copy( in, in + layer->inputs, x.begin() );
+    weights.multiply( 1, x.data(), acc.data() );
+    int n = layer->units;
+    ActivationFunction * af = layer->activation_func;
+    if( layer->next_layer != nullptr && af->kind != SOFTMAX_ACTIVATION ){
+      requantize( n, acc.data(), scale.data(), bias.data(), af->kind, 1 / output_scale, output.data() );
+      return;
+    }
+    // the float outputs are not clamped to 0-127, so negative logits of the output layer stay
+    F * y = float_output.data();
+    for(int u = 0; u < n; u++){
+      y[u] = acc[u] * scale[u] + bias[u];
+    }
+    if( af->kind == SOFTMAX_ACTIVATION ){
+      simd.add_scalar( n, - simd.max_reduce( n, y ), y, y );
+      simd.exp( n, y, y );
+      F sum = 0;
+      for(int u = 0; u < n; u++){
+        sum += y[u];
+      }
+      simd.scale( n, 1 / sum, y );
+    }else{
+      activate( af, n, y, y );
+    }
+    if( layer->next_layer != nullptr ){
+      F inv = 1 / output_scale;
+      for(int u = 0; u < n; u++){
+        output[u] = quantize_activation( y[u], inv );
+      }
+    }
+  }
+  size_t weight_bytes(){
+    return weights.data.size() + ( weights.scale.size() + bias.size() ) * sizeof( F );
+  }
+private:
+  FullyConnectedLayer * layer;
+  QuantizedWeights weights;
+  vec bias;
+  std::vector<F> scale;
+  std::vector<uint8_t> x;
+  std::vector<int32_t> acc;
+};
+
+// post-training quantization of the network starting at input
+// the activation ranges are calibrated on the samples of calibration
+// a QuantizedNetwork runs one sample at a time and keeps its own buffers
+class QuantizedNetwork {
+public:
+  QuantizedNetwork( Layer & input, const std::vector<vec> & calibration ){
+    // largest activated output of every layer over the calibration samples
+    ExecutionContext ctx( &input );
+    ctx.set_batch_size( calibration.size() );
+    TensorView & in = ctx.states[0]->activated_output;
+    for(int k = 0; k < calibration.size(); k++){
+      std::copy( calibration[k].begin(), calibration[k].end(), in.begin() + k * input.units );
+    }
+    input.propagate( ctx );
+    std::vector<F> scales;
+    for(int i = 0; i < ctx.layers.size(); i++){
+      TensorView & a = ctx.states[i]->activated_output;
+      F m = 0;
+      for(int k = 0; k < a.size(); k++){
+        if( a[k] < 0 && ctx.layers[i]->next_layer != nullptr ){
+          throw "int8 activations must not be negative : " + ctx.layers[i]->layer_name;
+        }
+        m = std::max( m, a[k] );
+      }
+      scales.push_back( m > 0 ? m / 127 : 1 );
+    }
+    input_units = input.units;
+    for(int k = 0; k < input_units; k++){
+      input_order.push_back( channel_last_index( &input, k ) );
+    }
+    input_scale = scales[0];
+    for(int i = 1; i < ctx.layers.size(); i++){
+      Layer * l = ctx.layers[i];
+      F in_scale = layers.empty() ? input_scale : layers.back()->output_scale;
+      if( ConvolutionLayer * c = dynamic_cast<ConvolutionLayer *>( l ) ){
+        // fused with the next max pooling, the convolution's own outputs are not set,
+        // only its maxima are and they are those of the pooling
+        layers.push_back( new QuantizedConvolution( c, in_scale, scales[ c->fused_pooling ? i + 1 : i ] ) );
+      }else if( MaxPoolingLayer * p = dynamic_cast<MaxPoolingLayer *>( l ) ){
+        layers.push_back( new QuantizedMaxPooling( p, in_scale ) );
+      }else if( FullyConnectedLayer * f = dynamic_cast<FullyConnectedLayer *>( l ) ){
+        layers.push_back( new QuantizedFullyConnected( f, in_scale, scales[i] ) );
+      }else{
+        throw "int8 inference does not support " + l->layer_name;
+      }
+    }
+    if( dynamic_cast<QuantizedFullyConnected *>( layers.back() ) == nullptr ){
+      throw std::string( "int8 inference needs a fully connected output layer" );
+    }
+    q_input.resize( input_units );
+  }
+  ~QuantizedNetwork(){
+    for(int i = 0; i < layers.size(); i++){
+      delete layers[i];
+    }
+  }
+  // one sample of input.units values
+  void propagate( const F * in ){
+    F inv = 1 / input_scale;
+    for(int k = 0; k < input_units; k++){
+      q_input[k] = quantize_activation( in[ input_order[k] ], inv );
+    }
+    const uint8_t * x = q_input.data();
+    for(int i = 0; i < layers.size(); i++){
+      layers[i]->propagate( x );
+      x = layers[i]->output.data();
+    }
+  }
+  // activated outputs of the last layer
+  const vec & output(){
+    return layers.back()->float_output;
+  }
+  int get_class(){
+    const vec & o = output();
+    return std::max_element( o.begin(), o.end() ) - o.begin();
+  }
+  size_t weight_bytes(){
+    size_t b = 0;
+    for(int i = 0; i < layers.size(); i++){
+      b += layers[i]->weight_bytes();
+    }
+    return b;
+  }
+private:
+  int input_units;
+  std::vector<int> input_order;
+  F input_scale;
+  std::vector<uint8_t> q_input;
+  std::vector<QuantizedLayer *> layers;
+};
+
+// prints the accuracy, the agreement and the speed of the float network
+// starting at input and its quantized version q, one sample at a time
+// dataset[c] = samples of class c
+void compare_quantized( Layer & input, QuantizedNetwork & q, const std::vector<std::vector<vec> > & dataset ){
+  ExecutionContext ctx( &input, INFERENCE );
+  Layer * output = ctx.layers.back();
+  std::vector<int> float_class, int8_class, label;
+  // each model runs over the whole dataset in turn, so that they do not evict each other's weights
+  auto t0 = std::chrono::steady_clock::now();
+  for(int c = 0; c < dataset.size(); c++){
+    for(int i = 0; i < dataset[c].size(); i++){
+      std::copy( dataset[c][i].begin(), dataset[c][i].end(), ctx.states[0]->activated_output.begin() );
+      input.propagate( ctx );
+      const TensorView & o = output->activated_output( ctx );
+      float_class.push_back( std::max_element( o.begin(), o.end() ) - o.begin() );
+      label.push_back( c );
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  for(int c = 0; c < dataset.size(); c++){
+    for(int i = 0; i < dataset[c].size(); i++){
+      q.propagate( dataset[c][i].data() );
+      int8_class.push_back( q.get_class() );
+    }
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  double float_time = std::chrono::duration<double>( t1 - t0 ).count();
+  double int8_time = std::chrono::duration<double>( t2 - t1 ).count();
+  int n = label.size(), float_correct = 0, int8_correct = 0, agree = 0;
+  for(int k = 0; k < n; k++){
+    float_correct += ( float_class[k] == label[k] );
+    int8_correct += ( int8_class[k] == label[k] );
+    agree += ( float_class[k] == int8_class[k] );
+  }
+  size_t float_bytes = 0;
+  for(int i = 0; i < ctx.layers.size(); i++){
+    std::vector<Layer::Parameter> ps = ctx.layers[i]->parameters();
+    for(int p = 0; p < ps.size(); p++){
+      float_bytes += ps[p].value->size() * sizeof( F );
+    }
+  }
+  std::cout << "[int8 kernels = " << int8_kernels.name << "]" << std::endl;
+  std::cout << "samples = " << n << std::endl;
+  std::cout << "float rate = " << 1.0 * float_correct / n << " ( " << 1e6 * float_time / n << " us / sample, " << float_bytes << " bytes of weights )" << std::endl;
+  std::cout << "int8  rate = " << 1.0 * int8_correct / n << " ( " << 1e6 * int8_time / n << " us / sample, " << q.weight_bytes() << " bytes of weights )" << std::endl;
+  std::cout << "same class = " << 1.0 * agree / n << std::endl;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef SIMDLIB
+#define SIMDLIB
+#include <iostream>
+#include "common.hpp"
+#include "winograd.hpp"
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// vectorized kernels, selected once at startup from what the CPU supports
+
+// the optimizer update rules ( see simd_kernels.hpp and optimizer.hpp )
+enum UpdateRule {
+  SGD_UPDATE = 0,
+  MOMENTUM_UPDATE = 1,
+  ADAGRAD_UPDATE = 2,
+  ADAM_UPDATE = 3
+};
+// the hyperparameters of one update; momentum is Adam's beta1, and
+// bias1 = 1 / ( 1 - beta1^t ), bias2 = 1 / ( 1 - beta2^t ) its bias corrections
+struct UpdateStep {
+  F learning_rate, momentum, beta2, epsilon;
+  F grad_scale;
+  F bias1, bias2;
+};
+
+struct SimdKernels {
+  std::string name;
+  int channel_block; // channels per block of the blocked layout, a multiple of the vector width
+  F (*dot)( int n, const F * x, const F * y );
+  void (*axpy)( int n, F a, const F * x, F * y );              // y += a x
+  void (*add_vec)( int n, const F * x, F * y );                // y += x
+  void (*add_scalar)( int n, F a, const F * x, F * y );        // y = x + a
+  void (*scale)( int n, F a, F * x );                          // x *= a
+  void (*exp)( int n, const F * x, F * y );
+  void (*max_vec)( int n, const F * x, F * y );                // y = max( y, x )
+  F (*max_reduce)( int n, const F * x );
+  // optimizer updates indexed by UpdateRule, w and the states s, d from grad_scale grad
+  void (*update[4])( int n, const UpdateStep & u, const F * grad, F * s, F * d, F * w );
+  // activation kernels indexed by ActivationKind ( id, ReLU, sigmoid )
+  void (*activate[3])( int n, const F * y, F * a );                          // a = f( y )
+  void (*bias_activate[3])( int n, const F * b, F * y, F * a );              // y += b, a = f( y )
+  void (*bias_scalar_activate[3])( int n, F b, const F * x, F * y, F * a );  // y = x + b, a = f( y )
+  void (*mul_activation_derivative[3])( int n, const F * u, const F * a, F * d ); // d *= f'( u )
+  // Winograd tile transforms indexed by F(2x2,3x3), F(4x4,3x3) ( see simd_kernels.hpp )
+  void (*winograd_input[2])( int n, const F * d, int rs, int cs, F * v, long vs );    // v = BT d B
+  void (*winograd_input_t[2])( int n, const F * v, long vs, F * d, int rs, int cs );  // d += B v BT
+  void (*winograd_output[2])( int n, const F * m, long ms, F * y, int rs, int cs );   // y = AT m A
+  void (*winograd_output_t[2])( int n, const F * y, int rs, int cs, F * m, long ms ); // m = A y AT
+  // direct convolution of channel blocked images ( see simd_kernels.hpp )
+  void (*conv_blocked)( int cin, int fs, const F * in, int ph, int pw, const F * w, const F * bias,
+                        int kblocks, int oh, int ow, F * out );
+  void (*conv_blocked_gradient)( int cin, int fs, const F * in, int ph, int pw, const F * d, int dh, int dw_,
+                                 int kblocks, int oh, int ow, F * dw );
+  void (*max_window)( const F * const * rows, int wh, int ww, int cs, int k0, int ps, F * m, F * arg );
+  // block sparse y += A x indexed by blocks of 1 ( CSR ), 4 and 8 rows ( see sparse.hpp )
+  void (*sparse_gemv[3])( int rows, const int * ptr, const int * col, const F * v, const F * x, F * y );
+  // the blocks of x[ 0, n ) holding a nonzero, or a value >= 0 with nonneg ( see sparse.hpp )
+  void (*mark_blocks)( int n, int block, const F * x, bool nonneg, uint8_t * flags );
+};
+
+namespace simd_scalar {
+  typedef F V;
+  const int W = 1;
+  inline V loadu( const F * p ){ return *p; }
+  inline void storeu( F * p, V v ){ *p = v; }
+  inline V set1( F a ){ return a; }
+  inline V zero(){ return 0; }
+  inline V add( V a, V b ){ return a + b; }
+  inline V sub( V a, V b ){ return a - b; }
+  inline V mul( V a, V b ){ return a * b; }
+  inline V div( V a, V b ){ return a / b; }
+  inline V vmax_( V a, V b ){ return std::max( a, b ); }
+  inline V vmin_( V a, V b ){ return std::min( a, b ); }
+  inline V fmadd( V a, V b, V c ){ return a * b + c; }
+  inline V vsqrt( V a ){ return std::sqrt( a ); }
+  inline V vfloor( V a ){ return std::floor( a ); }
+  inline F hsum( V a ){ return a; }
+  inline F hmax( V a ){ return a; }
+  inline V pow2i( V n ){ return std::ldexp( (F)1.0, (int)n ); }
+  inline V mask_nonneg( V z, V d ){ return ( z < 0 ) ? 0 : d; }
+  inline V select_gt( V a, V b, V x, V y ){ return a > b ? x : y; }
+  inline V gather( const F * p, const int * i ){ return p[ *i ]; }
+#include "simd_kernels.hpp"
+}
+
+#ifdef SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+namespace simd_sse4 {
+  typedef __m128 V;
+  const int W = 4;
+  inline V loadu( const F * p ){ return _mm_loadu_ps( p ); }
+  inline void storeu( F * p, V v ){ _mm_storeu_ps( p, v ); }
+  inline V set1( F a ){ return _mm_set1_ps( a ); }
+  inline V zero(){ return _mm_setzero_ps(); }
+  inline V add( V a, V b ){ return _mm_add_ps( a, b ); }
+  inline V sub( V a, V b ){ return _mm_sub_ps( a, b ); }
+  inline V mul( V a, V b ){ return _mm_mul_ps( a, b ); }
+  inline V div( V a, V b ){ return _mm_div_ps( a, b ); }
+  inline V vmax_( V a, V b ){ return _mm_max_ps( a, b ); }
+  inline V vmin_( V a, V b ){ return _mm_min_ps( a, b ); }
+  inline V fmadd( V a, V b, V c ){ return _mm_add_ps( _mm_mul_ps( a, b ), c ); }
+  inline V vsqrt( V a ){ return _mm_sqrt_ps( a ); }
+  inline V vfloor( V a ){ return _mm_floor_ps( a ); }
+  inline F hsum( V a ){
+    a = _mm_add_ps( a, _mm_movehl_ps( a, a ) );
+    a = _mm_add_ss( a, _mm_shuffle_ps( a, a, 1 ) );
+    return _mm_cvtss_f32( a );
+  }
+  inline F hmax( V a ){
+    a = _mm_max_ps( a, _mm_movehl_ps( a, a ) );
+    a = _mm_max_ss( a, _mm_shuffle_ps( a, a, 1 ) );
+    return _mm_cvtss_f32( a );
+  }
+  inline V pow2i( V n ){
+    __m128i e = _mm_add_epi32( _mm_cvtps_epi32( n ), _mm_set1_epi32( 127 ) );
+    return _mm_castsi128_ps( _mm_slli_epi32( e, 23 ) );
+  }
+  inline V mask_nonneg( V z, V d ){ return _mm_and_ps( _mm_cmpnlt_ps( z, _mm_setzero_ps() ), d ); }
+  inline V select_gt( V a, V b, V x, V y ){ return _mm_blendv_ps( y, x, _mm_cmpgt_ps( a, b ) ); }
+  inline V gather( const F * p, const int * i ){ return _mm_set_ps( p[ i[3] ], p[ i[2] ], p[ i[1] ], p[ i[0] ] ); }
+#include "simd_kernels.hpp"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace simd_avx2 {
+  typedef __m256 V;
+  const int W = 8;
+  inline V loadu( const F * p ){ return _mm256_loadu_ps( p ); }
+  inline void storeu( F * p, V v ){ _mm256_storeu_ps( p, v ); }
+  inline V set1( F a ){ return _mm256_set1_ps( a ); }
+  inline V zero(){ return _mm256_setzero_ps(); }
+  inline V add( V a, V b ){ return _mm256_add_ps( a, b ); }
+  inline V sub( V a, V b ){ return _mm256_sub_ps( a, b ); }
+  inline V mul( V a, V b ){ return _mm256_mul_ps( a, b ); }
+  inline V div( V a, V b ){ return _mm256_div_ps( a, b ); }
+  inline V vmax_( V a, V b ){ return _mm256_max_ps( a, b ); }
+  inline V vmin_( V a, V b ){ return _mm256_min_ps( a, b ); }
+  inline V fmadd( V a, V b, V c ){ return _mm256_fmadd_ps( a, b, c ); }
+  inline V vsqrt( V a ){ return _mm256_sqrt_ps( a ); }
+  inline V vfloor( V a ){ return _mm256_floor_ps( a ); }
+  inline F hsum( V a ){
+    __m128 s = _mm_add_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) );
+    s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+    s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+    return _mm_cvtss_f32( s );
+  }
+  inline F hmax( V a ){
+    __m128 s = _mm_max_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) );
+    s = _mm_max_ps( s, _mm_movehl_ps( s, s ) );
+    s = _mm_max_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+    return _mm_cvtss_f32( s );
+  }
+  inline V pow2i( V n ){
+    __m256i e = _mm256_add_epi32( _mm256_cvtps_epi32( n ), _mm256_set1_epi32( 127 ) );
+    return _mm256_castsi256_ps( _mm256_slli_epi32( e, 23 ) );
+  }
+  inline V mask_nonneg( V z, V d ){ return _mm256_and_ps( _mm256_cmp_ps( z, _mm256_setzero_ps(), _CMP_NLT_UQ ), d ); }
+  inline V select_gt( V a, V b, V x, V y ){ return _mm256_blendv_ps( y, x, _mm256_cmp_ps( a, b, _CMP_GT_OQ ) ); }
+  inline V gather( const F * p, const int * i ){ return _mm256_i32gather_ps( p, _mm256_loadu_si256( (const __m256i *)i ), 4 ); }
+#include "simd_kernels.hpp"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace simd_avx512 {
+  typedef __m512 V;
+  const int W = 16;
+  inline V loadu( const F * p ){ return _mm512_loadu_ps( p ); }
+  inline void storeu( F * p, V v ){ _mm512_storeu_ps( p, v ); }
+  inline V set1( F a ){ return _mm512_set1_ps( a ); }
+  inline V zero(){ return _mm512_setzero_ps(); }
+  inline V add( V a, V b ){ return _mm512_add_ps( a, b ); }
+  inline V sub( V a, V b ){ return _mm512_sub_ps( a, b ); }
+  inline V mul( V a, V b ){ return _mm512_mul_ps( a, b ); }
+  inline V div( V a, V b ){ return _mm512_div_ps( a, b ); }
+  inline V vmax_( V a, V b ){ return _mm512_max_ps( a, b ); }
+  inline V vmin_( V a, V b ){ return _mm512_min_ps( a, b ); }
+  inline V fmadd( V a, V b, V c ){ return _mm512_fmadd_ps( a, b, c ); }
+  inline V vsqrt( V a ){ return _mm512_sqrt_ps( a ); }
+  inline V vfloor( V a ){ return _mm512_roundscale_ps( a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC ); }
+  inline F hsum( V a ){ return _mm512_reduce_add_ps( a ); }
+  inline F hmax( V a ){ return _mm512_reduce_max_ps( a ); }
+  inline V pow2i( V n ){
+    __m512i e = _mm512_add_epi32( _mm512_cvtps_epi32( n ), _mm512_set1_epi32( 127 ) );
+    return _mm512_castsi512_ps( _mm512_slli_epi32( e, 23 ) );
+  }
+  inline V mask_nonneg( V z, V d ){ return _mm512_maskz_mov_ps( _mm512_cmp_ps_mask( z, _mm512_setzero_ps(), _CMP_NLT_UQ ), d ); }
+  inline V select_gt( V a, V b, V x, V y ){ return _mm512_mask_blend_ps( _mm512_cmp_ps_mask( a, b, _CMP_GT_OQ ), y, x ); }
+  inline V gather( const F * p, const int * i ){ return _mm512_i32gather_ps( _mm512_loadu_si512( i ), p, 4 ); }
+#include "simd_kernels.hpp"
+}
+#pragma GCC pop_options
+#endif
+
+#define SIMD_ACTIVATION_KERNELS(ns, kernel)                     \
+    { ns::kernel<ns::IdActivation>, ns::kernel<ns::ReLUActivation>, ns::kernel<ns::SigmoidActivation> }
+
+#define SIMD_KERNEL_TABLE(ns, isa_name) {                        \
+    isa_name, ns::CHANNEL_BLOCK, ns::dot, ns::axpy, ns::add_vec,  \
+    ns::add_scalar, ns::scale, ns::exp, ns::max_vec,              \
+    ns::max_reduce,                                               \
+    { ns::update<ns::SgdUpdate>, ns::update<ns::MomentumUpdate>,  \
+      ns::update<ns::AdagradUpdate>, ns::update<ns::AdamUpdate> }, \
+    SIMD_ACTIVATION_KERNELS(ns, activate),                        \
+    SIMD_ACTIVATION_KERNELS(ns, bias_activate),                   \
+    SIMD_ACTIVATION_KERNELS(ns, bias_scalar_activate),            \
+    SIMD_ACTIVATION_KERNELS(ns, mul_activation_derivative),       \
+    { ns::winograd_input<2>, ns::winograd_input<4> },             \
+    { ns::winograd_input_t<2>, ns::winograd_input_t<4> },         \
+    { ns::winograd_output<2>, ns::winograd_output<4> },           \
+    { ns::winograd_output_t<2>, ns::winograd_output_t<4> },       \
+    ns::conv_blocked, ns::conv_blocked_gradient, ns::max_window,  \
+    { ns::sparse_gemv<1>, ns::sparse_gemv<4>, ns::sparse_gemv<8> }, \
+    ns::mark_blocks }
+
+SimdKernels select_simd_kernels( std::string isa ){
+  // isa = "avx512", "avx2", "sse4" or "scalar"; an empty string picks the
+  // widest instruction set supported by this CPU
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if( ( isa == "" || isa == "avx512" ) && __builtin_cpu_supports( "avx512f" ) ){
+    SimdKernels k = SIMD_KERNEL_TABLE( simd_avx512, "avx512" );
+    return k;
+  }
+  if( ( isa == "" || isa == "avx512" || isa == "avx2" ) && __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ){
+    SimdKernels k = SIMD_KERNEL_TABLE( simd_avx2, "avx2" );
+    return k;
+  }
+  if( isa != "scalar" && __builtin_cpu_supports( "sse4.1" ) ){
+    SimdKernels k = SIMD_KERNEL_TABLE( simd_sse4, "sse4" );
+    return k;
+  }
+#endif
+  SimdKernels k = SIMD_KERNEL_TABLE( simd_scalar, "scalar" );
+  return k;
+}
+
+SimdKernels select_simd_kernels(){
+  // NN_SIMD overrides the automatic choice, e.g. NN_SIMD=scalar
+  const char * env = std::getenv( "NN_SIMD" );
+  return select_simd_kernels( env == nullptr ? "" : env );
+}
+
+SimdKernels simd = select_simd_kernels();
+
+#endif
@@ -0,0 +1,726 @@
+// kernel bodies shared by every instruction set in simd.hpp
+// this file has no include guard: simd.hpp includes it once per instruction
+// set, inside a namespace which provides
+//   V, W                       vector type and its number of lanes
+//   loadu, storeu, set1, zero  memory access and broadcast
+//   add, sub, mul, div, vmax_, vmin_, fmadd, vsqrt, vfloor
+//   hsum, hmax                 horizontal reductions
+//   pow2i                      2^n for an integral valued vector n
+//   mask_nonneg( z, d )        ( z < 0 ) ? 0 : d
+//   select_gt( a, b, x, y )    ( a > b ) ? x : y
+//   gather( p, i )             p[ i[0] ], ..., p[ i[W - 1] ]
+// the activation kernels are templates over the activation policies below,
+// so each (instruction set, activation) pair is its own loop without any
+// per element call
+
+inline V exp_v( V x ){
+  // Cephes expf: e^x = 2^n * e^r, |r| <= ln(2)/2
+  x = vmin_( vmax_( x, set1( -88.3762626647949f ) ), set1( 88.3762626647949f ) );
+  V n = vfloor( fmadd( x, set1( 1.44269504088896341f ), set1( 0.5f ) ) );
+  x = sub( x, mul( n, set1( 0.693359375f ) ) );
+  x = sub( x, mul( n, set1( -2.12194440e-4f ) ) );
+  V y = set1( 1.9875691500E-4f );
+  y = fmadd( y, x, set1( 1.3981999507E-3f ) );
+  y = fmadd( y, x, set1( 8.3334519073E-3f ) );
+  y = fmadd( y, x, set1( 4.1665795894E-2f ) );
+  y = fmadd( y, x, set1( 1.6666665459E-1f ) );
+  y = fmadd( y, x, set1( 5.0000001201E-1f ) );
+  y = fmadd( y, mul( x, x ), add( x, set1( 1.0f ) ) );
+  return mul( y, pow2i( n ) );
+}
+
+inline V sigmoid_v( V x ){
+  V one = set1( 1.0f );
+  return div( one, add( one, exp_v( sub( zero(), x ) ) ) );
+}
+
+F dot( int n, const F * x, const F * y ){
+  V s0 = zero(), s1 = zero();
+  int i = 0;
+  for(; i + 2 * W <= n; i += 2 * W){
+    s0 = fmadd( loadu( x + i ), loadu( y + i ), s0 );
+    s1 = fmadd( loadu( x + i + W ), loadu( y + i + W ), s1 );
+  }
+  for(; i + W <= n; i += W){
+    s0 = fmadd( loadu( x + i ), loadu( y + i ), s0 );
+  }
+  F r = hsum( add( s0, s1 ) );
+  for(; i < n; i++){
+    r += x[i] * y[i];
+  }
+  return r;
+}
+
+void axpy( int n, F a, const F * x, F * y ){
+  V va = set1( a );
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( y + i, fmadd( va, loadu( x + i ), loadu( y + i ) ) );
+  }
+  for(; i < n; i++){
+    y[i] += a * x[i];
+  }
+}
+
+void add_vec( int n, const F * x, F * y ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( y + i, add( loadu( y + i ), loadu( x + i ) ) );
+  }
+  for(; i < n; i++){
+    y[i] += x[i];
+  }
+}
+
+void add_scalar( int n, F a, const F * x, F * y ){
+  V va = set1( a );
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( y + i, add( loadu( x + i ), va ) );
+  }
+  for(; i < n; i++){
+    y[i] = x[i] + a;
+  }
+}
+
+void scale( int n, F a, F * x ){
+  V va = set1( a );
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( x + i, mul( loadu( x + i ), va ) );
+  }
+  for(; i < n; i++){
+    x[i] *= a;
+  }
+}
+
+// activation policies: f on a vector, and d * f'(u) given the unit value u
+// and the activated value a = f(u); fs / mul_dfs are the scalar versions
+struct IdActivation {
+  static V f( V u ){ return u; }
+  static V mul_df( V u, V a, V d ){ return d; }
+  static F fs( F u ){ return u; }
+  static F mul_dfs( F u, F a, F d ){ return d; }
+};
+struct ReLUActivation {
+  static V f( V u ){ return vmax_( u, zero() ); }
+  static V mul_df( V u, V a, V d ){ return mask_nonneg( u, d ); }
+  static F fs( F u ){ return std::max( F(0), u ); }
+  static F mul_dfs( F u, F a, F d ){ return ( u < 0 ) ? 0 : d; }
+};
+struct SigmoidActivation {
+  static V f( V u ){ return sigmoid_v( u ); }
+  static V mul_df( V u, V a, V d ){ return mul( d, mul( a, sub( set1( 1.0f ), a ) ) ); }
+  static F fs( F u ){ return 1.0 / ( 1.0 + std::exp( -u ) ); }
+  static F mul_dfs( F u, F a, F d ){ return d * a * ( 1 - a ); }
+};
+
+// a = f( y )
+template <class Act>
+void activate( int n, const F * y, F * a ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( a + i, Act::f( loadu( y + i ) ) );
+  }
+  for(; i < n; i++){
+    a[i] = Act::fs( y[i] );
+  }
+}
+
+// y += b, a = f( y )
+template <class Act>
+void bias_activate( int n, const F * b, F * y, F * a ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    V v = add( loadu( y + i ), loadu( b + i ) );
+    storeu( y + i, v );
+    storeu( a + i, Act::f( v ) );
+  }
+  for(; i < n; i++){
+    y[i] += b[i];
+    a[i] = Act::fs( y[i] );
+  }
+}
+
+// y = x + b, a = f( y ) for a scalar bias b
+template <class Act>
+void bias_scalar_activate( int n, F b, const F * x, F * y, F * a ){
+  V vb = set1( b );
+  int i = 0;
+  for(; i + W <= n; i += W){
+    V v = add( loadu( x + i ), vb );
+    storeu( y + i, v );
+    storeu( a + i, Act::f( v ) );
+  }
+  for(; i < n; i++){
+    y[i] = x[i] + b;
+    a[i] = Act::fs( y[i] );
+  }
+}
+
+// d *= f'( u ), a = f( u )
+template <class Act>
+void mul_activation_derivative( int n, const F * u, const F * a, F * d ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( d + i, Act::mul_df( loadu( u + i ), loadu( a + i ), loadu( d + i ) ) );
+  }
+  for(; i < n; i++){
+    d[i] = Act::mul_dfs( u[i], a[i], d[i] );
+  }
+}
+
+void exp( int n, const F * x, F * y ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( y + i, exp_v( loadu( x + i ) ) );
+  }
+  for(; i < n; i++){
+    y[i] = std::exp( x[i] );
+  }
+}
+
+void max_vec( int n, const F * x, F * y ){
+  int i = 0;
+  for(; i + W <= n; i += W){
+    storeu( y + i, vmax_( loadu( y + i ), loadu( x + i ) ) );
+  }
+  for(; i < n; i++){
+    y[i] = std::max( y[i], x[i] );
+  }
+}
+
+F max_reduce( int n, const F * x ){
+  F r = x[0];
+  int i = 0;
+  if( n >= W ){
+    V m = loadu( x );
+    for(i = W; i + W <= n; i += W){
+      m = vmax_( m, loadu( x + i ) );
+    }
+    r = hmax( m );
+  }
+  for(; i < n; i++){
+    r = std::max( r, x[i] );
+  }
+  return r;
+}
+
+// update rule policies ( see UpdateRule ): the new w from g = grad_scale grad,
+// updating the states s and d; applys is the scalar version
+// SGD       w -= lr g
+struct SgdUpdate {
+  static V apply( const UpdateStep & u, V g, V & s, V & d, V w ){
+    return fmadd( set1( -u.learning_rate ), g, w );
+  }
+  static F applys( const UpdateStep & u, F g, F & s, F & d, F w ){
+    return w - u.learning_rate * g;
+  }
+};
+// momentum  d = momentum d - lr g, w += d
+struct MomentumUpdate {
+  static V apply( const UpdateStep & u, V g, V & s, V & d, V w ){
+    d = fmadd( set1( u.momentum ), d, mul( set1( -u.learning_rate ), g ) );
+    return add( w, d );
+  }
+  static F applys( const UpdateStep & u, F g, F & s, F & d, F w ){
+    d = u.momentum * d - u.learning_rate * g;
+    return w + d;
+  }
+};
+// AdaGrad   s += g^2, d = momentum d - lr g / sqrt( max( s, 1 ) ), w += d
+struct AdagradUpdate {
+  static V apply( const UpdateStep & u, V g, V & s, V & d, V w ){
+    s = fmadd( g, g, s );
+    d = fmadd( set1( u.momentum ), d, div( mul( set1( -u.learning_rate ), g ), vsqrt( vmax_( s, set1( 1.0f ) ) ) ) );
+    return add( w, d );
+  }
+  static F applys( const UpdateStep & u, F g, F & s, F & d, F w ){
+    s += g * g;
+    d = - u.learning_rate * g / std::sqrt( std::max( s, (F)1.0 ) ) + u.momentum * d;
+    return w + d;
+  }
+};
+// Adam      d = beta1 d + ( 1 - beta1 ) g, s = beta2 s + ( 1 - beta2 ) g^2,
+//           w -= lr ( bias1 d ) / ( sqrt( bias2 s ) + epsilon ), beta1 = momentum
+struct AdamUpdate {
+  static V apply( const UpdateStep & u, V g, V & s, V & d, V w ){
+    d = fmadd( set1( u.momentum ), d, mul( set1( 1 - u.momentum ), g ) );
+    s = fmadd( set1( u.beta2 ), s, mul( set1( 1 - u.beta2 ), mul( g, g ) ) );
+    V r = add( vsqrt( mul( set1( u.bias2 ), s ) ), set1( u.epsilon ) );
+    return fmadd( set1( -u.learning_rate * u.bias1 ), div( d, r ), w );
+  }
+  static F applys( const UpdateStep & u, F g, F & s, F & d, F w ){
+    d = u.momentum * d + ( 1 - u.momentum ) * g;
+    s = u.beta2 * s + ( 1 - u.beta2 ) * g * g;
+    return w - u.learning_rate * u.bias1 * d / ( std::sqrt( u.bias2 * s ) + u.epsilon );
+  }
+};
+
+// w, s and d updated in one pass over the four arrays
+template <class Rule>
+void update( int n, const UpdateStep & u, const F * grad, F * s, F * d, F * w ){
+  V gs = set1( u.grad_scale );
+  int i = 0;
+  for(; i + W <= n; i += W){
+    V si = loadu( s + i ), di = loadu( d + i );
+    V wi = Rule::apply( u, mul( loadu( grad + i ), gs ), si, di, loadu( w + i ) );
+    storeu( s + i, si );
+    storeu( d + i, di );
+    storeu( w + i, wi );
+  }
+  for(; i < n; i++){
+    w[i] = Rule::applys( u, grad[i] * u.grad_scale, s[i], d[i], w[i] );
+  }
+}
+
+// s + l x, free when the constant l is 0 or +-1
+inline V winograd_madd( V s, F l, V x ){
+  if( l == 0 ) return s;
+  if( l == 1 ) return add( s, x );
+  if( l == -1 ) return sub( s, x );
+  return fmadd( set1( l ), x, s );
+}
+
+// Y = L X LT for a constant L = [ R x C ]; the loops are unrolled, so that
+// every element of L is folded into the code
+template <int R, int C>
+inline void winograd_sandwich( const F (&L)[R][C], const V (&X)[C][C], V (&Y)[R][R] ){
+  V T[R][C];
+#pragma GCC unroll 8
+  for(int i = 0; i < R; i++){
+#pragma GCC unroll 8
+    for(int j = 0; j < C; j++){
+      V s = zero();
+#pragma GCC unroll 8
+      for(int k = 0; k < C; k++){
+        s = winograd_madd( s, L[i][k], X[k][j] );
+      }
+      T[i][j] = s;
+    }
+  }
+#pragma GCC unroll 8
+  for(int i = 0; i < R; i++){
+#pragma GCC unroll 8
+    for(int j = 0; j < R; j++){
+      V s = zero();
+#pragma GCC unroll 8
+      for(int k = 0; k < C; k++){
+        s = winograd_madd( s, L[j][k], T[i][k] );
+      }
+      Y[i][j] = s;
+    }
+  }
+}
+
+// Y = LT X L
+template <int R, int C>
+inline void winograd_sandwich_t( const F (&L)[R][C], const V (&X)[R][R], V (&Y)[C][C] ){
+  V T[C][R];
+#pragma GCC unroll 8
+  for(int i = 0; i < C; i++){
+#pragma GCC unroll 8
+    for(int j = 0; j < R; j++){
+      V s = zero();
+#pragma GCC unroll 8
+      for(int k = 0; k < R; k++){
+        s = winograd_madd( s, L[k][i], X[k][j] );
+      }
+      T[i][j] = s;
+    }
+  }
+#pragma GCC unroll 8
+  for(int i = 0; i < C; i++){
+#pragma GCC unroll 8
+    for(int j = 0; j < C; j++){
+      V s = zero();
+#pragma GCC unroll 8
+      for(int k = 0; k < R; k++){
+        s = winograd_madd( s, L[k][j], T[i][k] );
+      }
+      Y[i][j] = s;
+    }
+  }
+}
+
+// Winograd transforms of one tile for n channels stored channel last, W at a
+// time, so n is rounded up to W ( see winograd.hpp )
+// pixel ( i, j ) of a tile is at i rs + j cs, transformed value xi at xi vs
+
+// v = BT d B
+template <int M>
+void winograd_input( int n, const F * d, int rs, int cs, F * v, long vs ){
+  const int A = Winograd<M>::ALPHA;
+  for(int c = 0; c < n; c += W){
+    V x[A][A], y[A][A];
+    for(int i = 0; i < A; i++){
+      for(int j = 0; j < A; j++){
+        x[i][j] = loadu( d + i * rs + j * cs + c );
+      }
+    }
+    winograd_sandwich( Winograd<M>::BT, x, y );
+    for(int xi = 0; xi < A * A; xi++){
+      storeu( v + xi * vs + c, y[ xi / A ][ xi % A ] );
+    }
+  }
+}
+
+// d += B v BT
+template <int M>
+void winograd_input_t( int n, const F * v, long vs, F * d, int rs, int cs ){
+  const int A = Winograd<M>::ALPHA;
+  for(int c = 0; c < n; c += W){
+    V x[A][A], y[A][A];
+    for(int xi = 0; xi < A * A; xi++){
+      x[ xi / A ][ xi % A ] = loadu( v + xi * vs + c );
+    }
+    winograd_sandwich_t( Winograd<M>::BT, x, y );
+    for(int i = 0; i < A; i++){
+      for(int j = 0; j < A; j++){
+        F * p = d + i * rs + j * cs + c;
+        storeu( p, add( loadu( p ), y[i][j] ) );
+      }
+    }
+  }
+}
+
+// y = AT m A
+template <int M>
+void winograd_output( int n, const F * m, long ms, F * y, int rs, int cs ){
+  const int A = Winograd<M>::ALPHA;
+  for(int c = 0; c < n; c += W){
+    V x[A][A], o[M][M];
+    for(int xi = 0; xi < A * A; xi++){
+      x[ xi / A ][ xi % A ] = loadu( m + xi * ms + c );
+    }
+    winograd_sandwich( Winograd<M>::AT, x, o );
+    for(int i = 0; i < M; i++){
+      for(int j = 0; j < M; j++){
+        storeu( y + i * rs + j * cs + c, o[i][j] );
+      }
+    }
+  }
+}
+
+// m = A y AT
+template <int M>
+void winograd_output_t( int n, const F * y, int rs, int cs, F * m, long ms ){
+  const int A = Winograd<M>::ALPHA;
+  for(int c = 0; c < n; c += W){
+    V x[M][M], o[A][A];
+    for(int i = 0; i < M; i++){
+      for(int j = 0; j < M; j++){
+        x[i][j] = loadu( y + i * rs + j * cs + c );
+      }
+    }
+    winograd_sandwich_t( Winograd<M>::AT, x, o );
+    for(int xi = 0; xi < A * A; xi++){
+      storeu( m + xi * ms + c, o[ xi / A ][ xi % A ] );
+    }
+  }
+}
+
+// channel blocked direct convolution ( see layer_2d.hpp ): images are
+// [ blocks x h x w x CHANNEL_BLOCK ], so a pixel of one block is one or more whole
+// vectors, and a vector holds the same pixel of CHANNEL_BLOCK output channels
+const int CHANNEL_BLOCK = W < 8 ? 8 : W;
+
+// RX consecutive output pixels of one block of output channels; in is the top left
+// input pixel of the first one, w the filters of the block [ cblocks x fs x fs x B x B ]
+// the lanes of the last input block past cin are skipped, they only hold zeros
+template <int RX>
+inline void conv_blocked_pixels( int cin, int fs, const F * in, int ph, int pw, const F * w, const F * bias, F * out ){
+  const int B = CHANNEL_BLOCK, NV = CHANNEL_BLOCK / W;
+  V acc[RX][NV];
+#pragma GCC unroll 8
+  for(int v = 0; v < NV; v++){
+    V b = bias == nullptr ? zero() : loadu( bias + v * W );
+#pragma GCC unroll 8
+    for(int r = 0; r < RX; r++){
+      acc[r][v] = b;
+    }
+  }
+  for(int cb = 0; cb * B < cin; cb++){
+    int lanes = std::min( B, cin - cb * B );
+    for(int s = 0; s < fs; s++){
+      for(int t = 0; t < fs; t++){
+        const F * ip = in + ( ( (long)cb * ph + s ) * pw + t ) * B;
+        const F * wp = w + ( ( (long)cb * fs + s ) * fs + t ) * B * B;
+        for(int ci = 0; ci < lanes; ci++){
+#pragma GCC unroll 8
+          for(int v = 0; v < NV; v++){
+            V wv = loadu( wp + ci * B + v * W );
+#pragma GCC unroll 8
+            for(int r = 0; r < RX; r++){
+              acc[r][v] = fmadd( set1( ip[ r * B + ci ] ), wv, acc[r][v] );
+            }
+          }
+        }
+      }
+    }
+  }
+#pragma GCC unroll 8
+  for(int r = 0; r < RX; r++){
+#pragma GCC unroll 8
+    for(int v = 0; v < NV; v++){
+      storeu( out + r * B + v * W, acc[r][v] );
+    }
+  }
+}
+
+// out[kb][y][x] = bias[kb] + sum_{ci,s,t} in[ci][y+s][x+t] w[kb][ci][s][t], the input of
+// cin channels [ cblocks = ceil( cin / B ) x ph x pw x B ] already padded, w [ kblocks x cblocks x fs x fs x B x B ]
+// with the output channel innermost, bias [ kblocks x B ] or nullptr for none
+void conv_blocked( int cin, int fs, const F * in, int ph, int pw, const F * w, const F * bias,
+                   int kblocks, int oh, int ow, F * out ){
+  const int B = CHANNEL_BLOCK;
+  long wsize = (long)( cin + B - 1 ) / B * fs * fs * B * B;
+  for(int kb = 0; kb < kblocks; kb++){
+    const F * b = bias == nullptr ? nullptr : bias + kb * B;
+    for(int y = 0; y < oh; y++){
+      F * o = out + ( (long)kb * oh + y ) * ow * B;
+      const F * ip = in + (long)y * pw * B;
+      int x = 0;
+      for(; x + 8 <= ow; x += 8){
+        conv_blocked_pixels<8>( cin, fs, ip + x * B, ph, pw, w + kb * wsize, b, o + x * B );
+      }
+      if( x < ow && ow >= 8 ){
+        // the last 8 pixels again rather than a tail bound by the FMA latency
+        conv_blocked_pixels<8>( cin, fs, ip + ( ow - 8 ) * B, ph, pw, w + kb * wsize, b, o + ( ow - 8 ) * B );
+        x = ow;
+      }
+      for(; x + 4 <= ow; x += 4){
+        conv_blocked_pixels<4>( cin, fs, ip + x * B, ph, pw, w + kb * wsize, b, o + x * B );
+      }
+      for(; x < ow; x++){
+        conv_blocked_pixels<1>( cin, fs, ip + x * B, ph, pw, w + kb * wsize, b, o + x * B );
+      }
+    }
+  }
+}
+
+// CJ input channels against a block of output channels, over XU pixels at a time so
+// that there are always 8 independent sums
+template <int CJ>
+inline void conv_blocked_gradient_lanes( const F * in, const F * d, int oh, int ow, int pw, int dw_, F * g ){
+  const int B = CHANNEL_BLOCK, NV = CHANNEL_BLOCK / W, XU = 8 / CJ;
+  V acc[XU][CJ][NV];
+#pragma GCC unroll 8
+  for(int u = 0; u < XU; u++){
+#pragma GCC unroll 8
+    for(int j = 0; j < CJ; j++){
+#pragma GCC unroll 8
+      for(int v = 0; v < NV; v++){
+        acc[u][j][v] = zero();
+      }
+    }
+  }
+  for(int y = 0; y < oh; y++){
+    const F * dp = d + (long)y * dw_ * B;
+    const F * ip = in + (long)y * pw * B;
+    int x = 0;
+    for(; x + XU <= ow; x += XU){
+#pragma GCC unroll 8
+      for(int u = 0; u < XU; u++){
+#pragma GCC unroll 8
+        for(int v = 0; v < NV; v++){
+          V dv = loadu( dp + ( x + u ) * B + v * W );
+#pragma GCC unroll 8
+          for(int j = 0; j < CJ; j++){
+            acc[u][j][v] = fmadd( set1( ip[ ( x + u ) * B + j ] ), dv, acc[u][j][v] );
+          }
+        }
+      }
+    }
+    for(; x < ow; x++){
+#pragma GCC unroll 8
+      for(int v = 0; v < NV; v++){
+        V dv = loadu( dp + x * B + v * W );
+#pragma GCC unroll 8
+        for(int j = 0; j < CJ; j++){
+          acc[0][j][v] = fmadd( set1( ip[ x * B + j ] ), dv, acc[0][j][v] );
+        }
+      }
+    }
+  }
+#pragma GCC unroll 8
+  for(int j = 0; j < CJ; j++){
+#pragma GCC unroll 8
+    for(int v = 0; v < NV; v++){
+      V sum = acc[0][j][v];
+#pragma GCC unroll 8
+      for(int u = 1; u < XU; u++){
+        sum = add( sum, acc[u][j][v] );
+      }
+      F * p = g + j * B + v * W;
+      storeu( p, add( loadu( p ), sum ) );
+    }
+  }
+}
+
+// dw[kb][ci][s][t] += sum_{y,x} in[ci][y+s][x+t] d[kb][y][x], the gradient of conv_blocked;
+// the oh x ow pixels of d start at d in blocks of dh x dw_ pixels
+void conv_blocked_gradient( int cin, int fs, const F * in, int ph, int pw, const F * d, int dh, int dw_,
+                            int kblocks, int oh, int ow, F * dw ){
+  const int B = CHANNEL_BLOCK;
+  int cblocks = ( cin + B - 1 ) / B;
+  for(int kb = 0; kb < kblocks; kb++){
+    const F * dp = d + (long)kb * dh * dw_ * B;
+    for(int cb = 0; cb < cblocks; cb++){
+      int lanes = std::min( B, cin - cb * B );
+      for(int s = 0; s < fs; s++){
+        for(int t = 0; t < fs; t++){
+          F * g = dw + ( ( ( (long)kb * cblocks + cb ) * fs + s ) * fs + t ) * B * B;
+          const F * ip = in + ( ( (long)cb * ph + s ) * pw + t ) * B;
+          int c = 0;
+          for(; c + 8 <= lanes; c += 8){
+            conv_blocked_gradient_lanes<8>( ip + c, dp, oh, ow, pw, dw_, g + c * B );
+          }
+          for(; c + 4 <= lanes; c += 4){
+            conv_blocked_gradient_lanes<4>( ip + c, dp, oh, ow, pw, dw_, g + c * B );
+          }
+          for(; c < lanes; c++){
+            conv_blocked_gradient_lanes<1>( ip + c, dp, oh, ow, pw, dw_, g + c * B );
+          }
+        }
+      }
+    }
+  }
+}
+
+// max pooling of one window of channel blocked pixels: for each of the CHANNEL_BLOCK
+// lanes, m = the max over the wh rows ( at rows[r] ) of ww pixels cs apart, and
+// arg = k0 + r ps + c of its first position, as a float
+void max_window( const F * const * rows, int wh, int ww, int cs, int k0, int ps, F * m, F * arg ){
+  const int NV = CHANNEL_BLOCK / W;
+  V mv[NV], av[NV];
+#pragma GCC unroll 8
+  for(int v = 0; v < NV; v++){
+    mv[v] = loadu( rows[0] + v * W );
+    av[v] = set1( k0 );
+  }
+  for(int r = 0; r < wh; r++){
+    for(int c = r == 0 ? 1 : 0; c < ww; c++){
+      V k = set1( k0 + r * ps + c );
+#pragma GCC unroll 8
+      for(int v = 0; v < NV; v++){
+        V x = loadu( rows[r] + c * cs + v * W );
+        av[v] = select_gt( x, mv[v], k, av[v] );
+        mv[v] = vmax_( mv[v], x );
+      }
+    }
+  }
+#pragma GCC unroll 8
+  for(int v = 0; v < NV; v++){
+    storeu( m + v * W, mv[v] );
+    storeu( arg + v * W, av[v] );
+  }
+}
+
+// block sparse y += A x ( see sparse.hpp ): row block i, rows B i, ..., B i + B - 1,
+// has the blocks ptr[i], ..., ptr[i + 1] - 1, block b holding the B values
+// v[ B b ], ... of column col[b]; only the rows < rows are written, B = 1 is CSR
+// two accumulators per row block, so that consecutive blocks do not wait on each other
+template <int B>
+void sparse_gemv( int rows, const int * ptr, const int * col, const F * v, const F * x, F * y ){
+  const int NV = B >= W ? B / W : 1;
+  int row_blocks = ( rows + B - 1 ) / B;
+  for(int i = 0; i < row_blocks; i++){
+    int b = ptr[i], e = ptr[i + 1];
+    F sum[B];
+    if( B == 1 ){
+      // W values at a time, their inputs gathered
+      V acc0 = zero(), acc1 = zero();
+      for(; b + 2 * W <= e; b += 2 * W){
+        acc0 = fmadd( loadu( v + b ), gather( x, col + b ), acc0 );
+        acc1 = fmadd( loadu( v + b + W ), gather( x, col + b + W ), acc1 );
+      }
+      for(; b + W <= e; b += W){
+        acc0 = fmadd( loadu( v + b ), gather( x, col + b ), acc0 );
+      }
+      F s = hsum( add( acc0, acc1 ) );
+      for(; b < e; b++){
+        s += v[b] * x[ col[b] ];
+      }
+      sum[0] = s;
+    }else if( B >= W ){
+      // a block is whole vectors
+      V acc0[NV], acc1[NV];
+#pragma GCC unroll 8
+      for(int k = 0; k < NV; k++){
+        acc0[k] = zero();
+        acc1[k] = zero();
+      }
+      for(; b + 2 <= e; b += 2){
+        V x0 = set1( x[ col[b] ] ), x1 = set1( x[ col[b + 1] ] );
+#pragma GCC unroll 8
+        for(int k = 0; k < NV; k++){
+          acc0[k] = fmadd( x0, loadu( v + (long)b * B + k * W ), acc0[k] );
+          acc1[k] = fmadd( x1, loadu( v + (long)( b + 1 ) * B + k * W ), acc1[k] );
+        }
+      }
+      if( b < e ){
+        V x0 = set1( x[ col[b] ] );
+#pragma GCC unroll 8
+        for(int k = 0; k < NV; k++){
+          acc0[k] = fmadd( x0, loadu( v + (long)b * B + k * W ), acc0[k] );
+        }
+      }
+#pragma GCC unroll 8
+      for(int k = 0; k < NV; k++){
+        storeu( sum + k * W, add( acc0[k], acc1[k] ) );
+      }
+    }else{
+      // a block is narrower than a vector
+      F s0[B], s1[B];
+      for(int r = 0; r < B; r++){
+        s0[r] = 0;
+        s1[r] = 0;
+      }
+      for(; b + 2 <= e; b += 2){
+        F x0 = x[ col[b] ], x1 = x[ col[b + 1] ];
+        const F * v0 = v + (long)b * B;
+#pragma GCC unroll 8
+        for(int r = 0; r < B; r++){
+          s0[r] += x0 * v0[r];
+          s1[r] += x1 * v0[ B + r ];
+        }
+      }
+      if( b < e ){
+        F x0 = x[ col[b] ];
+#pragma GCC unroll 8
+        for(int r = 0; r < B; r++){
+          s0[r] += x0 * v[ (long)b * B + r ];
+        }
+      }
+      for(int r = 0; r < B; r++){
+        sum[r] = s0[r] + s1[r];
+      }
+    }
+    int n = std::min( B, rows - i * B );
+    for(int r = 0; r < n; r++){
+      y[ i * B + r ] += sum[r];
+    }
+  }
+}
+
+// flags[b] = 1 for the blocks x[ block b, block ( b + 1 ) ) of x[ 0, n ) holding a
+// nonzero, or with nonneg a value >= 0 ( see live_spans in sparse.hpp ); flagged
+// blocks are not read again
+void mark_blocks( int n, int block, const F * x, bool nonneg, uint8_t * flags ){
+  for(int b = 0; b * block < n; b++){
+    if( flags[b] ) continue;
+    int i = b * block, e = std::min( n, i + block );
+    // the largest value, or the largest magnitude
+    V m = set1( -1 );
+    for(; i + W <= e; i += W){
+      V v = loadu( x + i );
+      m = vmax_( m, nonneg ? v : vmax_( v, sub( zero(), v ) ) );
+    }
+    F s = hmax( m );
+    for(; i < e; i++){
+      s = std::max( s, nonneg ? x[i] : std::abs( x[i] ) );
+    }
+    flags[b] = nonneg ? s >= 0 : s > 0;
+  }
+}
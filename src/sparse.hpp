@@ -0,0 +1,199 @@
+#ifndef SPARSE
+#define SPARSE
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include "common.hpp"
+#include "simd.hpp"
+
+// pruned weight matrices; a group is block consecutive rows of one column, the unit
+// of pruning, so that the kept weights form blocks of block x 1 ( block = 1 is CSR ),
+// and the spans of the columns met by sparse activations
+
+// the block heights of simd.sparse_gemv
+inline int sparse_block_index( int block ){
+  if( block == 1 ) return 0;
+  if( block == 4 ) return 1;
+  if( block == 8 ) return 2;
+  throw "sparse blocks are of 1, 4 or 8 rows, not " + std::to_string( block );
+}
+
+// a [ rows x cols ] matrix kept as its blocks holding any element of keep
+// row block i ( rows block i, ..., block i + block - 1 ) has the blocks
+// ptr[i], ..., ptr[i + 1] - 1, block b being the values[ block b ], ... of column
+// col[b], with zeros past the last row
+class SparseMatrix {
+public:
+  int rows, cols, block;
+  std::vector<int> ptr, col;
+  vec values;
+
+  SparseMatrix() : rows( 0 ), cols( 0 ), block( 1 ) { }
+  // the blocks from keep, one flag per element of the row-major matrix
+  void set_structure( int r, int c, int b, const std::vector<uint8_t> & keep ){
+    sparse_block_index( b );
+    rows = r;
+    cols = c;
+    block = b;
+    int row_blocks = ( rows + block - 1 ) / block;
+    ptr.assign( 1, 0 );
+    col.clear();
+    for(int i = 0; i < row_blocks; i++){
+      for(int j = 0; j < cols; j++){
+        bool kept = false;
+        for(int k = i * block; k < std::min( rows, ( i + 1 ) * block ); k++){
+          kept = kept || keep[ (size_t)k * cols + j ];
+        }
+        if( kept ){
+          col.push_back( j );
+        }
+      }
+      ptr.push_back( col.size() );
+    }
+    values.assign( col.size() * block, 0 );
+  }
+  // the values of the blocks from the dense row-major w
+  void set_values( const F * w ){
+    int row_blocks = ( rows + block - 1 ) / block;
+    for(int i = 0; i < row_blocks; i++){
+      for(int b = ptr[i]; b < ptr[i + 1]; b++){
+        for(int r = 0; r < block; r++){
+          int k = i * block + r;
+          values[ (size_t)b * block + r ] = k < rows ? w[ (size_t)k * cols + col[b] ] : 0;
+        }
+      }
+    }
+  }
+  size_t blocks() const {
+    return col.size();
+  }
+  // the elements in blocks, without the zeros past the last row
+  size_t kept() const {
+    size_t n = 0;
+    for(int i = 0; i + 1 < ptr.size(); i++){
+      n += (size_t)( ptr[i + 1] - ptr[i] ) * std::min( block, rows - i * block );
+    }
+    return n;
+  }
+  // zeros the elements of the dense row-major w outside the blocks, walking the gaps
+  // between the kept columns of each row block; the kept elements are not touched, so
+  // that other threads updating them concurrently lose nothing
+  void zero_pruned( F * w ) const {
+    int row_blocks = ( rows + block - 1 ) / block;
+    for(int i = 0; i < row_blocks; i++){
+      for(int k = i * block; k < std::min( rows, ( i + 1 ) * block ); k++){
+        F * row = w + (size_t)k * cols;
+        int end = 0; // past the last kept column
+        for(int b = ptr[i]; b < ptr[i + 1]; b++){
+          std::fill( row + end, row + col[b], (F)0 );
+          end = col[b] + 1;
+        }
+        std::fill( row + end, row + cols, (F)0 );
+      }
+    }
+  }
+  // y += A x
+  void gemv( const F * x, F * y ) const {
+    simd.sparse_gemv[ sparse_block_index( block ) ]( rows, ptr.data(), col.data(), values.data(), x, y );
+  }
+};
+
+// the sum of squares of every group of w = [ rows x cols ], group ( i, j ) at i cols + j
+vec group_norms( int rows, int cols, int block, const F * w ){
+  vec norms( (size_t)( ( rows + block - 1 ) / block ) * cols, 0 );
+  for(int k = 0; k < rows; k++){
+    F * n = &norms[ (size_t)( k / block ) * cols ];
+    for(int j = 0; j < cols; j++){
+      n[j] += w[ (size_t)k * cols + j ] * w[ (size_t)k * cols + j ];
+    }
+  }
+  return norms;
+}
+
+// magnitude pruning: the flags of the elements of w = [ rows x cols ] kept when the
+// fraction sparsity of the groups with the smallest sums of squares is removed
+std::vector<uint8_t> magnitude_mask( int rows, int cols, int block, const F * w, F sparsity ){
+  vec norms = group_norms( rows, cols, block, w );
+  size_t pruned = (size_t)std::max( 0.0, std::min( (double)norms.size(), (double)sparsity * norms.size() + 0.5 ) );
+  // ties are broken by position, so that the mask does not depend on the sort
+  std::vector<int> order( norms.size() );
+  std::iota( order.begin(), order.end(), 0 );
+  std::nth_element( order.begin(), order.begin() + pruned, order.end(), [&]( int a, int b ){
+      return norms[a] < norms[b] || ( norms[a] == norms[b] && a < b );
+    } );
+  std::vector<uint8_t> group( norms.size(), 1 ), keep( (size_t)rows * cols );
+  for(size_t g = 0; g < pruned; g++){
+    group[ order[g] ] = 0;
+  }
+  for(int k = 0; k < rows; k++){
+    for(int j = 0; j < cols; j++){
+      keep[ (size_t)k * cols + j ] = group[ (size_t)( k / block ) * cols + j ];
+    }
+  }
+  return keep;
+}
+
+// the fraction of the groups of w = [ rows x cols ] whose elements are all zero
+F zero_groups( int rows, int cols, int block, const F * w ){
+  vec norms = group_norms( rows, cols, block, w );
+  return (F)std::count( norms.begin(), norms.end(), (F)0 ) / norms.size();
+}
+
+// sparse activations: a mini-batch x = [ n x cols ] only meets the columns of a weight
+// matrix where some sample is live ( nonzero, or with a nonzero derivative ); they are
+// taken in spans of whole blocks of SPAN_COLUMNS columns, a cache line, since skipping
+// less saves no memory traffic and would leave the vector kernels short tails
+const int SPAN_COLUMNS = 16;
+
+// the number of column blocks of cols columns
+inline int span_blocks( int cols ){
+  return ( cols + SPAN_COLUMNS - 1 ) / SPAN_COLUMNS;
+}
+
+// spans = b0, e0, b1, e1, ... the runs of the flagged column blocks, clipped to cols;
+// with bridge a single unflagged block between two runs is taken in, splitting a span
+// there costs more than its columns; returns the columns covered
+int block_spans( int cols, const std::vector<uint8_t> & blocks, std::vector<int> & spans, bool bridge = true ){
+  spans.clear();
+  int covered = 0, n = span_blocks( cols );
+  for(int k = 0; k < n; ){
+    if( !blocks[k] ){
+      k++;
+      continue;
+    }
+    int b = k;
+    while( k < n && ( blocks[k] || ( bridge && k + 1 < n && blocks[k + 1] ) ) ) k++;
+    spans.push_back( b * SPAN_COLUMNS );
+    spans.push_back( std::min( cols, k * SPAN_COLUMNS ) );
+    covered += spans.back() - spans[ spans.size() - 2 ];
+  }
+  return covered;
+}
+
+// the spans of the columns of x = [ n x cols ] where some sample is nonzero, or with
+// nonneg >= 0 ( a ReLU's derivative is zero below 0 only ), blocks being scratch space
+// of span_blocks( cols ) flags; returns the columns covered
+int live_spans( int n, int cols, const F * x, bool nonneg, std::vector<uint8_t> & blocks, std::vector<int> & spans ){
+  std::fill( blocks.begin(), blocks.end(), 0 );
+  for(int k = 0; k < n; k++){
+    simd.mark_blocks( cols, SPAN_COLUMNS, x + (size_t)k * cols, nonneg, blocks.data() );
+  }
+  return block_spans( cols, blocks, spans );
+}
+
+// flags[k] = f for the column blocks k of spans
+void mark_spans( const std::vector<int> & spans, std::vector<uint8_t> & flags, uint8_t f ){
+  for(int k = 0; k + 1 < spans.size(); k += 2){
+    std::fill( flags.begin() + spans[k] / SPAN_COLUMNS, flags.begin() + span_blocks( spans[k + 1] ), f );
+  }
+}
+
+// the spans of the columns in the spans a or b, into b
+int merge_spans( int cols, const std::vector<int> & a, std::vector<int> & b, std::vector<uint8_t> & blocks ){
+  std::fill( blocks.begin(), blocks.end(), 0 );
+  mark_spans( a, blocks, 1 );
+  mark_spans( b, blocks, 1 );
+  return block_spans( cols, blocks, b );
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef THREADPOOL
+#define THREADPOOL
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// a fixed set of threads running the tasks 0, ..., tasks-1 of one job at a time
+// the calling thread takes part in the job, so a pool of size n starts n-1 threads
+class ThreadPool {
+public:
+  ThreadPool( int n ){
+    if( n < 1 ) n = 1;
+    stopping = false;
+    generation = 0;
+    busy = 0;
+    for(int i = 0; i < n - 1; i++){
+      workers.push_back( std::thread( &ThreadPool::worker_loop, this ) );
+    }
+  }
+  ~ThreadPool(){
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      stopping = true;
+    }
+    wake.notify_all();
+    for(int i = 0; i < workers.size(); i++){
+      workers[i].join();
+    }
+  }
+  int size(){
+    return workers.size() + 1;
+  }
+  // calls job(0), ..., job(tasks-1) in parallel and returns when all of them are done
+  void run( int tasks, std::function<void(int)> job ){
+    if( tasks <= 0 ) return;
+    if( workers.empty() || tasks == 1 ){
+      for(int i = 0; i < tasks; i++) job( i );
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      current_job = job;
+      task_count = tasks;
+      next_task = 0;
+      busy = workers.size();
+      generation++;
+    }
+    wake.notify_all();
+    run_tasks();
+    std::unique_lock<std::mutex> lock( mutex );
+    done.wait( lock, [this]{ return busy == 0; } );
+  }
+private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::function<void(int)> current_job;
+  std::atomic<int> next_task;
+  int task_count;
+  int busy;
+  long generation;
+  bool stopping;
+
+  void run_tasks(){
+    int i;
+    while( ( i = next_task++ ) < task_count ){
+      current_job( i );
+    }
+  }
+  void worker_loop(){
+    long seen = 0;
+    while( true ){
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        wake.wait( lock, [&]{ return stopping || generation != seen; } );
+        if( stopping ) return;
+        seen = generation;
+      }
+      run_tasks();
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        busy--;
+      }
+      done.notify_one();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef TRAINER
+#define TRAINER
+#include <thread>
+#include "common.hpp"
+#include "thread_pool.hpp"
+#include "optimizer.hpp"
+#include "layer/layer.hpp"
+
+enum ParallelMode {
+  // gradients of all workers are summed with a fixed tree, then one update
+  // is taken on the master network, split over the workers; results only
+  // depend on the number of workers, not on thread timing
+  SYNCHRONOUS_PARALLEL,
+  // every worker applies its own gradient to the master network as soon as it
+  // is ready, without any lock (Hogwild!); updates of different workers may
+  // interleave and overwrite each other; only the raw parameters are written by
+  // the workers, what the layers derive from them is rebuilt once all are done
+  HOGWILD_PARALLEL
+};
+
+// data-parallel training: every mini-batch is split over a pool of workers,
+// each running its shard through the one shared network with its own
+// ExecutionContext
+// Input is InputLayer or InputLayer2D
+template <class Input>
+class DataParallelTrainer {
+public:
+  DataParallelTrainer( Input & input_layer, int threads, ParallelMode m = SYNCHRONOUS_PARALLEL ) : pool( threads ){
+    mode = m;
+    profiler = nullptr;
+    input = &input_layer;
+    for(int k = 0; k < pool.size(); k++){
+      contexts.push_back( new ExecutionContext( input ) );
+    }
+    layers = contexts[0]->layers;
+  }
+  ~DataParallelTrainer(){
+    for(int k = 0; k < contexts.size(); k++){
+      delete contexts[k];
+    }
+  }
+  int threads(){
+    return pool.size();
+  }
+  // times the phases of every worker ( see profiler.hpp ), nullptr stops
+  void set_profiler( Profiler * p ){
+    profiler = p;
+    for(int k = 0; k < contexts.size(); k++){
+      contexts[k]->profiler = p;
+    }
+  }
+  // one training step on the mini-batch data with targets target,
+  // AdaGrad with momentum
+  void one_step( std::vector<vec> & data, std::vector<vec> & target, F learning_rate, F momentum ){
+    AdagradStep update = { this, learning_rate, momentum };
+    one_step( data, target, update );
+  }
+  // one training step on a batch of a BatchPipeline; the shards are read from its buffers
+  void one_step( const Batch & b, F learning_rate, F momentum ){
+    AdagradStep update = { this, learning_rate, momentum };
+    one_step( b, update );
+  }
+  // the same with the rule of opt
+  void one_step( std::vector<vec> & data, std::vector<vec> & target, Optimizer & opt ){
+    OptimizerStep update = { &opt };
+    one_step( data, target, update );
+  }
+  void one_step( const Batch & b, Optimizer & opt ){
+    OptimizerStep update = { &opt };
+    one_step( b, update );
+  }
+  // runs job( ctx, k ) for k = 0, ..., tasks-1 on the pool, each worker with
+  // its own context of the network; parameters must not change meanwhile
+  void run( int tasks, std::function<void( ExecutionContext &, int )> job ){
+    std::atomic<int> next( 0 );
+    pool.run( contexts.size(), [&]( int w ){
+        int k;
+        while( ( k = next++ ) < tasks ){
+          job( *contexts[w], k );
+        }
+      } );
+  }
+private:
+  ParallelMode mode;
+  ThreadPool pool;
+  Profiler * profiler;
+  Input * input;
+  std::vector<Layer *> layers;
+  std::vector<ExecutionContext *> contexts;
+
+  // the update of the parameters from the grads of a context, split over pool when given;
+  // updates_applied follows once every update of the step is in
+  struct AdagradStep {
+    DataParallelTrainer * trainer;
+    F learning_rate, momentum;
+    void operator()( ExecutionContext & ctx, F grad_scale, ThreadPool * pool ){
+      for(int i = 0; i < trainer->layers.size(); i++){
+        trainer->layers[i]->update_parameters( ctx, learning_rate, momentum, grad_scale );
+      }
+    }
+  };
+  struct OptimizerStep {
+    Optimizer * opt;
+    void operator()( ExecutionContext & ctx, F grad_scale, ThreadPool * pool ){
+      opt->update( ctx, grad_scale, pool );
+    }
+  };
+
+  template <class Update>
+  void one_step( std::vector<vec> & data, std::vector<vec> & target, Update & update ){
+    step( data.size(), update, [&]( ExecutionContext & ctx, int begin, int end ){
+        input->propagate( ctx, &data[ begin ], end - begin );
+        layers.back()->set_target( ctx, &target[ begin ], end - begin );
+      } );
+  }
+  template <class Update>
+  void one_step( const Batch & b, Update & update ){
+    int in_units = layers.front()->units, out_units = layers.back()->units;
+    step( b.size, update, [&]( ExecutionContext & ctx, int begin, int end ){
+        input->propagate( ctx, &b.data[ begin * in_units ], end - begin );
+        layers.back()->set_target( ctx, &b.target[ begin * out_units ], end - begin );
+      } );
+  }
+  // load( ctx, begin, end ) puts the samples [ begin, end ) and their targets into ctx
+  // the jobs are passed to the pool by reference, so that a step makes no heap allocation
+  template <class Update, class Load>
+  void step( int n, Update & update, Load load ){
+    int workers = std::min( (int)contexts.size(), n );
+    if( mode == HOGWILD_PARALLEL ){
+      auto job = [&]( int k ){
+        int begin = n * k / workers, end = n * ( k + 1 ) / workers;
+        load( *contexts[k], begin, end );
+        compute_gradient( *contexts[k] );
+        update( *contexts[k], (F)1.0 / ( end - begin ), nullptr );
+      };
+      pool.run( workers, std::ref( job ) );
+      updates_applied( workers );
+      step_done();
+      return;
+    }
+    auto job = [&]( int k ){
+      int begin = n * k / workers, end = n * ( k + 1 ) / workers;
+      load( *contexts[k], begin, end );
+      compute_gradient( *contexts[k] );
+    };
+    pool.run( workers, std::ref( job ) );
+    // pairwise tree reduction into context 0
+    for(int stride = 1; stride < workers; stride *= 2){
+      int pairs = ( workers + 2 * stride - 1 ) / ( 2 * stride );
+      auto reduce = [&]( int i ){
+        int a = 2 * stride * i, b = a + stride;
+        if( b < workers ) add_gradient( *contexts[b], *contexts[a] );
+      };
+      pool.run( pairs, std::ref( reduce ) );
+    }
+    update( *contexts[0], (F)1.0 / n, &pool );
+    updates_applied( 1 );
+    step_done();
+  }
+  // the layers rebuild what derives from their parameters, on this thread, after the
+  // updates of the first n contexts
+  void updates_applied( int n ){
+    for(int i = 0; i < layers.size(); i++){
+      if( !layers[i]->cached_parameters().empty() ){
+        layers[i]->updates_applied( contexts.data(), n );
+      }
+    }
+  }
+  void step_done(){
+    if( profiler != nullptr ){
+      profiler->step_done();
+    }
+  }
+  // the samples and targets are already in ctx
+  void compute_gradient( ExecutionContext & ctx ){
+    layers.back()->back_propagate( ctx );
+    for(int i = 0; i < layers.size(); i++){
+      if( !layers[i]->cached_parameters().empty() ){
+        layers[i]->run_step( ctx, GRADIENT_STEP );
+      }
+    }
+  }
+  // gradients of context from are added to those of context to
+  void add_gradient( ExecutionContext & from, ExecutionContext & to ){
+    for(int i = 0; i < layers.size(); i++){
+      layers[i]->add_gradient( *from.states[i], *to.states[i] );
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef WINOGRAD
+#define WINOGRAD
+#include "common.hpp"
+
+// Winograd minimal filtering F(m x m, 3 x 3) for stride 1 convolutions
+// an input tile d of alpha x alpha pixels ( alpha = m + 2 ) and a 3 x 3 filter g
+// give the m x m outputs
+//   Y = AT [ ( G g GT ) * ( BT d B ) ] A
+// where * is elementwise, so alpha^2 products replace 9 m^2 multiplications
+// summed over the channels, the elementwise products of all tiles become
+// alpha^2 independent GEMMs, one per position xi of the transformed tile
+// tiles are transformed channel last, one vector of channels at a time
+// ( SimdKernels::winograd_* ), into [ alpha^2 x tiles x ldc ]; the channels
+// are padded to ldc = winograd_lanes( channels ) with zeros, so that the
+// kernels never need a scalar tail
+template <int M> struct Winograd;
+
+template <> struct Winograd<2> {
+  static const int ALPHA = 4;
+  static const F BT[4][4];
+  static const F G[4][3];
+  static const F AT[2][4];
+};
+const F Winograd<2>::BT[4][4] = {
+  { 1,  0, -1,  0 },
+  { 0,  1,  1,  0 },
+  { 0, -1,  1,  0 },
+  { 0,  1,  0, -1 } };
+const F Winograd<2>::G[4][3] = {
+  { 1,    0,   0   },
+  { 0.5,  0.5, 0.5 },
+  { 0.5, -0.5, 0.5 },
+  { 0,    0,   1   } };
+const F Winograd<2>::AT[2][4] = {
+  { 1, 1,  1,  0 },
+  { 0, 1, -1, -1 } };
+
+template <> struct Winograd<4> {
+  static const int ALPHA = 6;
+  static const F BT[6][6];
+  static const F G[6][3];
+  static const F AT[4][6];
+};
+const F Winograd<4>::BT[6][6] = {
+  { 4,  0, -5,  0, 1, 0 },
+  { 0, -4, -4,  1, 1, 0 },
+  { 0,  4, -4, -1, 1, 0 },
+  { 0, -2, -1,  2, 1, 0 },
+  { 0,  2, -1, -2, 1, 0 },
+  { 0,  4,  0, -5, 0, 1 } };
+const F Winograd<4>::G[6][3] = {
+  {  1.0 / 4,   0,          0         },
+  { -1.0 / 6,  -1.0 / 6,   -1.0 / 6   },
+  { -1.0 / 6,   1.0 / 6,   -1.0 / 6   },
+  {  1.0 / 24,  1.0 / 12,   1.0 / 6   },
+  {  1.0 / 24, -1.0 / 12,   1.0 / 6   },
+  {  0,         0,          1         } };
+const F Winograd<4>::AT[4][6] = {
+  { 1, 1,  1, 1,  1, 0 },
+  { 0, 1, -1, 2, -2, 0 },
+  { 0, 1,  1, 4,  4, 0 },
+  { 0, 1, -1, 8, -8, 1 } };
+
+// channels rounded up to the widest vector
+inline int winograd_lanes( int channels ){
+  return ( channels + 15 ) / 16 * 16;
+}
+
+// U[ xi ][ c ][ k ] = G g[k][c] GT for the filters g = [ K x C x 3 x 3 ],
+// U = [ alpha^2 x ldc x ldk ]
+template <int M>
+void winograd_filter( const F * g, int K, int C, F * U, int ldc, int ldk ){
+  const int A = Winograd<M>::ALPHA;
+  const F (&G)[A][3] = Winograd<M>::G;
+  std::fill( U, U + A * A * ldc * ldk, (F)0 );
+  for(int k = 0; k < K; k++){
+    for(int c = 0; c < C; c++){
+      const F * x = g + ( k * C + c ) * 9;
+      F t[A][3];
+      for(int i = 0; i < A; i++){
+        for(int j = 0; j < 3; j++){
+          t[i][j] = G[i][0] * x[j] + G[i][1] * x[ 3 + j ] + G[i][2] * x[ 6 + j ];
+        }
+      }
+      for(int i = 0; i < A; i++){
+        for(int j = 0; j < A; j++){
+          U[ ( ( i * A + j ) * ldc + c ) * ldk + k ] = t[i][0] * G[j][0] + t[i][1] * G[j][1] + t[i][2] * G[j][2];
+        }
+      }
+    }
+  }
+}
+
+// grad[k][c] = GT dU[ xi ][ c ][ k ] G, the gradient of the filters from that of U
+template <int M>
+void winograd_filter_t( const F * dU, int K, int C, int ldc, int ldk, F * grad ){
+  const int A = Winograd<M>::ALPHA;
+  const F (&G)[A][3] = Winograd<M>::G;
+  for(int k = 0; k < K; k++){
+    for(int c = 0; c < C; c++){
+      F t[3][A];
+      for(int i = 0; i < 3; i++){
+        for(int j = 0; j < A; j++){
+          F s = 0;
+          for(int l = 0; l < A; l++){
+            s += G[l][i] * dU[ ( ( l * A + j ) * ldc + c ) * ldk + k ];
+          }
+          t[i][j] = s;
+        }
+      }
+      F * y = grad + ( k * C + c ) * 9;
+      for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 3; j++){
+          F s = 0;
+          for(int l = 0; l < A; l++){
+            s += t[i][l] * G[l][j];
+          }
+          y[ i * 3 + j ] = s;
+        }
+      }
+    }
+  }
+}
+
+#endif